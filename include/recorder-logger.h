@@ -64,6 +64,24 @@ typedef struct CallSignature_t {
     UT_hash_handle hh;
 } CallSignature;
 
+/*
+ * Rank templates in call signature arguments
+ * (see iopr_interprocess()). An argument that starts
+ * with RECORDER_TEMPLATE_MARK is instantiated per rank
+ * by the reader:
+ *
+ *   MARK 'A' a ',' b      ->  a*rank+b
+ *   MARK 'G' P ',' a ',' c ',' b
+ *                         ->  a*(rank/P) + c*(rank%P) + b
+ *   MARK 'S' w ',' text   ->  text with every RECORDER_TEMPLATE_RANK
+ *                             replaced by the rank, zero-padded to w digits
+ */
+#define RECORDER_TEMPLATE_MARK      '\x1f'
+#define RECORDER_TEMPLATE_AFFINE    'A'
+#define RECORDER_TEMPLATE_GRID      'G'
+#define RECORDER_TEMPLATE_STRING    'S'
+#define RECORDER_TEMPLATE_RANK      '\x1e'
+
 
 typedef struct RecorderMetadata_t {
     int    total_ranks;
@@ -82,6 +100,7 @@ typedef struct RecorderMetadata_t {
     bool   interprocess_compression;    // interprocess compression of cst/cfg
     bool   interprocess_pattern_recognition;
     bool   intraprocess_pattern_recognition;
+    bool   interprocess_grammar_sharing;    // unique grammars reference a job-wide shared rule dictionary
 } RecorderMetadata;
 
 
@@ -118,6 +137,7 @@ typedef struct RecorderLogger_t {
     bool      interprocess_compression; // Wether to perform interprocess compression of cst/cfg
     bool      interprocess_pattern_recognition; 
     bool      intraprocess_pattern_recognition; 
+    bool      interprocess_grammar_sharing;     // Whether to extract rules shared by multiple ranks' grammars
 } RecorderLogger;
 
 
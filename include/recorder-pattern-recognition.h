@@ -7,21 +7,27 @@
 typedef int64_t off64_t;
 #endif
 
-typedef struct offset_map {
-    char* func;         // key
-    off64_t offset;     // value, this is the previous offset
-    UT_hash_handle hh;
-} offset_map_t;
-
 /* all functions in this unit starts with iopr_
  * (I/O Pattern Recognition)
  *
  */
 
-// intraprocess
-off64_t iopr_intraprocess(const char* func, off64_t offset);
+/*
+ * intraprocess
+ *
+ * Replace the offset argument of a record, if it has one, by
+ * its encoding relative to the previous access of the same call
+ * to the same file (the first argument):
+ *   "N"      first access, the absolute offset
+ *   "dN"     offset = previous offset + N (e.g., constant strides)
+ *   "ddN"    offset = previous offset + previous delta + N
+ * The previous delta is 0 after a first access. Close calls
+ * forget the states of their file.
+ * Must be called under g_mutex, in the order of the CFG.
+ */
+void    iopr_intraprocess(Record* record);
 
 // interprocess
 void    iopr_interprocess(RecorderLogger* logger);
 
-#endif
+#endif
\ No newline at end of file
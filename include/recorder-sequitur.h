@@ -74,6 +74,7 @@ typedef struct Grammar_t {
     int start_rule_id;              // first rule id, normally is -1
     int rule_id;                    // current_rule id, a negative number start from 'start_rule_id'
     bool twins_removal;             // if or not we will apply the twins-removal rule
+    int optimization_budget;        // steps spent re-optimizing the grammar at serialization, 0 to disable
 } Grammar;
 
 
@@ -111,7 +112,10 @@ int digram_delete(Digram **digram_table, Symbol *symbol);
 
 /* recorder_sequitur_logger.c */
 int* serialize_grammar(Grammar *grammar, int* serialized_integers);
-void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank, int mpi_size);
+void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank, int mpi_size, bool share_rules);
+
+/* recorder_sequitur_optimize.c */
+int* sequitur_optimize_grammar(int* g, int* integers, int step_budget);
 
 /* recorder_sequitur_utils.c */
 void  sequitur_print_rules(Grammar *grammar);
@@ -18,6 +18,8 @@
 #define RECORDER_INTERPROCESS_COMPRESSION	        "RECORDER_INTERPROCESS_COMPRESSION"
 #define RECORDER_INTERPROCESS_PATTERN_RECOGNITION   "RECORDER_INTERPROCESS_PATTERN_RECOGNITION"
 #define RECORDER_INTRAPROCESS_PATTERN_RECOGNITION   "RECORDER_INTRAPROCESS_PATTERN_RECOGNITION"
+#define RECORDER_INTERPROCESS_GRAMMAR_SHARING       "RECORDER_INTERPROCESS_GRAMMAR_SHARING"
+#define RECORDER_GRAMMAR_OPTIMIZATION               "RECORDER_GRAMMAR_OPTIMIZATION"
 #define RECORDER_EXCLUSION_FILE     		        "RECORDER_EXCLUSION_FILE"
 #define RECORDER_INCLUSION_FILE     		        "RECORDER_INCLUSION_FILE"
 #define RECORDER_DEBUG_LEVEL                        "RECORDER_DEBUG_LEVEL"
@@ -407,5 +407,6 @@ void save_cfg_local(RecorderLogger* logger) {
 }
 
 void save_cfg_merged(RecorderLogger* logger) {
-    sequitur_save_unique_grammars(logger->traces_dir, &logger->cfg, logger->rank, logger->nprocs);
+    sequitur_save_unique_grammars(logger->traces_dir, &logger->cfg, logger->rank, logger->nprocs,
+                                  logger->interprocess_grammar_sharing);
 }
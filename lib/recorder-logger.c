@@ -76,11 +76,15 @@ void write_record(Record *record) {
     if(!logger.store_call_depth)
         record->call_depth = 0;
 
+    pthread_mutex_lock(&g_mutex);
+
+    // Encode offsets in the order records enter the CFG
+    if(logger.intraprocess_pattern_recognition)
+        iopr_intraprocess(record);
+
     int key_len;
     char* key = compose_cs_key(record, &key_len);
 
-    pthread_mutex_lock(&g_mutex);
-
     CallSignature *entry = NULL;
     HASH_FIND(hh, logger.cst, key, key_len, entry);
     if(entry) {                         // Found
@@ -268,6 +272,7 @@ void logger_init() {
     logger.interprocess_compression = true;
     logger.intraprocess_pattern_recognition = false;
     logger.interprocess_pattern_recognition = false;
+    logger.interprocess_grammar_sharing = false;
     logger.ts_index = 0;
     logger.ts_resolution = 1e-7;            // 100ns
     logger.ts_compression = true;
@@ -299,6 +304,12 @@ void logger_init() {
     const char* intraprocess_pattern_recognition_env = getenv(RECORDER_INTRAPROCESS_PATTERN_RECOGNITION);
     if(intraprocess_pattern_recognition_env)
         logger.intraprocess_pattern_recognition = atoi(intraprocess_pattern_recognition_env);
+    const char* interprocess_grammar_sharing_env = getenv(RECORDER_INTERPROCESS_GRAMMAR_SHARING);
+    if(interprocess_grammar_sharing_env)
+        logger.interprocess_grammar_sharing = atoi(interprocess_grammar_sharing_env);
+    const char* grammar_optimization_env = getenv(RECORDER_GRAMMAR_OPTIMIZATION);
+    if(grammar_optimization_env)
+        logger.cfg.optimization_budget = atoi(grammar_optimization_env);
 
     // For non-mpi programs, ignore interprocess configurations.
     const char* non_mpi_env = getenv(RECORDER_WITH_NON_MPI);
@@ -307,6 +318,11 @@ void logger_init() {
         logger.interprocess_compression = false;
     }
 
+    // Shared rules are extracted while merging grammars,
+    // so this only makes sense with interprocess compression.
+    if (!logger.interprocess_compression)
+        logger.interprocess_grammar_sharing = false;
+
     initialized = true;
 }
 
@@ -342,6 +358,7 @@ void save_global_metadata() {
         .interprocess_compression = logger.interprocess_compression,
         .interprocess_pattern_recognition = logger.interprocess_pattern_recognition,
         .intraprocess_pattern_recognition = logger.intraprocess_pattern_recognition,
+        .interprocess_grammar_sharing = logger.interprocess_grammar_sharing,
     };
     GOTCHA_REAL_CALL(fwrite)(&metadata, sizeof(RecorderMetadata), 1, metafh);
     // reserve the first 1024 bytes to store the metadata block
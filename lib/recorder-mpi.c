@@ -392,10 +392,7 @@ int RECORDER_MPI_IMP(MPI_File_set_size) (MPI_File fh, MPI_Offset size, MPI_Fint*
 int RECORDER_MPI_IMP(MPI_File_set_view) (MPI_File fh, MPI_Offset disp, MPI_Datatype etype, MPI_Datatype filetype, CONST char *datarep, MPI_Info info, MPI_Fint* ierr) {
     FILTER_MPIIO_CALL(MPI_File_set_view, (fh, disp, etype, filetype, datarep, info), &fh);
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_File_set_view, (fh, disp, etype, filetype, datarep, info), ierr);
-    off64_t stored_offset = (off64_t) disp;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("MPI_File_set_view", (off64_t)disp);
-    char **args = assemble_args_list(6, file2id(&fh), itoa(stored_offset), type2name(etype), type2name(filetype), ptoa(datarep), ptoa(&info));
+    char **args = assemble_args_list(6, file2id(&fh), itoa(disp), type2name(etype), type2name(filetype), ptoa(datarep), ptoa(&info));
     RECORDER_INTERCEPTOR_EPILOGUE(6, args);
 }
 
@@ -409,20 +406,14 @@ int RECORDER_MPI_IMP(MPI_File_read) (MPI_File fh, void *buf, int count, MPI_Data
 int RECORDER_MPI_IMP(MPI_File_read_at) (MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype, MPI_Status *status, MPI_Fint* ierr) {
     FILTER_MPIIO_CALL(MPI_File_read_at, (fh, offset, buf, count, datatype, status), &fh);
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_File_read_at, (fh, offset, buf, count, datatype, status), ierr);
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("MPI_File_read_at", (off64_t)offset);
-    char **args = assemble_args_list(6, file2id(&fh), itoa(stored_offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
+    char **args = assemble_args_list(6, file2id(&fh), itoa(offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
     RECORDER_INTERCEPTOR_EPILOGUE(6, args);
 }
 
 int RECORDER_MPI_IMP(MPI_File_read_at_all) (MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype, MPI_Status *status, MPI_Fint* ierr) {
     FILTER_MPIIO_CALL(MPI_File_read_at_all, (fh, offset, buf, count, datatype, status), &fh);
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_File_read_at_all, (fh, offset, buf, count, datatype, status), ierr);
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("MPI_File_read_at_all", (off64_t)offset);
-    char **args = assemble_args_list(6, file2id(&fh), itoa(stored_offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
+    char **args = assemble_args_list(6, file2id(&fh), itoa(offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
     RECORDER_INTERCEPTOR_EPILOGUE(6, args);
 }
 
@@ -499,20 +490,14 @@ int RECORDER_MPI_IMP(MPI_File_write) (MPI_File fh, CONST void *buf, int count, M
 int RECORDER_MPI_IMP(MPI_File_write_at) (MPI_File fh, MPI_Offset offset, CONST void *buf, int count, MPI_Datatype datatype, MPI_Status *status, MPI_Fint* ierr) {
     FILTER_MPIIO_CALL(MPI_File_write_at, (fh, offset, buf, count, datatype, status), &fh);
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_File_write_at, (fh, offset, buf, count, datatype, status), ierr);
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("MPI_File_write_at", (off64_t)offset);
-    char **args = assemble_args_list(6, file2id(&fh), itoa(stored_offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
+    char **args = assemble_args_list(6, file2id(&fh), itoa(offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
     RECORDER_INTERCEPTOR_EPILOGUE(6, args);
 }
 
 int RECORDER_MPI_IMP(MPI_File_write_at_all) (MPI_File fh, MPI_Offset offset, CONST void *buf, int count, MPI_Datatype datatype, MPI_Status *status, MPI_Fint* ierr) {
     FILTER_MPIIO_CALL(MPI_File_write_at_all, (fh, offset, buf, count, datatype, status), &fh);
     RECORDER_INTERCEPTOR_PROLOGUE_F(int, MPI_File_write_at_all, (fh, offset, buf, count, datatype, status), ierr);
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("MPI_File_write_at_all", (off64_t)offset);
-    char **args = assemble_args_list(6, file2id(&fh), itoa(stored_offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
+    char **args = assemble_args_list(6, file2id(&fh), itoa(offset), ptoa(buf), itoa(count), type2name(datatype), status2str(status));
     RECORDER_INTERCEPTOR_EPILOGUE(6, args);
 }
 
@@ -4,183 +4,767 @@
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include "uthash.h"
 #include "recorder.h"
 #include "recorder-pattern-recognition.h"
 
-struct offset_cs_entry {
-    int offset_key_start;
-    int offset_key_end;
-    CallSignature* cs;
+/*
+ * Intraprocess stride detection
+ *
+ * One entry per file, keyed by the first argument of the
+ * calls (the path for POSIX calls, the file id for MPI-IO
+ * calls), with one state per call. The reader keys its state
+ * the same way, as handles are not recorded. So interleaved
+ * accesses to different files, or reads and writes to the
+ * same file, do not break each other's strides.
+ *
+ * The states are only touched by write_record() under
+ * g_mutex, so offsets are encoded in the order the records
+ * are appended to the CFG, which is the order the reader
+ * decodes them in, also when threads interleave.
+ */
+typedef struct iopr_stride {
+    off64_t offset;         // previous offset
+    off64_t delta;          // previous delta
+    off64_t dd;             // previous delta of delta
+    int     count;          // number of accesses so far
+} iopr_stride_t;
+
+// Calls whose offset argument is encoded
+static const struct {
+    const char* name;
+    int offset_arg;
+} intraprocess_funcs[] = {
+    {"lseek", 1}, {"lseek64", 1},
+    {"pread", 3}, {"pread64", 3},
+    {"pwrite", 3}, {"pwrite64", 3},
+    {"MPI_File_set_view", 1},
+    {"MPI_File_read_at", 1}, {"MPI_File_read_at_all", 1},
+    {"MPI_File_write_at", 1}, {"MPI_File_write_at_all", 1},
 };
+#define IOPR_NUM_FUNCS (sizeof(intraprocess_funcs) / sizeof(intraprocess_funcs[0]))
+#define IOPR_CLOSE     -2
+
+// Calls that forget the strides of their file
+static const char* intraprocess_close_funcs[] = {"close", "MPI_File_close"};
+
+typedef struct iopr_file_strides {
+    char* file;                             // key
+    iopr_stride_t strides[IOPR_NUM_FUNCS];
+    UT_hash_handle hh;
+} iopr_file_strides_t;
+
+static iopr_file_strides_t* stride_table;
+
+// func id -> index in intraprocess_funcs, -1 if the offset
+// is not encoded, IOPR_CLOSE for the close calls
+// built on first use
+static int* intraprocess_func_index;
+static int  intraprocess_max_func_id = -1;
+
+static void init_intraprocess_funcs() {
+    int num_close = sizeof(intraprocess_close_funcs) / sizeof(intraprocess_close_funcs[0]);
+    int ids[IOPR_NUM_FUNCS], close_ids[num_close];
+    int max_id = 0;
+    for(size_t i = 0; i < IOPR_NUM_FUNCS; i++) {
+        ids[i] = get_function_id_by_name(intraprocess_funcs[i].name);
+        if(ids[i] > max_id) max_id = ids[i];
+    }
+    for(int i = 0; i < num_close; i++) {
+        close_ids[i] = get_function_id_by_name(intraprocess_close_funcs[i]);
+        if(close_ids[i] > max_id) max_id = close_ids[i];
+    }
 
-static offset_map_t* func2offset_map;
+    intraprocess_func_index = malloc(sizeof(int) * (max_id+1));
+    for(int i = 0; i <= max_id; i++)
+        intraprocess_func_index[i] = -1;
+    for(size_t i = 0; i < IOPR_NUM_FUNCS; i++)
+        if(ids[i] >= 0) intraprocess_func_index[ids[i]] = i;
+    for(int i = 0; i < num_close; i++)
+        if(close_ids[i] >= 0) intraprocess_func_index[close_ids[i]] = IOPR_CLOSE;
+    intraprocess_max_func_id = max_id;
+}
 
+static iopr_stride_t* get_stride_state(int func, const char* file) {
+    if(file == NULL)
+        return NULL;
+    iopr_file_strides_t* entry = NULL;
+    HASH_FIND_STR(stride_table, file, entry);
+    if(entry == NULL) {
+        entry = calloc(1, sizeof(iopr_file_strides_t));
+        entry->file = strdup(file);
+        HASH_ADD_KEYPTR(hh, stride_table, entry->file, strlen(entry->file), entry);
+    }
+    return &entry->strides[func];
+}
 
-off64_t iopr_intraprocess(const char *func, off64_t offset) {
-    offset_map_t* entry = NULL;
-    HASH_FIND_STR(func2offset_map, func, entry);
-    if (!entry) {
-        entry = (offset_map_t*) malloc(sizeof(offset_map_t));
-        entry->func = strdup(func);
-        entry->offset = offset;
-        HASH_ADD_STR(func2offset_map, func, entry);
-        return offset;
+static char* encode_offset(iopr_stride_t* state, off64_t offset) {
+    char* res = NULL;
+    if(state->count == 0) {
+        res = itoa(offset);
+        state->delta = 0;
+        state->dd = 0;
     } else {
-        off64_t delta = offset - entry->offset;
-        entry->offset = offset;
-        return delta;
+        off64_t delta = offset - state->offset;
+        off64_t dd = delta - state->delta;
+        // A delta of delta is only worth it once it repeats,
+        // e.g., accesses of a triangular loop nest; constant
+        // strides (dd == 0) are stored as plain deltas.
+        res = malloc(32);
+        if(state->count > 1 && dd != 0 && dd == state->dd)
+            sprintf(res, "dd%ld", (long) dd);
+        else
+            sprintf(res, "d%ld", (long) delta);
+        state->delta = delta;
+        state->dd = dd;
     }
+    state->offset = offset;
+    state->count++;
+    return res;
 }
 
-int count_function(RecorderLogger *logger, int filter_func_id) {
-    int func_count = 0;
+// Forget the strides of a file when it is closed through
+// any handle, the reader does the same at the close record
+static void forget_strides(const char* file) {
+    iopr_file_strides_t* entry = NULL;
+    if(file)
+        HASH_FIND_STR(stride_table, file, entry);
+    if(entry) {
+        HASH_DEL(stride_table, entry);
+        free(entry->file);
+        free(entry);
+    }
+}
 
-    CallSignature *entry, *tmp;
-    HASH_ITER(hh, logger->cst, entry, tmp) {
-        void* ptr = entry->key+sizeof(pthread_t);
-        int func_id;
-        memcpy(&func_id, ptr, sizeof(func_id));
-        if(func_id == filter_func_id)
-            func_count++;
+void iopr_intraprocess(Record* record) {
+    if(intraprocess_max_func_id < 0)
+        init_intraprocess_funcs();
+    if(record->func_id < 0 || record->func_id > intraprocess_max_func_id ||
+       record->arg_count < 1)
+        return;
+
+    int func = intraprocess_func_index[record->func_id];
+    if(func == IOPR_CLOSE) {
+        forget_strides(record->args[0]);
+        return;
     }
+    if(func < 0 || intraprocess_funcs[func].offset_arg >= record->arg_count)
+        return;
 
-    return func_count;
+    iopr_stride_t* state = get_stride_state(func, record->args[0]);
+    char** arg = &record->args[intraprocess_funcs[func].offset_arg];
+    if(state == NULL || *arg == NULL)
+        return;
+    char* encoded = encode_offset(state, (off64_t) atoll(*arg));
+    free(*arg);
+    *arg = encoded;
 }
 
-void iopr_interprocess_by_func(RecorderLogger *logger, char* func_name, int offset_arg_idx) {
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
 
-    int filter_func_id = get_function_id_by_name(func_name);
-    int func_count = count_function(logger, filter_func_id);
+static uint64_t fnv1a(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*) data;
+    for(size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
 
-    struct offset_cs_entry *offset_cs_entries = malloc(sizeof(struct offset_cs_entry) * func_count);
-    long int *offsets = malloc(sizeof(long int) * func_count);
+// Only accept canonical integers ("0", "-12", but not "012" or "+1")
+// so a*rank+b prints back to exactly the same string
+static bool parse_integer(const char* s, int len, long long* val) {
+    int i = (len > 0 && s[0] == '-') ? 1 : 0;
+    if(i == len || len-i > 18)
+        return false;
+    if(s[i] == '0' && (len-i > 1 || i == 1))
+        return false;
+    long long v = 0;
+    for(; i < len; i++) {
+        if(!isdigit((unsigned char)s[i]))
+            return false;
+        v = v*10 + (s[i]-'0');
+    }
+    *val = (s[0] == '-') ? -v : v;
+    return true;
+}
 
+/*
+ * Replace the arguments of a call signature and rehash it.
+ * new_args[i] == NULL keeps the i-th argument unchanged.
+ */
+static void rewrite_cs_args(RecorderLogger* logger, CallSignature* cs, char** new_args) {
     int args_start = cs_key_args_start();
+    unsigned char arg_count;
+    memcpy(&arg_count, cs->key+args_start-sizeof(int)-1, 1);
+
+    int max_len = cs->key_len - args_start;
+    for(int i = 0; i < arg_count; i++)
+        if(new_args[i]) max_len += strlen(new_args[i]);
+    char* args = recorder_malloc(max_len);
+
+    char* key = (char*) cs->key;
+    int pos = 0, start = args_start, i = 0;
+    for(int k = args_start; k < cs->key_len; k++) {
+        if(key[k] != ' ') continue;
+        if(new_args[i]) {
+            memcpy(args+pos, new_args[i], strlen(new_args[i]));
+            pos += strlen(new_args[i]);
+        } else {
+            memcpy(args+pos, key+start, k-start);
+            pos += k-start;
+        }
+        args[pos++] = ' ';
+        start = k + 1;
+        i++;
+    }
 
-    int idx = 0;
-    CallSignature* entry;
-    CallSignature* tmp;
-    HASH_ITER(hh, logger->cst, entry, tmp) {
-        void* ptr = entry->key+sizeof(pthread_t);
+    HASH_DEL(logger->cst, cs);
 
-        int func_id;
-        memcpy(&func_id, ptr, sizeof(func_id));
+    int new_keylen = args_start + pos;
+    void* newkey = recorder_malloc(new_keylen);
+    memcpy(newkey, cs->key, args_start);
+    memcpy(newkey+args_start-sizeof(int), &pos, sizeof(int));
+    memcpy(newkey+args_start, args, pos);
 
-        if(func_id == filter_func_id) {
+    recorder_free(cs->key, cs->key_len);
+    cs->key = newkey;
+    cs->key_len = new_keylen;
+    HASH_ADD_KEYPTR(hh, logger->cst, cs->key, cs->key_len, cs);
 
-            char* key = (char*) entry->key;
+    recorder_free(args, max_len);
+}
 
-            int arg_idx = 0;
-            int start = args_start, end = args_start;
+/*
+ * Interprocess offset patterns
+ *
+ * Offsets of the calls listed in offset_funcs are collected
+ * in call signature order. Ranks that made the same sequence
+ * of offset calls exchange all their offsets with a single
+ * Allgather. An offset that is, on every rank,
+ *   1. a*rank+b, or
+ *   2. a*(rank/P) + c*(rank%P) + b, i.e., affine in the
+ *      coordinates of a process grid with P columns,
+ * is replaced by the pattern (see recorder-logger.h), so the
+ * call signatures merge across ranks.
+ *
+ * To cover a new call, add it to offset_funcs.
+ */
+typedef struct offset_func {
+    const char* name;
+    int offset_arg;         // index of the offset argument
+} offset_func_t;
+
+static const offset_func_t offset_funcs[] = {
+    {"lseek", 1},
+    {"lseek64", 1},
+    {"pread", 3},
+    {"pread64", 3},
+    {"pwrite", 3},
+    {"pwrite64", 3},
+    {"fseek", 1},
+    {"fseeko", 1},
+    {"MPI_File_set_view", 1},
+    {"MPI_File_read_at", 1},
+    {"MPI_File_read_at_all", 1},
+    {"MPI_File_read_at_all_begin", 1},
+    {"MPI_File_iread_at", 1},
+    {"MPI_File_write_at", 1},
+    {"MPI_File_write_at_all", 1},
+    {"MPI_File_write_at_all_begin", 1},
+    {"MPI_File_iwrite_at", 1},
+    {"MPI_File_iwrite_at_all", 1},
+    {"MPI_File_seek", 1},
+    {"MPI_File_seek_shared", 1},
+    {"H5Sselect_elements", 3},
+};
 
-            for(int i = args_start; i < entry->key_len; i++) {
-                if(key[i] == ' ') {
-                    if(arg_idx == offset_arg_idx) {
-                        end = i;
-                        break;
-                    } else {
-                        arg_idx++;
-                        start = i;
-                    }
-                }
-            }
+typedef struct offset_slot {
+    CallSignature* cs;
+    int arg_idx;
+    bool valid;             // offset is a plain integer
+    long long value;
+} offset_slot_t;
+
+/*
+ * Fit the offsets of all n ranks of a group. ranks[]
+ * are global ranks in increasing order. Return the
+ * pattern in template form, NULL if there is none.
+ */
+static char* fit_offset_pattern(long long* ranks, long long* values, int n, int nprocs) {
+    char* tmpl = NULL;
+
+    // offset = a*rank+b
+    long long a = (values[1] - values[0]) / (ranks[1] - ranks[0]);
+    long long b = values[0] - a*ranks[0];
+    bool fit = (a != 0);
+    for(int i = 0; fit && i < n; i++)
+        fit = (values[i] == a*ranks[i] + b);
+    if(fit) {
+        tmpl = malloc(64);
+        sprintf(tmpl, "%c%c%lld,%lld", RECORDER_TEMPLATE_MARK, RECORDER_TEMPLATE_AFFINE, a, b);
+        return tmpl;
+    }
+
+    // offset = a_hi*(rank/P) + a_lo*(rank%P) + b
+    // P ranges over the divisors of nprocs
+    if(n < 4) return NULL;
+    for(long long P = 2; P < nprocs; P++) {
+        if(nprocs % P != 0) continue;
+
+        // need a second rank in the same row and one in another row
+        int same = -1, other = -1;
+        long long row0 = ranks[0] / P, col0 = ranks[0] % P;
+        for(int i = 1; i < n && (same < 0 || other < 0); i++) {
+            if(ranks[i]/P == row0 && same < 0) same = i;
+            if(ranks[i]/P != row0 && other < 0) other = i;
+        }
+        if(same < 0 || other < 0) continue;
+
+        long long dcol = ranks[same]%P - col0;
+        if((values[same] - values[0]) % dcol != 0) continue;
+        long long a_lo = (values[same] - values[0]) / dcol;
+
+        long long drow = ranks[other]/P - row0;
+        long long rest = values[other] - values[0] - a_lo*(ranks[other]%P - col0);
+        if(rest % drow != 0) continue;
+        long long a_hi = rest / drow;
+        // same offset on all ranks, keep it literal as above
+        if(a_hi == 0 && a_lo == 0) continue;
+        b = values[0] - a_hi*row0 - a_lo*col0;
+
+        fit = true;
+        for(int i = 0; fit && i < n; i++)
+            fit = (values[i] == a_hi*(ranks[i]/P) + a_lo*(ranks[i]%P) + b);
+        if(fit) {
+            tmpl = malloc(128);
+            sprintf(tmpl, "%c%c%lld,%lld,%lld,%lld", RECORDER_TEMPLATE_MARK, RECORDER_TEMPLATE_GRID,
+                    P, a_hi, a_lo, b);
+            return tmpl;
+        }
+    }
+    return NULL;
+}
+
+static void iopr_offset_patterns(RecorderLogger *logger) {
 
-            assert(end > start);
-            char offset_str[64] = {0};
-            memcpy(offset_str, key+start+1, end-start-1);
-            long int offset = atol(offset_str);
+    // func id -> offset argument index, -1 for calls without an offset
+    int num_offset_funcs = sizeof(offset_funcs) / sizeof(offset_funcs[0]);
+    int max_func_id = 0;
+    int func_ids[num_offset_funcs];
+    for(int i = 0; i < num_offset_funcs; i++) {
+        func_ids[i] = get_function_id_by_name(offset_funcs[i].name);
+        if(func_ids[i] > max_func_id) max_func_id = func_ids[i];
+    }
+    int* offset_arg = malloc(sizeof(int) * (max_func_id+1));
+    for(int i = 0; i <= max_func_id; i++)
+        offset_arg[i] = -1;
+    for(int i = 0; i < num_offset_funcs; i++)
+        if(func_ids[i] >= 0) offset_arg[func_ids[i]] = offset_funcs[i].offset_arg;
 
-            offsets[idx] = offset;
-            offset_cs_entries[idx].offset_key_start = start;
-            offset_cs_entries[idx].offset_key_end   = end;
-            offset_cs_entries[idx].cs = entry;
+    int args_start = cs_key_args_start();
+    int n = 0, max_n = HASH_COUNT(logger->cst);
+    offset_slot_t* slots = malloc(sizeof(offset_slot_t) * (max_n+1));
+    uint64_t skeleton = FNV_OFFSET_BASIS;
 
-            idx++;
+    CallSignature *entry, *tmp;
+    HASH_ITER(hh, logger->cst, entry, tmp) {
+        int func_id;
+        memcpy(&func_id, entry->key+sizeof(pthread_t), sizeof(int));
+        if(func_id < 0 || func_id > max_func_id || offset_arg[func_id] < 0)
+            continue;
+
+        offset_slot_t* slot = &slots[n++];
+        slot->cs = entry;
+        slot->arg_idx = offset_arg[func_id];
+        slot->valid = false;
+        skeleton = fnv1a(skeleton, &func_id, sizeof(int));
+
+        char* key = (char*) entry->key;
+        int arg_idx = 0, start = args_start;
+        for(int k = args_start; k < entry->key_len; k++) {
+            if(key[k] != ' ') continue;
+            if(arg_idx++ == slot->arg_idx) {
+                slot->valid = parse_integer(key+start, k-start, &slot->value);
+                break;
+            }
+            start = k + 1;
         }
     }
+    free(offset_arg);
 
     GOTCHA_SET_REAL_CALL(MPI_Comm_split, RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Comm_size,  RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Comm_rank,  RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Comm_free,  RECORDER_MPI);
     GOTCHA_SET_REAL_CALL(MPI_Allgather,  RECORDER_MPI);
+    GOTCHA_SET_REAL_CALL(MPI_Allreduce,  RECORDER_MPI);
 
     MPI_Comm comm;
     int comm_size, comm_rank;
-    GOTCHA_REAL_CALL(MPI_Comm_split)(MPI_COMM_WORLD, func_count, logger->rank, &comm);
+    int color = (int)(skeleton & 0x7fffffff);
+    GOTCHA_REAL_CALL(MPI_Comm_split)(MPI_COMM_WORLD, color, logger->rank, &comm);
     GOTCHA_REAL_CALL(MPI_Comm_size)(comm, &comm_size);
     GOTCHA_REAL_CALL(MPI_Comm_rank)(comm, &comm_rank);
 
-    if(comm_rank == 0)
-        RECORDER_LOGDBG("%s count: %d, comm size: %d\n", func_name, func_count, comm_size);
-
-    if(comm_size > 2) {
-        long int *all_offsets = calloc(comm_size*(func_count), sizeof(long int));
-        GOTCHA_REAL_CALL(MPI_Allgather)(offsets, func_count, MPI_LONG,
-                                            all_offsets, func_count, MPI_LONG, comm);
-
-        // Fory every offset of the same I/O call
-        // check if it is the form of offset = a * rank + b;
-        for(int i = 0; i < func_count; i++) {
-
-            long int o1 = all_offsets[i];
-            long int o2 = all_offsets[i+func_count];
-            long int a = o2 - o1;
-            long int b = o1;
-            int same_pattern = 1;
-            for(int r = 0; r < comm_size; r++) {
-                long int o = all_offsets[i+func_count*r];
-                if(o != a*r+b) {
-                    same_pattern = 0;
-                    break;
-                }
+    // Guard against skeleton hash collisions
+    int counts[2] = {n, -n};
+    GOTCHA_REAL_CALL(MPI_Allreduce)(MPI_IN_PLACE, counts, 2, MPI_INT, MPI_MIN, comm);
+
+    if(comm_size > 2 && n > 0 && counts[0] == -counts[1]) {
+        // [0]: global rank, [1, n]: offsets, [n+1, 2n]: valid
+        int stride = 2*n + 1;
+        long long* mine = malloc(sizeof(long long) * stride);
+        long long* all  = malloc(sizeof(long long) * stride * comm_size);
+        mine[0] = logger->rank;
+        for(int i = 0; i < n; i++) {
+            mine[1+i]   = slots[i].value;
+            mine[1+n+i] = slots[i].valid;
+        }
+        GOTCHA_REAL_CALL(MPI_Allgather)(mine, stride, MPI_LONG_LONG, all, stride, MPI_LONG_LONG, comm);
+
+        long long* ranks  = malloc(sizeof(long long) * comm_size);
+        long long* values = malloc(sizeof(long long) * comm_size);
+        for(int r = 0; r < comm_size; r++)
+            ranks[r] = all[r*stride];
+
+        int recognized = 0;
+        for(int i = 0; i < n; i++) {
+            bool valid = true;
+            for(int r = 0; r < comm_size && valid; r++) {
+                valid = all[r*stride + 1+n+i];
+                values[r] = all[r*stride + 1+i];
+            }
+            if(!valid) continue;
+
+            char* tmpl = fit_offset_pattern(ranks, values, comm_size, logger->nprocs);
+            if(tmpl) {
+                char* new_args[256] = {NULL};
+                new_args[slots[i].arg_idx] = tmpl;
+                rewrite_cs_args(logger, slots[i].cs, new_args);
+                free(tmpl);
+                recognized++;
             }
+        }
 
-            // Everyone has the same pattern of offset
-            // Then modify the call signature to store
-            // the pattern instead of the actuall offset
-            // TODO we should store a and b, but now we
-            // store a only
-            if(same_pattern) {
-                HASH_DEL(logger->cst, offset_cs_entries[i].cs);
+        if(comm_rank == 0)
+            RECORDER_LOGDBG("[Recorder] offset patterns: %d of %d offsets, group size: %d\n", recognized, n, comm_size);
 
-                int start = offset_cs_entries[i].offset_key_start;
-                int end   = offset_cs_entries[i].offset_key_end;
+        free(ranks);
+        free(values);
+        free(mine);
+        free(all);
+    }
 
-                char* tmp = calloc(64, 1);
-                sprintf(tmp, "%ld*r+%ld", a, b);
+    GOTCHA_REAL_CALL(MPI_Comm_free)(&comm);
+    free(slots);
+}
+
+/*
+ * Rank-relative argument templates
+ *
+ * Ranks that recorded the same sequence of call signatures
+ * (same functions with the same argument counts) are grouped
+ * together. Within a group, the i-th argument of the j-th call
+ * signature is replaced by a rank template if, on every rank,
+ *   1. it is an integer of the form a*rank+b (a != 0), e.g.,
+ *      the dest of MPI_Send(rank+1), or
+ *   2. it is a string that embeds the rank and is otherwise
+ *      identical, e.g., out.0042.h5
+ * Those call signatures then become identical across ranks and
+ * are merged by the interprocess CST compression. The reader
+ * instantiates the templates for each rank.
+ *
+ * Only a constant number of collectives is needed per group:
+ * the first rank of a group broadcasts its arguments and string
+ * templates, the second its arguments, which fixes a and b.
+ * Everyone else verifies locally.
+ */
+#define TEMPLATE_AFFINE  1
+#define TEMPLATE_STRING  2
+
+typedef struct arg_slot {
+    CallSignature* cs;
+    int start;              // position of the argument in cs->key
+    int len;
+    bool is_integer;
+    long long value;
+    int min_run, max_run;   // shortest/longest digit run that matched the rank
+} arg_slot_t;
+
+// Value of the digit run s[0, len), -1 if too long to be a rank
+static long long digit_run_value(const char* s, int len) {
+    if(len > 18)
+        return -1;
+    long long v = 0;
+    for(int i = 0; i < len; i++)
+        v = v*10 + (s[i]-'0');
+    return v;
+}
+
+/*
+ * Replace every maximal digit run of arg that equals the
+ * rank with RECORDER_TEMPLATE_RANK. out must hold at least
+ * len+1 bytes and is null-terminated.
+ * Return the number of runs replaced.
+ */
+static int template_string(const char* arg, int len, int rank, char* out) {
+    int runs = 0, o = 0, i = 0;
+    while(i < len) {
+        // never template something that looks like a template already
+        if(arg[i] == RECORDER_TEMPLATE_MARK || arg[i] == RECORDER_TEMPLATE_RANK || arg[i] == 0)
+            return 0;
+        if(!isdigit((unsigned char)arg[i])) {
+            out[o++] = arg[i++];
+            continue;
+        }
+        int j = i;
+        while(j < len && isdigit((unsigned char)arg[j]))
+            j++;
+        if(digit_run_value(arg+i, j-i) == rank) {
+            out[o++] = RECORDER_TEMPLATE_RANK;
+            runs++;
+        } else {
+            memcpy(out+o, arg+i, j-i);
+            o += j-i;
+        }
+        i = j;
+    }
+    out[o] = 0;
+    return runs;
+}
+
+/*
+ * Check if arg is tmpl instantiated with our rank.
+ * Every placeholder must match a maximal digit run
+ * that equals the rank.
+ */
+static bool match_template(const char* arg, int len, const char* tmpl, int rank,
+                           int* min_run, int* max_run) {
+    int i = 0;
+    *min_run = INT_MAX;
+    *max_run = 0;
+    for(; *tmpl; tmpl++) {
+        if(*tmpl != RECORDER_TEMPLATE_RANK) {
+            if(i == len || arg[i] != *tmpl)
+                return false;
+            i++;
+            continue;
+        }
+        int j = i;
+        while(j < len && isdigit((unsigned char)arg[j]))
+            j++;
+        if(j == i || digit_run_value(arg+i, j-i) != rank)
+            return false;
+        if(j-i < *min_run) *min_run = j-i;
+        if(j-i > *max_run) *max_run = j-i;
+        i = j;
+    }
+    return i == len && *max_run > 0;
+}
+
+static int count_digits(int rank) {
+    int d = 1;
+    while(rank >= 10) { rank /= 10; d++; }
+    return d;
+}
 
-                if(comm_rank == 0)
-                    RECORDER_LOGDBG("pattern recognized %d: offset = %ld*rank+%ld\n", offset_cs_entries[i].cs->terminal_id, a, b);
+/*
+ * Rewrite the arguments of cs whose slot is marked in flags.
+ * slots points to the first argument of cs.
+ */
+static void apply_rank_templates(RecorderLogger* logger, arg_slot_t* slots, int* flags,
+                                 long long* a, long long* b, int* widths, char** tmpls,
+                                 int arg_count) {
+    char* new_args[256] = {NULL};
+    for(int i = 0; i < arg_count; i++) {
+        if(flags[i] & TEMPLATE_AFFINE) {
+            new_args[i] = malloc(64);
+            sprintf(new_args[i], "%c%c%lld,%lld", RECORDER_TEMPLATE_MARK,
+                    RECORDER_TEMPLATE_AFFINE, a[i], b[i]);
+        } else if(flags[i] & TEMPLATE_STRING) {
+            new_args[i] = malloc(strlen(tmpls[i]) + 32);
+            sprintf(new_args[i], "%c%c%d,%s", RECORDER_TEMPLATE_MARK,
+                    RECORDER_TEMPLATE_STRING, widths[i], tmpls[i]);
+        }
+    }
 
-                int old_keylen = offset_cs_entries[i].cs->key_len;
-                int new_keylen = old_keylen - (end-start-1) + strlen(tmp);
-                int new_arg_strlen = new_keylen - args_start;
+    rewrite_cs_args(logger, slots[0].cs, new_args);
 
-                void* newkey = malloc(new_keylen);
-                void* oldkey = offset_cs_entries[i].cs->key;
+    for(int i = 0; i < arg_count; i++)
+        free(new_args[i]);
+}
 
-                memcpy(newkey, oldkey, start+1);
-                memcpy(newkey+args_start-sizeof(int), &new_arg_strlen, sizeof(int));
-                memcpy(newkey+start+1, tmp, strlen(tmp));
-                memcpy(newkey+start+1+strlen(tmp), oldkey+end, old_keylen-end);
+static void iopr_rank_templates(RecorderLogger *logger) {
 
-                offset_cs_entries[i].cs->key = newkey;
-                offset_cs_entries[i].cs->key_len = new_keylen;
-                HASH_ADD_KEYPTR(hh, logger->cst, offset_cs_entries[i].cs->key, offset_cs_entries[i].cs->key_len, offset_cs_entries[i].cs);
+    int num_cs = HASH_COUNT(logger->cst);
+    int args_start = cs_key_args_start();
 
+    // Collect call signatures in insertion order
+    // and hash their skeleton to form the groups
+    CallSignature** css = malloc(sizeof(CallSignature*) * (num_cs+1));
+    int num_slots = 0, idx = 0;
+    uint64_t skeleton = FNV_OFFSET_BASIS;
+    CallSignature *entry, *tmp;
+    HASH_ITER(hh, logger->cst, entry, tmp) {
+        int func_id;
+        unsigned char arg_count;
+        memcpy(&func_id, entry->key+sizeof(pthread_t), sizeof(int));
+        memcpy(&arg_count, entry->key+args_start-sizeof(int)-1, 1);
+        skeleton = fnv1a(skeleton, &func_id, sizeof(int));
+        skeleton = fnv1a(skeleton, &arg_count, 1);
+        css[idx++] = entry;
+        num_slots += arg_count;
+    }
 
-                free(oldkey);
-                free(tmp);
+    arg_slot_t* slots = calloc(num_slots+1, sizeof(arg_slot_t));
+    int s = 0, args_total = 0;
+    for(int i = 0; i < num_cs; i++) {
+        char* key = (char*) css[i]->key;
+        int start = args_start;
+        for(int k = args_start; k < css[i]->key_len; k++) {
+            if(key[k] != ' ') continue;
+            arg_slot_t* slot = &slots[s++];
+            slot->cs    = css[i];
+            slot->start = start;
+            slot->len   = k - start;
+            slot->is_integer = parse_integer(key+start, slot->len, &slot->value);
+            args_total += slot->len + 1;
+            start = k + 1;
+        }
+    }
+
+    GOTCHA_SET_REAL_CALL(MPI_Comm_split, RECORDER_MPI);
+    GOTCHA_SET_REAL_CALL(MPI_Comm_size,  RECORDER_MPI);
+    GOTCHA_SET_REAL_CALL(MPI_Comm_rank,  RECORDER_MPI);
+    GOTCHA_SET_REAL_CALL(MPI_Comm_free,  RECORDER_MPI);
+    GOTCHA_SET_REAL_CALL(MPI_Bcast,      RECORDER_MPI);
+    GOTCHA_SET_REAL_CALL(MPI_Allreduce,  RECORDER_MPI);
+
+    MPI_Comm comm;
+    int comm_size, comm_rank;
+    int color = (int)(skeleton & 0x7fffffff);
+    GOTCHA_REAL_CALL(MPI_Comm_split)(MPI_COMM_WORLD, color, logger->rank, &comm);
+    GOTCHA_REAL_CALL(MPI_Comm_size)(comm, &comm_size);
+    GOTCHA_REAL_CALL(MPI_Comm_rank)(comm, &comm_rank);
+
+    // Guard against skeleton hash collisions
+    int counts[2] = {num_slots, -num_slots};
+    GOTCHA_REAL_CALL(MPI_Allreduce)(MPI_IN_PLACE, counts, 2, MPI_INT, MPI_MIN, comm);
+
+    if(comm_size > 1 && num_slots > 0 && counts[0] == -counts[1]) {
+        int S = num_slots;
+
+        // [0]: global rank, [1]: size of the string templates,
+        // [2, S+1]: values, [S+2, 2S+1]: is_integer
+        long long* first  = malloc(sizeof(long long) * (2*S+2));
+        long long* second = malloc(sizeof(long long) * (2*S+2));
+        long long* mine   = (comm_rank == 0) ? first : second;
+
+        // String templates of the first rank, one
+        // null-terminated (possibly empty) string per argument
+        char* tmpl_buf = NULL;
+        long long tmpl_size = 0;
+        if(comm_rank == 0) {
+            tmpl_buf = malloc(args_total + 1);
+            for(int i = 0; i < S; i++) {
+                char* arg = (char*)slots[i].cs->key + slots[i].start;
+                if(template_string(arg, slots[i].len, logger->rank, tmpl_buf+tmpl_size) == 0)
+                    tmpl_buf[tmpl_size] = 0;
+                tmpl_size += strlen(tmpl_buf+tmpl_size) + 1;
             }
         }
-        free(all_offsets);
+
+        mine[0] = logger->rank;
+        mine[1] = tmpl_size;
+        for(int i = 0; i < S; i++) {
+            mine[2+i]   = slots[i].value;
+            mine[2+S+i] = slots[i].is_integer;
+        }
+        GOTCHA_REAL_CALL(MPI_Bcast)(first, 2*S+2, MPI_LONG_LONG, 0, comm);
+        GOTCHA_REAL_CALL(MPI_Bcast)(second, 2*S+2, MPI_LONG_LONG, 1, comm);
+        tmpl_size = first[1];
+        if(comm_rank != 0)
+            tmpl_buf = malloc(tmpl_size);
+        GOTCHA_REAL_CALL(MPI_Bcast)(tmpl_buf, (int)tmpl_size, MPI_CHAR, 0, comm);
+
+        long long* a = calloc(S, sizeof(long long));
+        long long* b = calloc(S, sizeof(long long));
+        char** tmpls = malloc(sizeof(char*) * S);
+        int* widths  = malloc(sizeof(int) * S);
+        int* flags   = malloc(sizeof(int) * S);
+
+        long long r0 = first[0], r1 = second[0];
+        char* t = tmpl_buf;
+        for(int i = 0; i < S; i++) {
+            flags[i] = 0;
+            tmpls[i] = t;
+            t += strlen(t) + 1;
+
+            // affine patterns need at least three points to mean anything
+            if(comm_size > 2 && slots[i].is_integer && first[2+S+i] && second[2+S+i]) {
+                long long dv = second[2+i] - first[2+i];
+                if(dv != 0 && dv % (r1-r0) == 0) {
+                    a[i] = dv / (r1-r0);
+                    b[i] = first[2+i] - a[i]*r0;
+                    if(slots[i].value == a[i]*logger->rank + b[i])
+                        flags[i] |= TEMPLATE_AFFINE;
+                }
+            }
+            char* arg = (char*)slots[i].cs->key + slots[i].start;
+            if(tmpls[i][0] && match_template(arg, slots[i].len, tmpls[i], logger->rank,
+                                             &slots[i].min_run, &slots[i].max_run))
+                flags[i] |= TEMPLATE_STRING;
+            widths[i] = (flags[i] & TEMPLATE_STRING) ? slots[i].min_run : INT_MAX;
+        }
+
+        // The zero-padding width is the shortest run on any rank,
+        // e.g., 4 for "%04d", 1 for "%d". Then every rank checks
+        // that formatting its rank with this width gives back its runs.
+        GOTCHA_REAL_CALL(MPI_Allreduce)(MPI_IN_PLACE, widths, S, MPI_INT, MPI_MIN, comm);
+        for(int i = 0; i < S; i++) {
+            if(!(flags[i] & TEMPLATE_STRING)) continue;
+            int expected = count_digits(logger->rank);
+            if(widths[i] > expected) expected = widths[i];
+            if(slots[i].min_run != expected || slots[i].max_run != expected)
+                flags[i] &= ~TEMPLATE_STRING;
+        }
+        GOTCHA_REAL_CALL(MPI_Allreduce)(MPI_IN_PLACE, flags, S, MPI_INT, MPI_BAND, comm);
+
+        int templated = 0, first_slot = 0;
+        for(int i = 0; i < num_cs; i++) {
+            unsigned char arg_count;
+            memcpy(&arg_count, css[i]->key+args_start-sizeof(int)-1, 1);
+            bool any = false;
+            for(int k = first_slot; k < first_slot+arg_count; k++) {
+                if(flags[k] & TEMPLATE_AFFINE) flags[k] = TEMPLATE_AFFINE;
+                if(flags[k]) { any = true; templated++; }
+            }
+            if(any)
+                apply_rank_templates(logger, &slots[first_slot], &flags[first_slot], &a[first_slot],
+                                     &b[first_slot], &widths[first_slot], &tmpls[first_slot], arg_count);
+            first_slot += arg_count;
+        }
+
+        if(comm_rank == 0)
+            RECORDER_LOGDBG("[Recorder] rank templates: %d arguments, group size: %d\n", templated, comm_size);
+
+        free(first);
+        free(second);
+        free(tmpl_buf);
+        free(a);
+        free(b);
+        free(tmpls);
+        free(widths);
+        free(flags);
     }
 
     GOTCHA_REAL_CALL(MPI_Comm_free)(&comm);
-    free(offsets);
-    free(offset_cs_entries);
+    free(slots);
+    free(css);
 }
 
 void iopr_interprocess(RecorderLogger *logger) {
@@ -192,14 +776,9 @@ void iopr_interprocess(RecorderLogger *logger) {
     if (!mpi_initialized)
         return;
 
-    iopr_interprocess_by_func(logger, "lseek", 1);
-    iopr_interprocess_by_func(logger, "lseek64", 1);
-    iopr_interprocess_by_func(logger, "pread", 3);
-    iopr_interprocess_by_func(logger, "pread64", 3);
-    iopr_interprocess_by_func(logger, "pwrite", 3);
-    iopr_interprocess_by_func(logger, "pwrite64", 3);
-    iopr_interprocess_by_func(logger, "MPI_File_read_at", 1);
-    iopr_interprocess_by_func(logger, "MPI_File_read_at_all", 1);
-    iopr_interprocess_by_func(logger, "MPI_File_write_at", 1);
-    iopr_interprocess_by_func(logger, "MPI_File_write_at_all", 1);
+    iopr_offset_patterns(logger);
+
+    // Must run after the offset patterns, which
+    // expect the offsets to still be plain integers
+    iopr_rank_templates(logger);
 }
@@ -332,9 +332,6 @@ int WRAPPER_NAME(__fxstat64)(int vers, int fd, struct stat64 *buf) {
 ssize_t WRAPPER_NAME(pread64)(int fd, void *buf, size_t count, off64_t offset) {
     GET_CHECK_FILENAME(pread64, (fd, buf, count, offset), &fd, ARG_TYPE_FD);
     RECORDER_INTERCEPTOR_PROLOGUE(ssize_t, pread64, (fd, buf, count, offset));
-    off64_t stored_offset = offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("pread64", (off64_t)offset);
     char** args = assemble_args_list(4, _fname, ptoa(buf), itoa(count), itoa(offset));
     RECORDER_INTERCEPTOR_EPILOGUE(4, args);
 }
@@ -342,9 +339,6 @@ ssize_t WRAPPER_NAME(pread64)(int fd, void *buf, size_t count, off64_t offset) {
 ssize_t WRAPPER_NAME(pread)(int fd, void *buf, size_t count, off_t offset) {
     GET_CHECK_FILENAME(pread, (fd, buf, count, offset), &fd, ARG_TYPE_FD);
     RECORDER_INTERCEPTOR_PROLOGUE(ssize_t, pread, (fd, buf, count, offset));
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("pread", (off64_t)offset);
     char** args = assemble_args_list(4, _fname, ptoa(buf), itoa(count), itoa(offset));
     RECORDER_INTERCEPTOR_EPILOGUE(4, args);
 }
@@ -352,19 +346,13 @@ ssize_t WRAPPER_NAME(pread)(int fd, void *buf, size_t count, off_t offset) {
 ssize_t WRAPPER_NAME(pwrite64)(int fd, const void *buf, size_t count, off64_t offset) {
     GET_CHECK_FILENAME(pwrite64, (fd, buf, count, offset), &fd, ARG_TYPE_FD);
     RECORDER_INTERCEPTOR_PROLOGUE(ssize_t, pwrite64, (fd, buf, count, offset));
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("pwrite64", (off64_t)offset);
-    char** args = assemble_args_list(4, _fname, ptoa(buf), itoa(count), itoa(stored_offset));
+    char** args = assemble_args_list(4, _fname, ptoa(buf), itoa(count), itoa(offset));
     RECORDER_INTERCEPTOR_EPILOGUE(4, args);
 }
 ssize_t WRAPPER_NAME(pwrite)(int fd, const void *buf, size_t count, off_t offset) {
     GET_CHECK_FILENAME(pwrite, (fd, buf, count, offset), &fd, ARG_TYPE_FD);
     RECORDER_INTERCEPTOR_PROLOGUE(ssize_t, pwrite, (fd, buf, count, offset));
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("pwrite", (off64_t)offset);
-    char** args = assemble_args_list(4, _fname, ptoa(buf), itoa(count), itoa(stored_offset));
+    char** args = assemble_args_list(4, _fname, ptoa(buf), itoa(count), itoa(offset));
     RECORDER_INTERCEPTOR_EPILOGUE(4, args);
 }
 
@@ -455,20 +443,14 @@ long WRAPPER_NAME(ftell)(FILE *stream) {
 off64_t WRAPPER_NAME(lseek64)(int fd, off64_t offset, int whence) {
     GET_CHECK_FILENAME(lseek64, (fd, offset, whence), &fd, ARG_TYPE_FD);
     RECORDER_INTERCEPTOR_PROLOGUE(off64_t, lseek64, (fd, offset, whence));
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("lseek64", (off64_t)offset);
-    char** args = assemble_args_list(3, _fname, itoa(stored_offset), itoa(whence));
+    char** args = assemble_args_list(3, _fname, itoa(offset), itoa(whence));
     RECORDER_INTERCEPTOR_EPILOGUE(3, args);
 }
 
 off_t WRAPPER_NAME(lseek)(int fd, off_t offset, int whence) {
     GET_CHECK_FILENAME(lseek, (fd, offset, whence), &fd, ARG_TYPE_FD);
     RECORDER_INTERCEPTOR_PROLOGUE(off_t, lseek, (fd, offset, whence));
-    off64_t stored_offset = (off64_t) offset;
-    if (logger_intraprocess_pattern_recognition())
-        stored_offset = iopr_intraprocess("lseek", (off64_t)offset);
-    char** args = assemble_args_list(3, _fname, itoa(stored_offset), itoa(whence));
+    char** args = assemble_args_list(3, _fname, itoa(offset), itoa(whence));
     RECORDER_INTERCEPTOR_EPILOGUE(3, args);
 }
 
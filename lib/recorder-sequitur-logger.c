@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include "recorder-sequitur.h"
 #include "recorder-utils.h"
 #include "mpi.h"
@@ -21,6 +22,24 @@ typedef struct UniqueGrammar_t {
 static UniqueGrammar *unique_grammars;
 static int current_ugi = 0;
 
+/**
+ * A rule of some rank's grammar in its canonical form,
+ * i.e., rule body with every non-terminal replaced by
+ * the canonical id of the rule it references. Two rules
+ * from different ranks expand to the same sequence iff
+ * they have the same canonical form.
+ */
+typedef struct CanonicalRule_t {
+    int *key;               // canonical body: 2i+0 val, 2i+1 exp
+    int key_len;            // in bytes
+    int cid;                // canonical id, starts from 1
+    int ranks;              // number of ranks whose grammar has this rule
+    int last_rank;          // last rank counted in 'ranks'
+    bool referenced;        // used as a non-main rule by at least one rank
+    int sid;                // shared rule id, 0 if the rule stays private
+    UT_hash_handle hh;
+} CanonicalRule;
+
 /**
  * Store the Grammer in an integer array
  *
@@ -29,6 +48,10 @@ static int current_ugi = 0;
  * | rule 2 head | #symbols of rule 2 | symbol 1, ..., symbol N |
  * ...
  *
+ * If grammar->optimization_budget is set, the grammar is
+ * re-optimized (see sequitur_optimize_grammar()) before it
+ * is returned. The Grammar itself is not modified.
+ *
  * @len: [out] the length of the array: 1 + 2 * number of rules + number of symbols
  * @return: return the array, need to be freed by the caller
  *
@@ -62,11 +85,244 @@ int* serialize_grammar(Grammar *grammar, int* serialized_integers) {
         }
     }
 
+    if(grammar->optimization_budget > 0) {
+        int optimized_integers = total_integers;
+        int *optimized = sequitur_optimize_grammar(data, &optimized_integers, grammar->optimization_budget);
+        if(optimized) {
+            recorder_free(data, sizeof(int) * total_integers);
+            data = optimized;
+            total_integers = optimized_integers;
+        }
+    }
+
     *serialized_integers = total_integers;
     return data;
 }
 
-void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank, int mpi_size) {
+/**
+ * Compute the canonical id of a rule of grammar g.
+ *
+ * @rule_pos: [in] rule_pos[-rule_id] is the offset of the rule in g
+ * @cids: [in/out] memoized canonical ids, cids[-rule_id]
+ */
+static int canonicalize_rule(int* g, int* rule_pos, int* cids, int rule_id, int rank,
+                             CanonicalRule** table, CanonicalRule*** by_cid, int* num_cids) {
+    if(cids[-rule_id])
+        return cids[-rule_id];
+
+    int pos = rule_pos[-rule_id];
+    int symbols = g[pos+1];
+    int* body = g + pos + 2;
+
+    int key_len = sizeof(int) * symbols * 2;
+    int* key = recorder_malloc(key_len);
+    for(int i = 0; i < symbols; i++) {
+        int val = body[2*i+0];
+        // Non-terminals are stored as -cid so they can
+        // never collide with a terminal id
+        if(val < 0)
+            val = -canonicalize_rule(g, rule_pos, cids, val, rank, table, by_cid, num_cids);
+        key[2*i+0] = val;
+        key[2*i+1] = body[2*i+1];
+    }
+
+    CanonicalRule* entry = NULL;
+    HASH_FIND(hh, *table, key, key_len, entry);
+    if(entry) {
+        recorder_free(key, key_len);
+    } else {
+        entry = recorder_malloc(sizeof(CanonicalRule));
+        entry->key = key;
+        entry->key_len = key_len;
+        entry->cid = ++(*num_cids);
+        entry->ranks = 0;
+        entry->last_rank = -1;
+        entry->referenced = false;
+        entry->sid = 0;
+        HASH_ADD_KEYPTR(hh, *table, entry->key, entry->key_len, entry);
+
+        *by_cid = realloc(*by_cid, sizeof(CanonicalRule*) * (entry->cid+1));
+        (*by_cid)[entry->cid] = entry;
+    }
+
+    if(entry->last_rank != rank) {
+        entry->last_rank = rank;
+        entry->ranks++;
+    }
+    if(rule_id != -1)
+        entry->referenced = true;
+
+    cids[-rule_id] = entry->cid;
+    return entry->cid;
+}
+
+/*
+ * Index the rules of a serialized grammar by -rule_id
+ * return the size of rule_pos, i.e., max(-rule_id) + 1
+ */
+static int index_grammar_rules(int* g, int** rule_pos) {
+    int rules = g[0];
+    int max_id = 1;
+    int pos = 1;
+    for(int r = 0; r < rules; r++) {
+        if(-g[pos] > max_id) max_id = -g[pos];
+        pos += 2 + 2*g[pos+1];
+    }
+
+    *rule_pos = recorder_malloc(sizeof(int) * (max_id+1));
+    pos = 1;
+    for(int r = 0; r < rules; r++) {
+        (*rule_pos)[-g[pos]] = pos;
+        pos += 2 + 2*g[pos+1];
+    }
+    return max_id + 1;
+}
+
+/**
+ * Interprocess grammar sharing
+ *
+ * Exact-match dedup only helps if two ranks have byte-identical
+ * grammars. Here we find rules that appear (in canonical form) in
+ * at least two ranks' grammars and move them into a job-wide shared
+ * rule dictionary (sg.cfg). Each rank's grammar is then rewritten
+ * to keep only its private rules, which are renumbered from -1 and
+ * reference shared rules by their shared rule id. Shared ids start
+ * right after the largest number of private rules of any rank, so
+ * private and shared ids never overlap.
+ *
+ * @grammars: [in/out] grammars[rank] will be replaced by the rewritten grammar
+ * @integers: [in/out] length of grammars[rank]
+ * @shared_integers: [out] length of the returned shared dictionary
+ * @return: serialized shared dictionary, same format as serialize_grammar()
+ */
+static int* extract_shared_rules(int** grammars, int* integers, int mpi_size, int* shared_integers) {
+    CanonicalRule* table = NULL;
+    CanonicalRule** by_cid = NULL;
+    int num_cids = 0;
+
+    int** rule_pos = recorder_malloc(sizeof(int*) * mpi_size);
+    int** cids     = recorder_malloc(sizeof(int*) * mpi_size);
+    int*  id_range = recorder_malloc(sizeof(int) * mpi_size);
+
+    // 1. Canonicalize every rule of every rank
+    for(int rank = 0; rank < mpi_size; rank++) {
+        int* g = grammars[rank];
+        id_range[rank] = index_grammar_rules(g, &rule_pos[rank]);
+        cids[rank] = recorder_malloc(sizeof(int) * id_range[rank]);
+        memset(cids[rank], 0, sizeof(int) * id_range[rank]);
+
+        int pos = 1;
+        for(int r = 0; r < g[0]; r++) {
+            canonicalize_rule(g, rule_pos[rank], cids[rank], g[pos], rank, &table, &by_cid, &num_cids);
+            pos += 2 + 2*g[pos+1];
+        }
+    }
+
+    // 2. Decide the shared rules. All sub-rules of a shared rule
+    // are themselves shared since they have the same canonical form.
+    // Count private rules to find where shared ids start.
+    int max_private = 0;
+    for(int rank = 0; rank < mpi_size; rank++) {
+        int* g = grammars[rank];
+        int private_rules = 0, pos = 1;
+        for(int r = 0; r < g[0]; r++) {
+            CanonicalRule* entry = by_cid[cids[rank][-g[pos]]];
+            if(g[pos] == -1 || !(entry->referenced && entry->ranks > 1))
+                private_rules++;
+            pos += 2 + 2*g[pos+1];
+        }
+        if(private_rules > max_private)
+            max_private = private_rules;
+    }
+
+    int num_shared = 0, shared_symbols = 0;
+    for(int cid = 1; cid <= num_cids; cid++) {
+        CanonicalRule* entry = by_cid[cid];
+        if(entry->referenced && entry->ranks > 1) {
+            entry->sid = -(max_private + 1 + num_shared);
+            num_shared++;
+            shared_symbols += entry->key_len / sizeof(int) / 2;
+        }
+    }
+
+    // 3. Serialize the shared dictionary
+    *shared_integers = 1 + 2*num_shared + 2*shared_symbols;
+    int* shared = recorder_malloc(sizeof(int) * (*shared_integers));
+    int si = 0;
+    shared[si++] = num_shared;
+    for(int cid = 1; cid <= num_cids; cid++) {
+        CanonicalRule* entry = by_cid[cid];
+        if(entry->sid == 0) continue;
+        int symbols = entry->key_len / sizeof(int) / 2;
+        shared[si++] = entry->sid;
+        shared[si++] = symbols;
+        for(int i = 0; i < symbols; i++) {
+            int val = entry->key[2*i+0];
+            shared[si++] = (val < 0) ? by_cid[-val]->sid : val;
+            shared[si++] = entry->key[2*i+1];
+        }
+    }
+
+    // 4. Rewrite each rank's grammar with private rules only
+    for(int rank = 0; rank < mpi_size; rank++) {
+        int* g = grammars[rank];
+        int* new_ids = recorder_malloc(sizeof(int) * id_range[rank]);
+
+        int private_rules = 0, private_integers = 1, pos = 1;
+        for(int r = 0; r < g[0]; r++) {
+            CanonicalRule* entry = by_cid[cids[rank][-g[pos]]];
+            if(g[pos] == -1 || entry->sid == 0) {
+                new_ids[-g[pos]] = -(++private_rules);
+                private_integers += 2 + 2*g[pos+1];
+            } else {
+                new_ids[-g[pos]] = entry->sid;
+            }
+            pos += 2 + 2*g[pos+1];
+        }
+
+        int* ng = recorder_malloc(sizeof(int) * private_integers);
+        int ni = 0;
+        ng[ni++] = private_rules;
+        pos = 1;
+        for(int r = 0; r < g[0]; r++) {
+            int rule_id = g[pos], symbols = g[pos+1];
+            CanonicalRule* entry = by_cid[cids[rank][-rule_id]];
+            if(rule_id == -1 || entry->sid == 0) {
+                ng[ni++] = new_ids[-rule_id];
+                ng[ni++] = symbols;
+                for(int i = 0; i < symbols; i++) {
+                    int val = g[pos+2+2*i];
+                    ng[ni++] = (val < 0) ? new_ids[-val] : val;
+                    ng[ni++] = g[pos+3+2*i];
+                }
+            }
+            pos += 2 + 2*symbols;
+        }
+
+        grammars[rank] = ng;
+        integers[rank] = private_integers;
+
+        recorder_free(new_ids, sizeof(int) * id_range[rank]);
+        recorder_free(cids[rank], sizeof(int) * id_range[rank]);
+        recorder_free(rule_pos[rank], sizeof(int) * id_range[rank]);
+    }
+
+    CanonicalRule *entry, *tmp;
+    HASH_ITER(hh, table, entry, tmp) {
+        HASH_DEL(table, entry);
+        recorder_free(entry->key, entry->key_len);
+        recorder_free(entry, sizeof(CanonicalRule));
+    }
+    free(by_cid);
+    recorder_free(id_range, sizeof(int) * mpi_size);
+    recorder_free(cids, sizeof(int*) * mpi_size);
+    recorder_free(rule_pos, sizeof(int*) * mpi_size);
+
+    RECORDER_LOGINFO("[Recorder] shared grammar rules: %d\n", num_shared);
+    return shared;
+}
+
+void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank, int mpi_size, bool share_rules) {
     int grammar_ids[mpi_size];
     int integers;
     int *local_grammar = serialize_grammar(lg, &integers);
@@ -90,6 +346,22 @@ void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank,
 
     if(mpi_rank !=0) return;
 
+    int* grammars[mpi_size];
+    for(int rank = 0; rank < mpi_size; rank++)
+        grammars[rank] = gathered_grammars + displs[rank];
+
+    if(share_rules) {
+        int shared_integers;
+        int* shared = extract_shared_rules(grammars, recvcounts, mpi_size, &shared_integers);
+
+        char sg_filename[1096] = {0};
+        sprintf(sg_filename, "%s/sg.cfg", path);
+        FILE* sg_file = fopen(sg_filename, "wb");
+        recorder_write_zlib((unsigned char*)shared, sizeof(int)*shared_integers, sg_file);
+        fclose(sg_file);
+        recorder_free(shared, sizeof(int)*shared_integers);
+    }
+
     char ug_filename[1096] = {0};
     sprintf(ug_filename, "%s/ug.cfg", path);
     FILE* ug_file = fopen(ug_filename, "wb");
@@ -98,7 +370,7 @@ void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank,
     for(int rank = 0; rank < mpi_size; rank++) {
 
         // Serialized grammar
-        int* g = gathered_grammars + displs[rank];
+        int* g = grammars[rank];
         int g_len = recvcounts[rank] * sizeof(int);
         //printf("rank: %d, grammar lengh: %d\n", rank, g_len);
 
@@ -129,6 +401,13 @@ void sequitur_save_unique_grammars(const char* path, Grammar* lg, int mpi_rank,
         recorder_free(ug, sizeof(UniqueGrammar));
     }
 
+    // Rewritten grammars were allocated by extract_shared_rules()
+    if(share_rules) {
+        for(int rank = 0; rank < mpi_size; rank++)
+            recorder_free(grammars[rank], sizeof(int)*recvcounts[rank]);
+    }
+    recorder_free(gathered_grammars, sizeof(int) * gathered_integers);
+
     char ug_metadata_fname[1096] = {0};
     sprintf(ug_metadata_fname, "%s/ug.mt", path);
     FILE* f = fopen(ug_metadata_fname, "wb");
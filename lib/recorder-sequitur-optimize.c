@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) by Argonne National Laboratory
+ *     See COPYRIGHT in top-level directory
+ */
+
+/**
+ * Finalize-time grammar re-optimization
+ *
+ * Sequitur is an online algorithm and only enforces digram
+ * uniqueness and rule utility, so the grammar it leaves behind
+ * is often far from minimal. Typical examples are loops whose
+ * body got split across a rule boundary, e.g., a (b a)^n b
+ * instead of (a b)^(n+1), rules used only once under a repetition,
+ * and digrams that were never repeated "at the same time".
+ *
+ * Here we run a few cheap passes over the serialized grammar
+ * before it is written out:
+ *
+ *  1. Inline rules that cost more than they save, e.g., rules used
+ *     only once, merging adjacent runs (X^a X^b = X^(a+b)).
+ *  2. Loop-aware fixes: absorb neighbouring copies of a rule body
+ *     into the repetition of that rule and rotate loops whose body
+ *     is split across the loop boundary.
+ *  3. Re-Pair: repeatedly replace the most frequent digram with a
+ *     new rule as long as it shrinks the grammar.
+ *
+ * The passes are repeated until nothing changes or the step budget
+ * is exhausted. Each Re-Pair replacement and each round of the
+ * other passes is a step. The budget counts work rather than time,
+ * so identical grammars, e.g., of different ranks, are optimized
+ * into identical grammars and are still stored only once.
+ * Every pass preserves the expansion of the main rule, so the
+ * reader needs no change.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "recorder-sequitur.h"
+#include "recorder-utils.h"
+#include "uthash.h"
+
+typedef struct OptRule_t {
+    int *body;              // 2i+0: val, 2i+1: exp
+    int len;                // number of symbols
+    int cap;                // capacity in symbols
+    int refs;               // number of symbols referencing this rule
+    int ref_max_exp;        // max exp of the symbols referencing this rule
+    bool alive;
+} OptRule;
+
+typedef struct OptGrammar_t {
+    OptRule *rules;         // rules[-rule_id]
+    int num_rules;          // number of slots, i.e., max(-rule_id) + 1
+    int main_id;
+    bool overflow;          // an exponent would not fit in an int
+} OptGrammar;
+
+typedef struct OptDigram_t {
+    int key[4];             // val1, exp1, val2, exp2
+    int count;
+    UT_hash_handle hh;
+} OptDigram;
+
+
+static void rule_push(OptRule *r, int val, int exp, bool *overflow) {
+    // Merge runs: X^a X^b = X^(a+b)
+    if(r->len > 0 && r->body[2*(r->len-1)] == val) {
+        long long e = (long long)r->body[2*(r->len-1)+1] + exp;
+        if(e > INT_MAX) {
+            *overflow = true;
+            return;
+        }
+        r->body[2*(r->len-1)+1] = (int) e;
+        return;
+    }
+    if(r->len == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 4;
+        r->body = realloc(r->body, sizeof(int) * 2 * r->cap);
+    }
+    r->body[2*r->len]   = val;
+    r->body[2*r->len+1] = exp;
+    r->len++;
+}
+
+static void rule_reset(OptRule *r) {
+    if(r->body) free(r->body);
+    memset(r, 0, sizeof(OptRule));
+}
+
+static int new_opt_rule(OptGrammar *og) {
+    og->rules = realloc(og->rules, sizeof(OptRule) * (og->num_rules+1));
+    memset(&og->rules[og->num_rules], 0, sizeof(OptRule));
+    og->rules[og->num_rules].alive = true;
+    return -(og->num_rules++);
+}
+
+static void load_grammar(OptGrammar *og, int *g) {
+    int rules = g[0];
+    int max_id = 1;
+    int pos = 1;
+    for(int r = 0; r < rules; r++) {
+        if(-g[pos] > max_id) max_id = -g[pos];
+        pos += 2 + 2*g[pos+1];
+    }
+
+    og->num_rules = max_id + 1;
+    og->rules = calloc(og->num_rules, sizeof(OptRule));
+    og->main_id = g[1];
+    og->overflow = false;
+
+    pos = 1;
+    for(int r = 0; r < rules; r++) {
+        OptRule *rule = &og->rules[-g[pos]];
+        rule->alive = true;
+        for(int i = 0; i < g[pos+1]; i++)
+            rule_push(rule, g[pos+2+2*i], g[pos+3+2*i], &og->overflow);
+        pos += 2 + 2*g[pos+1];
+    }
+}
+
+static void count_refs(OptGrammar *og) {
+    for(int id = 0; id < og->num_rules; id++) {
+        og->rules[id].refs = 0;
+        og->rules[id].ref_max_exp = 0;
+    }
+    for(int id = 0; id < og->num_rules; id++) {
+        OptRule *r = &og->rules[id];
+        if(!r->alive) continue;
+        for(int i = 0; i < r->len; i++) {
+            int val = r->body[2*i];
+            if(val < 0) {
+                OptRule *ref = &og->rules[-val];
+                ref->refs++;
+                if(r->body[2*i+1] > ref->ref_max_exp)
+                    ref->ref_max_exp = r->body[2*i+1];
+            }
+        }
+    }
+}
+
+static int grammar_size(OptGrammar *og) {
+    int size = 1;
+    for(int id = 0; id < og->num_rules; id++)
+        if(og->rules[id].alive)
+            size += 2 + 2*og->rules[id].len;
+    return size;
+}
+
+/*
+ * A rule of L symbols used c times costs 2+2L+2c integers,
+ * inlining it costs 2Lc integers (less if runs merge).
+ * So inlining pays off if (L-1)*(c-1) < 2, i.e., L == 1,
+ * c == 1, or L == c == 2. Rules with more than one symbol
+ * can only be inlined where they are not repeated.
+ */
+static bool is_inlinable(OptGrammar *og, int val) {
+    if(val >= 0 || val == og->main_id) return false;
+    OptRule *r = &og->rules[-val];
+    if(r->len == 1) return true;
+    return r->ref_max_exp == 1 && (r->len-1) * (r->refs-1) < 2;
+}
+
+static void emit_symbol(OptGrammar *og, bool *inlined, OptRule *dst, int val, int exp) {
+    if(val >= 0 || !inlined[-val]) {
+        rule_push(dst, val, exp, &og->overflow);
+        return;
+    }
+
+    OptRule *r = &og->rules[-val];
+    if(r->len == 1) {
+        long long e = (long long)r->body[1] * exp;
+        if(e > INT_MAX) {
+            og->overflow = true;
+            return;
+        }
+        emit_symbol(og, inlined, dst, r->body[0], (int)e);
+    } else {
+        // never repeated, see is_inlinable()
+        for(int i = 0; i < r->len; i++)
+            emit_symbol(og, inlined, dst, r->body[2*i], r->body[2*i+1]);
+    }
+}
+
+/*
+ * Pass 1: inline rules that do not pay off
+ * return true if any rule was inlined
+ */
+static bool inline_pass(OptGrammar *og) {
+    count_refs(og);
+
+    bool changed = false;
+    bool *inlined = calloc(og->num_rules, sizeof(bool));
+    for(int id = 1; id < og->num_rules; id++) {
+        if(og->rules[id].alive && og->rules[id].refs > 0 && is_inlinable(og, -id)) {
+            inlined[id] = true;
+            changed = true;
+        }
+    }
+
+    if(changed) {
+        for(int id = 1; id < og->num_rules; id++) {
+            OptRule *r = &og->rules[id];
+            if(!r->alive || inlined[id]) continue;
+            OptRule nr = {0};
+            for(int i = 0; i < r->len; i++)
+                emit_symbol(og, inlined, &nr, r->body[2*i], r->body[2*i+1]);
+            free(r->body);
+            r->body = nr.body;
+            r->len  = nr.len;
+            r->cap  = nr.cap;
+        }
+        for(int id = 1; id < og->num_rules; id++)
+            if(inlined[id]) rule_reset(&og->rules[id]);
+    }
+
+    free(inlined);
+    return changed;
+}
+
+static bool symbols_equal(int *a, int *b, int len) {
+    return memcmp(a, b, sizeof(int) * 2 * len) == 0;
+}
+
+/*
+ * Pass 2: loop-aware fixes
+ *
+ * For every symbol R^n where R's body is u_1 ... u_k:
+ *  - u_1 ... u_k R^n and R^n u_1 ... u_k become R^(n+1)
+ *  - u_k R^n u_1 ... u_(k-1) becomes R'^(n+1), where
+ *    R' = u_k u_1 ... u_(k-1) is the rotated loop body
+ *
+ * return true if any symbol was rewritten
+ */
+static bool loop_pass(OptGrammar *og) {
+    bool changed = false;
+    int num_rules = og->num_rules;
+    int *rotated = calloc(num_rules, sizeof(int));     // rotated[-R] = R'
+
+    for(int id = 1; id < num_rules; id++) {
+        if(!og->rules[id].alive) continue;
+
+        OptRule nr = {0};
+        int i = 0;
+        while(i < og->rules[id].len) {
+            OptRule *r = &og->rules[id];
+            int val = r->body[2*i], exp = r->body[2*i+1];
+
+            if(val >= 0 || val == og->main_id || og->rules[-val].len < 2) {
+                rule_push(&nr, val, exp, &og->overflow);
+                i++;
+                continue;
+            }
+
+            // R may be re-allocated when creating R' below
+            int k = og->rules[-val].len;
+            int *u = og->rules[-val].body;
+
+            // absorb preceding copies already emitted
+            while(nr.len >= k && exp < INT_MAX &&
+                  symbols_equal(&nr.body[2*(nr.len-k)], u, k)) {
+                nr.len -= k;
+                exp++;
+                changed = true;
+            }
+            // absorb following copies
+            int next = i + 1;
+            while(next + k <= r->len && exp < INT_MAX &&
+                  symbols_equal(&r->body[2*next], u, k)) {
+                next += k;
+                exp++;
+                changed = true;
+            }
+
+            // rotate: u_k R^n u_1 ... u_(k-1)
+            if(nr.len >= 1 && next + k-1 <= r->len && exp < INT_MAX &&
+               symbols_equal(&nr.body[2*(nr.len-1)], &u[2*(k-1)], 1) &&
+               symbols_equal(&r->body[2*next], u, k-1)) {
+                if(rotated[-val] == 0) {
+                    int rid = new_opt_rule(og);
+                    r = &og->rules[id];
+                    u = og->rules[-val].body;
+                    OptRule *rot = &og->rules[-rid];
+                    rule_push(rot, u[2*(k-1)], u[2*(k-1)+1], &og->overflow);
+                    for(int j = 0; j < k-1; j++)
+                        rule_push(rot, u[2*j], u[2*j+1], &og->overflow);
+                    rotated[-val] = rid;
+                }
+                nr.len -= 1;
+                next += k-1;
+                val = rotated[-val];
+                exp++;
+                changed = true;
+            }
+
+            rule_push(&nr, val, exp, &og->overflow);
+            i = next;
+        }
+
+        OptRule *r = &og->rules[id];
+        free(r->body);
+        r->body = nr.body;
+        r->len  = nr.len;
+        r->cap  = nr.cap;
+    }
+
+    free(rotated);
+    return changed;
+}
+
+/*
+ * Pass 3: one Re-Pair step
+ *
+ * Replacing a digram that occurs c times with a new rule
+ * saves 2c integers and the new rule costs 2+2*2 integers,
+ * so the grammar only shrinks for c >= 4.
+ *
+ * return true if a digram was replaced
+ */
+static bool repair_step(OptGrammar *og) {
+    OptDigram *table = NULL, *d, *tmp, *best = NULL;
+
+    for(int id = 1; id < og->num_rules; id++) {
+        OptRule *r = &og->rules[id];
+        if(!r->alive) continue;
+        for(int i = 0; i + 1 < r->len; i++) {
+            HASH_FIND(hh, table, &r->body[2*i], sizeof(int)*4, d);
+            if(d == NULL) {
+                d = calloc(1, sizeof(OptDigram));
+                memcpy(d->key, &r->body[2*i], sizeof(int)*4);
+                HASH_ADD(hh, table, key, sizeof(int)*4, d);
+            }
+            // adjacent symbols never share a val after run merging,
+            // so occurrences of a digram can not overlap
+            d->count++;
+            if(best == NULL || d->count > best->count)
+                best = d;
+        }
+    }
+
+    bool changed = false;
+    if(best && best->count >= 4) {
+        int key[4];
+        memcpy(key, best->key, sizeof(key));
+        int rid = new_opt_rule(og);
+        rule_push(&og->rules[-rid], key[0], key[1], &og->overflow);
+        rule_push(&og->rules[-rid], key[2], key[3], &og->overflow);
+
+        for(int id = 1; id < og->num_rules; id++) {
+            OptRule *r = &og->rules[id];
+            if(!r->alive || id == -rid) continue;
+            OptRule nr = {0};
+            for(int i = 0; i < r->len; i++) {
+                if(i + 1 < r->len && memcmp(&r->body[2*i], key, sizeof(key)) == 0) {
+                    rule_push(&nr, rid, 1, &og->overflow);
+                    i++;
+                } else {
+                    rule_push(&nr, r->body[2*i], r->body[2*i+1], &og->overflow);
+                }
+            }
+            free(r->body);
+            r->body = nr.body;
+            r->len  = nr.len;
+            r->cap  = nr.cap;
+        }
+        changed = true;
+    }
+
+    HASH_ITER(hh, table, d, tmp) {
+        HASH_DEL(table, d);
+        free(d);
+    }
+    return changed;
+}
+
+static void mark_reachable(OptGrammar *og, int val, int *new_ids, int *next_id) {
+    if(new_ids[-val] != 0) return;
+    new_ids[-val] = (*next_id)--;
+    OptRule *r = &og->rules[-val];
+    for(int i = 0; i < r->len; i++)
+        if(r->body[2*i] < 0)
+            mark_reachable(og, r->body[2*i], new_ids, next_id);
+}
+
+/*
+ * Drop unreachable rules and renumber the rest
+ * compactly, the main rule comes first and keeps its id.
+ */
+static int* store_grammar(OptGrammar *og, int *integers) {
+    int *new_ids = calloc(og->num_rules, sizeof(int));
+    int next_id = og->main_id;
+    mark_reachable(og, og->main_id, new_ids, &next_id);
+
+    int num_rules = og->main_id - next_id;
+    int *order = malloc(sizeof(int) * num_rules);
+    int total = 1;
+    for(int id = 1; id < og->num_rules; id++) {
+        if(new_ids[id] == 0) continue;
+        order[og->main_id - new_ids[id]] = id;
+        total += 2 + 2*og->rules[id].len;
+    }
+
+    int *data = recorder_malloc(sizeof(int) * total);
+    int pos = 0;
+    data[pos++] = num_rules;
+    for(int i = 0; i < num_rules; i++) {
+        OptRule *r = &og->rules[order[i]];
+        data[pos++] = new_ids[order[i]];
+        data[pos++] = r->len;
+        for(int j = 0; j < r->len; j++) {
+            int val = r->body[2*j];
+            data[pos++] = val < 0 ? new_ids[-val] : val;
+            data[pos++] = r->body[2*j+1];
+        }
+    }
+
+    free(order);
+    free(new_ids);
+    *integers = total;
+    return data;
+}
+
+/**
+ * Re-optimize a serialized grammar (see serialize_grammar())
+ *
+ * @g: [in] the serialized grammar, not modified
+ * @integers: [in/out] length of g, updated to the length of the returned grammar
+ * @step_budget: stop after this many steps
+ * @return: the optimized grammar, or NULL if it is not smaller than g
+ */
+int* sequitur_optimize_grammar(int* g, int* integers, int step_budget) {
+    int steps = 0;
+
+    OptGrammar og;
+    load_grammar(&og, g);
+
+    int size = grammar_size(&og);
+    while(!og.overflow && steps < step_budget) {
+        steps++;
+        inline_pass(&og);
+        loop_pass(&og);
+        while(!og.overflow && steps < step_budget) {
+            steps++;
+            if(!repair_step(&og)) break;
+        }
+        inline_pass(&og);
+
+        int new_size = grammar_size(&og);
+        if(new_size >= size) break;
+        size = new_size;
+    }
+
+    int *data = NULL;
+    if(!og.overflow) {
+        int new_integers;
+        data = store_grammar(&og, &new_integers);
+        if(new_integers < *integers) {
+            *integers = new_integers;
+        } else {
+            recorder_free(data, sizeof(int) * new_integers);
+            data = NULL;
+        }
+    }
+
+    for(int id = 0; id < og.num_rules; id++)
+        rule_reset(&og.rules[id]);
+    free(og.rules);
+    return data;
+}
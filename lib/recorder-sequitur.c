@@ -253,6 +253,7 @@ void sequitur_init_rule_id(Grammar *grammar, int start_rule_id, bool twins_remov
     grammar->rules = NULL;
     grammar->rule_id = start_rule_id;
     grammar->twins_removal = twins_removal;
+    grammar->optimization_budget = 0;
 
 
     // Add the main rule: S, which will be the head of the rule list
@@ -22,8 +22,32 @@ int main(int argc, char** argv) {
         offset += 5;
     }
 
+    // Two descriptors of the same file, used in turn. Offsets
+    // are relative to the previous access of the file, whichever
+    // descriptor made it, and closing one of them starts over.
+    int fd2 = open("./workfile.out", O_WRONLY);
+    for(int i = 0; i < 10; i++) {
+        pwrite(fd, data, 5, 100 + i*10);
+        pwrite(fd2, data, 5, i*10);
+        lseek(fd2, i*20, SEEK_SET);
+    }
+    close(fd2);
+    for(int i = 0; i < 10; i++)
+        pwrite(fd, data, 5, 200 + i*5);
+
     close(fd);
 
+    // Interprocess patterns: a header written at the same offset
+    // by all ranks stays a literal, only the rank-dependent
+    // offsets become rank templates.
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_File fh;
+    MPI_File_open(MPI_COMM_WORLD, "./workfile.mpi.out", MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+    MPI_File_write_at(fh, 0, data, 5, MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_File_write_at_all(fh, 64 + rank*5, data, 5, MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+
     MPI_Finalize();
     return 0;
 }
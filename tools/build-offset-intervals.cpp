@@ -1,10 +1,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <vector>
+#include <deque>
+#include <queue>
 #include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 extern "C" {                            // Needed to mix linking C and C++ sources
 #include "reader.h"
 #include "reader-private.h"
@@ -12,212 +17,351 @@ extern "C" {                            // Needed to mix linking C and C++ sourc
 
 using namespace std;
 
-typedef struct RRecord_t {
+/*
+ * What a call does to the offsets, decided once per function
+ * from its name, in the same order as the checks were made
+ * on every record before
+ */
+enum OpKind {
+    OP_NONE,
+    OP_MPI,             // MPI_File_read*/write*, file handle of the POSIX calls it makes
+    OP_FOPEN,           // fopen, fdopen: offset 0, or eof when appending
+    OP_OPEN,
+    OP_SEEK,
+    OP_CLOSE,
+    OP_SYNC,
+    OP_RW_VECTOR,       // readv, writev: args[1] bytes at the file pointer
+    OP_RW_STREAM,       // fread, fwrite: args[1]*args[2] bytes of stream args[3]
+    OP_RW_POSITIONED,   // pread, pwrite: args[2] bytes at args[3]
+    OP_RW,              // read, write: args[2] bytes at the file pointer
+};
+
+/*
+ * Records decoded from a rank at a time, the next batch is
+ * decoded once the merge used up the last one. DECODE_BUDGET
+ * is divided among the ranks. Every batch inflates timestamps
+ * from the checkpoint before it, so it is not made smaller
+ * than DECODE_BATCH_MIN.
+ */
+#define DECODE_BUDGET    (1<<22)
+#define DECODE_BATCH_MIN (1<<12)
+#define DECODE_BATCH_MAX (1<<16)
+
+/*
+ * A decoded call, with the arguments needed for the offsets
+ * already parsed. Files are ids in the table of the rank,
+ * mapped to global ids when the op is merged.
+ */
+typedef struct Op_t {
+    double tstart;
+    int    seq_id;
+    int    file;                // file, or MPI file handle for OP_MPI
+    unsigned char kind;
+    unsigned char call_depth;
+    bool   is_read;
+    size_t count;               // bytes; seek offset for OP_SEEK; append for opens
+    size_t offset;              // OP_RW_POSITIONED offset; whence for OP_SEEK
+} Op;
+
+/*
+ * Strings interned to ids
+ */
+typedef struct NameTable_t {
+    unordered_map<string, int> ids;
+    vector<string> names;
+
+    int id(const char* name) {
+        auto it = ids.find(name);
+        if(it != ids.end())
+            return it->second;
+        int id = names.size();
+        ids.emplace(name, id);
+        names.push_back(name);
+        return id;
+    }
+} NameTable;
+
+typedef struct RankOps_t {
     int rank;
-    int seq_id;
-    Record* record;
-} RRecord;
+    double tstart;              // first record of the rank, none of its ops start before
+    bool* selected;             // call signatures to decode, until the cursor is opened
+    RecordCursor* cursor;       // NULL before the merge reaches the rank and once it is done
+    deque<Op> ops;              // decoded batch, in time order, consumed by the merge
+    NameTable files;
+    NameTable handles;
+    vector<int> global_files;   // global_files[file id of the rank]
+} RankOps;
+
+/*
+ * Offsets and eofs seen by a rank while merging
+ */
+typedef struct RankState_t {
+    unordered_map<int, size_t> offset_book;     // <file, current offset>
+    unordered_map<int, size_t> local_eof;       // <file, eof> (locally)
+    int mpifh;                                  // handle of the current MPI call, -1 if none
+    int mpi_call_depth;
+} RankState;
 
 
 RecorderReader *reader;
-vector<RRecord> records;
+static vector<unsigned char> func_kinds;        // func_kinds[func_id]
+static size_t decode_batch_records;
 
-static inline size_t str2sizet(char* arg) {
-    size_t res;
+static inline size_t str2sizet(const char* arg) {
+    size_t res = 0;
     sscanf(arg, "%zu", &res);
     return res;
 }
 
-size_t get_eof(string filename, unordered_map<string, size_t> local_eof, unordered_map<string, size_t> global_eof) {
-    size_t e1 = 0, e2 = 0;
-    if(local_eof.find(filename) != local_eof.end())
-        e1 = local_eof[filename];
-    if(global_eof.find(filename) != global_eof.end())
-        e2 = global_eof[filename];
-    return max(e1, e2);
-}
-
-void handle_data_operation(RRecord &rr,
-                            unordered_map<string, size_t> &offset_book,          // <fd, current offset>
-                            unordered_map<string, size_t> &local_eof,            // <filename, eof> (locally)
-                            unordered_map<string, size_t> &global_eof,           // <filename, eof> (globally)
-                            unordered_map<string, vector<Interval>> &intervals,
-                            string current_mpifh, int current_mpi_call_depth)
-{
-    Record *R = rr.record;
-    const char* func = recorder_get_func_name(reader, R);
+static int op_kind(const char* func) {
+    // only MPI_File_write* and MPI_File_read* calls are decoded
+    if(strstr(func, "MPI"))
+        return OP_MPI;
+
+    if(strstr(func, "fopen") || strstr(func, "fdopen"))
+        return OP_FOPEN;
+    if(strstr(func, "open"))
+        return OP_OPEN;
+    if(strstr(func, "seek"))
+        return OP_SEEK;
+    if(strstr(func, "close"))
+        return OP_CLOSE;
+    if(strstr(func, "sync"))
+        return OP_SYNC;
 
     if(!strstr(func, "read") && !strstr(func, "write"))
-        return;
-
-    Interval I;
-    I.rank = rr.rank;
-    I.seqId = rr.seq_id;
-    I.tstart = R->tstart;
-    I.isRead = strstr(func, "read") ? true: false;
-    memset(I.mpifh, 0, sizeof(I.mpifh));
-    strcpy(I.mpifh, "-");
-
-    if(R->call_depth == current_mpi_call_depth+1)
-        strcpy(I.mpifh, current_mpifh.c_str());
-
-    string filename = "";
-    if(strstr(func, "writev") || strstr(func, "readv")) {
-        filename = R->args[0];
-        I.offset = offset_book[filename];
-        I.count = str2sizet(R->args[1]);
-        offset_book[filename] += I.count;
-    } else if(strstr(func, "fwrite") || strstr(func, "fread")) {
-        filename = R->args[3];
-        I.offset = offset_book[filename];
-        I.count = str2sizet(R->args[1]) * str2sizet(R->args[2]);
-        offset_book[filename] += I.count;
-    } else if(strstr(func, "pwrite") || strstr(func, "pread")) {
-        filename = R->args[0];
-        I.count = str2sizet(R->args[2]);
-        I.offset = str2sizet(R->args[3]);
-    } else if(strstr(func, "write") || strstr(func, "read")) {
-        filename = R->args[0];
-        I.count = str2sizet(R->args[2]);
-        I.offset = offset_book[filename];
-        offset_book[filename] += I.count;
-    } else if(strstr(func, "fprintf")) {
-        filename = R->args[0];
-        I.count = str2sizet(R->args[1]);
-        offset_book[filename] += I.count;
-    }
-
-    if(filename != "") {
-
-        if(local_eof.find(filename) == local_eof.end())
-            local_eof[filename] = I.offset + I.count;
-        else
-            local_eof[filename] = max(local_eof[filename], I.offset+I.count);
-
-        /* TODO:
-         * On POSIX systems, update global eof now
-         * On other systems (e.,g with commit semantics
-         * and session semantics), update global eof at
-         * close/sync ? */
-        global_eof[filename] = get_eof(filename, local_eof, global_eof);
-
-        intervals[filename].push_back(I);
-    }
+        return OP_NONE;
+    if(strstr(func, "writev") || strstr(func, "readv"))
+        return OP_RW_VECTOR;
+    if(strstr(func, "fwrite") || strstr(func, "fread"))
+        return OP_RW_STREAM;
+    if(strstr(func, "pwrite") || strstr(func, "pread"))
+        return OP_RW_POSITIONED;
+    return OP_RW;
 }
 
 /*
- * Inspect metadata operations to make
- * sure we can correctly keep track of
- * the position of file pointers.
- *
- * Params:
- *   offset_book: <filename, currect offset>
- *   local_eof:   <filename, eof>
- *   global_eof:  <filename, eof>
+ * Whether records of a call signature are needed
+ * to build the intervals
  */
-void handle_metadata_operation(RRecord &rr,
-                                unordered_map<string, size_t> &offset_book,
-                                unordered_map<string, size_t> &local_eof,
-                                unordered_map<string, size_t> &global_eof
-                              )
-{
-    Record *R = rr.record;
-    const char* func = recorder_get_func_name(reader, R);
+bool is_interval_call(Record* r, void* arg) {
 
-    string filename = "";
-
-    if(strstr(func, "fopen") || strstr(func, "fdopen")) {
-        filename = R->args[0];
-        offset_book[filename] = 0;
+    int func_type = recorder_get_func_type(reader, r);
+    const char* func = recorder_get_func_name(reader, r);
 
-        // append
-        if(strstr(R->args[1], "a"))
-            offset_book[filename] = get_eof(filename, local_eof, global_eof);
+    if((func_type != RECORDER_POSIX) && (func_type != RECORDER_MPIIO))
+        return false;
 
-    } else if(strstr(func, "open")) {
-        filename = R->args[0];
-        offset_book[filename] = 0;
+    // For MPI-IO calls keep only MPI_File_write* and MPI_File_read*
+    if((func_type == RECORDER_MPIIO) && (!strstr(func, "MPI_File_write"))
+        && (!strstr(func, "MPI_File_read")) && (!strstr(func, "MPI_File_iread"))
+        && (!strstr(func, "MPI_File_iwrite")))
+        return false;
 
-        /* TODO: Do O_APPEND, SEEK_SET, ... have
-         * the same value on this machine and the machine where
-         * traces were collected? */
-        int flag = atoi(R->args[1]);
-        if(flag & O_APPEND)
-            offset_book[filename] = get_eof(filename, local_eof, global_eof);
+    if(strstr(func, "dir") || strstr(func, "link"))
+        return false;
 
-    } else if(strstr(func, "seek") || strstr(func, "seeko")) {
-        filename = R->args[0];
-        size_t offset = str2sizet(R->args[1]);
-        int whence = atoi(R->args[2]);
+    return func_kinds[r->func_id] != OP_NONE;
+}
 
-        if(whence == SEEK_SET)
-            offset_book[filename] = offset;
-        else if(whence == SEEK_CUR)
-            offset_book[filename] += offset;
-        else if(whence == SEEK_END)
-            offset_book[filename] = get_eof(filename, local_eof, global_eof);
+void insert_one_op(Record* R, size_t seq_id, void* arg) {
+    RankOps* ro = (RankOps*) arg;
+    const char* func = recorder_get_func_name(reader, R);
 
-    } else if(strstr(func, "close") || strstr(func, "sync")) {
-        filename = R->args[0];
+    Op op;
+    op.tstart = R->tstart;
+    op.seq_id = seq_id;
+    op.kind = func_kinds[R->func_id];
+    op.call_depth = R->call_depth;
+    op.is_read = strstr(func, "read") ? true : false;
+    op.count = 0;
+    op.offset = 0;
+
+    switch(op.kind) {
+        case OP_MPI:
+            op.file = ro->handles.id(R->args[0]);
+            break;
+        case OP_FOPEN:
+            op.count = strstr(R->args[1], "a") ? 1 : 0;
+            break;
+        case OP_OPEN:
+            /* TODO: Do O_APPEND, SEEK_SET, ... have
+             * the same value on this machine and the machine where
+             * traces were collected? */
+            op.count = (atoi(R->args[1]) & O_APPEND) ? 1 : 0;
+            break;
+        case OP_SEEK:
+            op.count = str2sizet(R->args[1]);
+            op.offset = atoi(R->args[2]);
+            break;
+        case OP_RW_VECTOR:
+            op.count = str2sizet(R->args[1]);
+            break;
+        case OP_RW_STREAM:
+            if(R->arg_count < 4)
+                return;
+            op.count = str2sizet(R->args[1]) * str2sizet(R->args[2]);
+            break;
+        case OP_RW_POSITIONED:
+            op.count = str2sizet(R->args[2]);
+            op.offset = str2sizet(R->args[3]);
+            break;
+        case OP_RW:
+            op.count = str2sizet(R->args[2]);
+            break;
+    }
+    if(op.kind != OP_MPI)
+        op.file = ro->files.id(R->args[op.kind == OP_RW_STREAM ? 3 : 0]);
 
-        // Update the global eof at close time
-        global_eof[filename] = get_eof(filename, local_eof, global_eof);
+    ro->ops.push_back(op);
+}
 
-        // Remove from the table
-        if(strstr(func, "close"))
-            offset_book.erase(filename);
-    } else {
-        return;
+/*
+ * Decode batches of a rank until some calls that move
+ * offsets come out. Once the rank has no records left
+ * its cursor is closed, which unpins its CST and CFG.
+ */
+static bool decode_batch(RankOps& ro) {
+    while(ro.ops.empty()) {
+        if(recorder_cursor_decode(ro.cursor, decode_batch_records, insert_one_op, &ro) == 0) {
+            recorder_close_cursor(ro.cursor);
+            ro.cursor = NULL;
+            return false;
+        }
     }
+    return true;
 }
 
-bool compare_by_tstart(const RRecord &lhs, const RRecord &rhs) {
-    return lhs.record->tstart < rhs.record->tstart;
+/*
+ * Select the call signatures of each rank and find when its
+ * first record starts, concurrently. Only the selected ones
+ * are decoded, seq ids still count every record of the rank.
+ * The cursors are opened by the merge, see open_rank().
+ */
+static void select_ranks(vector<RankOps>& ranks) {
+    int nprocs = reader->metadata.total_ranks;
+    atomic<int> next_rank(0);
+    auto worker = [&]() {
+        int rank;
+        while((rank = next_rank++) < nprocs) {
+            RankOps* ro = &ranks[rank];
+            size_t records;
+            ro->rank = rank;
+            ro->cursor = NULL;
+            ro->selected = NULL;
+            recorder_get_rank_span(reader, rank, &records, &ro->tstart, NULL);
+            if(records > 0)
+                ro->selected = recorder_select_call_signatures(reader, rank, is_interval_call, NULL);
+        }
+    };
+
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > nprocs)
+        nthreads = nprocs;
+    vector<thread> threads;
+    for(int i = 1; i < nthreads; i++)
+        threads.emplace_back(worker);
+    worker();
+    for(auto& t : threads)
+        t.join();
 }
 
-static int current_seq_id = 0;
-
-void insert_one_record(Record* r, void* arg) {
+/*
+ * Open the cursor of a rank once the merge reaches the start
+ * of its first record and decode its first batch
+ */
+static bool open_rank(RankOps& ro) {
+    ro.cursor = recorder_open_cursor(reader, ro.rank, ro.selected);
+    free(ro.selected);
+    ro.selected = NULL;
+    return decode_batch(ro);
+}
 
-    /* increase seq id before the checks
-     * so we always have the correct seq id
-     * when we insert a record */
-    current_seq_id++;
+static size_t get_eof(RankState& st, vector<size_t>& global_eof, int file) {
+    size_t e1 = 0;
+    auto it = st.local_eof.find(file);
+    if(it != st.local_eof.end())
+        e1 = it->second;
+    return max(e1, global_eof[file]);
+}
 
-    int func_type = recorder_get_func_type(reader, r);
-    const char* func = recorder_get_func_name(reader, r);
+/*
+ * Inspect metadata operations to make
+ * sure we can correctly keep track of
+ * the position of file pointers.
+ */
+static void handle_metadata_operation(Op& op, RankState& st, vector<size_t>& global_eof) {
+    int f = op.file;
+    switch(op.kind) {
+        case OP_FOPEN:
+        case OP_OPEN:
+            st.offset_book[f] = op.count ? get_eof(st, global_eof, f) : 0;
+            break;
+        case OP_SEEK:
+            if(op.offset == SEEK_SET)
+                st.offset_book[f] = op.count;
+            else if(op.offset == SEEK_CUR)
+                st.offset_book[f] += op.count;
+            else if(op.offset == SEEK_END)
+                st.offset_book[f] = get_eof(st, global_eof, f);
+            break;
+        case OP_CLOSE:
+            // Update the global eof at close time
+            global_eof[f] = get_eof(st, global_eof, f);
+            // Remove from the table
+            st.offset_book.erase(f);
+            break;
+        case OP_SYNC:
+            global_eof[f] = get_eof(st, global_eof, f);
+            break;
+    }
+}
 
-    if((func_type != RECORDER_POSIX) && (func_type != RECORDER_MPIIO))
-        return;
+static void handle_data_operation(Op& op, int rank, RankState& st, vector<size_t>& global_eof,
+                                  vector<vector<Interval>>& intervals, NameTable& handles) {
+    int f = op.file;
+    Interval I;
+    I.rank = rank;
+    I.seqId = op.seq_id;
+    I.tstart = op.tstart;
+    I.isRead = op.is_read;
+    I.count = op.count;
+    memset(I.mpifh, 0, sizeof(I.mpifh));
+    strcpy(I.mpifh, "-");
 
-    // For MPI-IO calls keep only MPI_File_write* and MPI_File_read*
-    if((func_type == RECORDER_MPIIO) && (!strstr(func, "MPI_File_write")) 
-        && (!strstr(func, "MPI_File_read")) && (!strstr(func, "MPI_File_iread"))
-        && (!strstr(func, "MPI_File_iwrite")))
-        return;
-    
-    if(strstr(func, "dir") || strstr(func, "link"))
-        return;
+    if(st.mpifh >= 0 && op.call_depth == st.mpi_call_depth+1)
+        strncpy(I.mpifh, handles.names[st.mpifh].c_str(), sizeof(I.mpifh)-1);
 
-    RRecord rr;
-    rr.record = r;
-    rr.rank = *((int*) arg);
-    rr.seq_id = current_seq_id - 1;
+    if(op.kind == OP_RW_POSITIONED) {
+        I.offset = op.offset;
+    } else {
+        size_t& pos = st.offset_book[f];
+        I.offset = pos;
+        pos += I.count;
+    }
 
-    records.push_back(rr);
-}
+    size_t& eof = st.local_eof[f];
+    eof = max(eof, I.offset + I.count);
 
-void flatten_and_sort_records(RecorderReader *reader) {
+    /* TODO:
+     * On POSIX systems, update global eof now
+     * On other systems (e.,g with commit semantics
+     * and session semantics), update global eof at
+     * close/sync ? */
+    global_eof[f] = max(eof, global_eof[f]);
 
-    int nprocs = reader->metadata.total_ranks;
+    intervals[f].push_back(I);
+}
 
-    for(int rank = 0; rank < nprocs; rank++) {
-        current_seq_id = 0;
-        recorder_decode_records2(reader, rank, insert_one_record, &rank);
+typedef struct MergeHead_t {
+    double tstart;
+    int rank;
+    bool operator<(const MergeHead_t& other) const {   // reversed, for a min-heap
+        if(tstart != other.tstart)
+            return tstart > other.tstart;
+        return rank > other.rank;
     }
-
-    sort(records.begin(), records.end(), compare_by_tstart);
-}
+} MergeHead;
 
 /*
  * Return an array of <filename, intervals>
@@ -225,61 +369,112 @@ void flatten_and_sort_records(RecorderReader *reader) {
  * saved in 'num_files'.
  * caller is responsible for freeing space
  * after use.
+ *
+ * The calls of each rank are already in time order,
+ * they are merged across ranks with a heap on tstart
+ * (ties by rank) instead of being sorted together.
+ * Each rank is decoded a batch at a time as the merge
+ * goes, so only one batch per rank is held in memory,
+ * DECODE_BUDGET records over all ranks (unless there are
+ * more ranks than DECODE_BUDGET/DECODE_BATCH_MIN). A rank
+ * stays in the heap with the tstart of its first record
+ * until it is reached, only then its CST and CFG are
+ * loaded and pinned, until its last op is merged. Ranks
+ * running at the same time are still all pinned at once,
+ * the reader cache (RECORDER_READER_CACHE_MB) only bounds
+ * the others.
  */
 IntervalsMap* build_offset_intervals(RecorderReader *_reader, int *num_files) {
 
     reader = _reader;
-    flatten_and_sort_records(reader);
-
-    // <filename, intervals>
-    unordered_map<string, vector<Interval>> intervals;
-
-    unordered_map<string, size_t> offset_books[reader->metadata.total_ranks];
-    unordered_map<string, size_t> local_eofs[reader->metadata.total_ranks];
-    unordered_map<string, size_t> global_eof;
-
-    string current_mpifh = "";
-    int current_mpi_call_depth;
-
-    int i;
-    for(i = 0; i < records.size(); i++) {
-        RRecord rr = records[i];
-        const char* func = recorder_get_func_name(reader, rr.record);
-        // Only MPI_File_write* and MPI_File_read* calls here
-        // thanks to insert_one_record()
-        if(strstr(func, "MPI")) {
-            current_mpifh = rr.record->args[0];
-            current_mpi_call_depth = (int) rr.record->call_depth;
-        // POSIX calls
+    int nprocs = reader->metadata.total_ranks;
+
+    func_kinds.assign(256, OP_NONE);
+    for(int func_id = 0; func_id < reader->supported_funcs && func_id < 256; func_id++)
+        func_kinds[func_id] = op_kind(reader->func_list[func_id]);
+
+    decode_batch_records = DECODE_BUDGET / max(nprocs, 1);
+    decode_batch_records = max(decode_batch_records, (size_t) DECODE_BATCH_MIN);
+    decode_batch_records = min(decode_batch_records, (size_t) DECODE_BATCH_MAX);
+
+    vector<RankOps> ranks(nprocs);
+    select_ranks(ranks);
+
+    NameTable files;
+    vector<vector<Interval>> intervals;
+    vector<size_t> global_eof;
+    vector<RankState> states(nprocs);
+    for(RankState& st : states) {
+        st.mpifh = -1;
+        st.mpi_call_depth = -2;
+    }
+
+    priority_queue<MergeHead> heap;
+    for(int rank = 0; rank < nprocs; rank++)
+        if(ranks[rank].selected)
+            heap.push({ranks[rank].tstart, rank});
+
+    while(!heap.empty()) {
+        int rank = heap.top().rank;
+        heap.pop();
+        RankOps& ro = ranks[rank];
+        RankState& st = states[rank];
+
+        // reached the first record of the rank, its ops start no earlier
+        if(ro.selected) {
+            if(open_rank(ro))
+                heap.push({ro.ops.front().tstart, rank});
+            continue;
+        }
+
+        Op& op = ro.ops.front();
+
+        // file ids of the rank to global ones
+        if(op.kind != OP_MPI) {
+            while(ro.global_files.size() <= (size_t) op.file)
+                ro.global_files.push_back(files.id(ro.files.names[ro.global_files.size()].c_str()));
+            op.file = ro.global_files[op.file];
+            intervals.resize(files.names.size());
+            global_eof.resize(files.names.size(), 0);
+        }
+
+        if(op.kind == OP_MPI) {
+            st.mpifh = op.file;
+            st.mpi_call_depth = (int) op.call_depth;
+        } else if(op.kind >= OP_RW_VECTOR) {
+            handle_data_operation(op, rank, st, global_eof, intervals, ro.handles);
         } else {
-            handle_metadata_operation(rr, offset_books[rr.rank], local_eofs[rr.rank], global_eof);
-            handle_data_operation(rr, offset_books[rr.rank], local_eofs[rr.rank], global_eof, intervals, current_mpifh, current_mpi_call_depth);
+            handle_metadata_operation(op, st, global_eof);
         }
+
+        ro.ops.pop_front();
+        if(decode_batch(ro))
+            heap.push({ro.ops.front().tstart, rank});
     }
 
     /* Now we have the list of intervals for all files,
-     * we copy it from the C++ vector to a C style pointer.
-     * The vector and the memory it allocated will be
-     * freed once out of scope (leave this function)
+     * we copy it from the C++ vector to a C style pointer,
+     * one file at a time, freeing the vector once copied.
      * Also, using a C style struct is easier for Python binding.
      */
-    *num_files = intervals.size();
+    *num_files = 0;
+    for(auto& file_intervals : intervals)
+        if(!file_intervals.empty())
+            (*num_files)++;
 
     IntervalsMap *IM = (IntervalsMap*) malloc(sizeof(IntervalsMap) * (*num_files));
 
-    i = 0;
-    for(auto it = intervals.cbegin(); it != intervals.cend(); it++) {
-        /* it->first: filename
-         * it->second: vector<Interval> */
-        IM[i].filename = strdup(it->first.c_str());
-        IM[i].num_intervals = it->second.size();
-        IM[i].intervals = (Interval*) malloc(sizeof(Interval) * it->second.size());
-        memcpy(IM[i].intervals, it->second.data(), sizeof(Interval) * it->second.size());
+    int i = 0;
+    for(size_t f = 0; f < intervals.size(); f++) {
+        if(intervals[f].empty())
+            continue;
+        IM[i].filename = strdup(files.names[f].c_str());
+        IM[i].num_intervals = intervals[f].size();
+        IM[i].intervals = (Interval*) malloc(sizeof(Interval) * intervals[f].size());
+        memcpy(IM[i].intervals, intervals[f].data(), sizeof(Interval) * intervals[f].size());
+        vector<Interval>().swap(intervals[f]);
         i++;
     }
 
-    for(i = 0; i < records.size(); i++) {
-        recorder_free_record(records[i].record);
-    }
     return IM;
 }
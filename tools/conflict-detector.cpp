@@ -2,8 +2,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <vector>
+#include <string>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 extern "C" {
 #include "reader.h"
 #include "reader-private.h"
@@ -16,30 +22,22 @@ using namespace std;
 // and verification process.
 static int conflicts_cap = INT_MAX;
 
-int compare_by_offset(const void *lhs, const void *rhs) {
-    Interval *first = (Interval*)lhs;
-    Interval *second = (Interval*)rhs;
-    return first->offset - second->offset;
-}
-
-int compare_by_index(const void *lhs, const void *rhs) {
-    Interval *first = (Interval*)lhs;
-    Interval *second = (Interval*)rhs;
+#define OUTPUT_BUFFER_SIZE  (4*1024*1024)
+#define CHUNK_INTERVALS     (64*1024)       // intervals of a file scanned by one task
 
-    if (first->rank < second->rank)
-        return 1;
-    else if (first->rank == second->rank)
-        return first->seqId < second->seqId;
-    else
-        return 0;
+// total order, so that each pair is reported once and the same way every run
+static bool compare_by_offset(const Interval& first, const Interval& second) {
+    if (first.offset != second.offset)
+        return first.offset < second.offset;
+    if (first.rank != second.rank)
+        return first.rank < second.rank;
+    return first.seqId < second.seqId;
 }
 
-int sum_array(int *arr, int count) {
-    int i, sum = 0;
-    for(i = 0; i < count; i++) {
-        sum += arr[i];
-    }
-    return sum;
+static bool compare_by_index(const Interval* first, const Interval* second) {
+    if (first->rank != second->rank)
+        return first->rank < second->rank;
+    return first->seqId < second->seqId;
 }
 
 int is_conflict(Interval* i1, Interval* i2) {
@@ -55,93 +53,194 @@ int is_conflict(Interval* i1, Interval* i2) {
     return true;
 }
 
-void detect_conflicts(IntervalsMap *IM, int num_files, const char* base_dir) {
-    FILE* conflict_file;
-    char path[512];
-    size_t total_conflicts = 0;
+/*
+ * Intervals of a file sorted by offset. The intervals that may
+ * conflict with intervals[i] and come after it are the ones
+ * starting before it ends, a contiguous range. For a read only
+ * the writes of that range are visited, so overlapping reads
+ * (and writes of the same rank, rare) are the only pairs looked
+ * at without being reported.
+ */
+typedef struct SortedFile_t {
+    Interval* intervals;
+    size_t num_intervals;
+    vector<size_t> writes;      // positions of the writes in intervals
+} SortedFile;
+
+typedef struct Detector_t {
+    vector<SortedFile> files;
+    vector<pair<int, size_t>> tasks;     // <file, first interval>
+    atomic<size_t> next_task;
+    atomic<size_t> total_conflicts;
+    FILE* out;
+    mutex out_lock;
+} Detector;
+
+static void flush_output(Detector* d, string& buf) {
+    lock_guard<mutex> guard(d->out_lock);
+    fwrite(buf.data(), 1, buf.size(), d->out);
+    buf.clear();
+}
 
-    sprintf(path, "%s/conflicts.dat", base_dir);
-    conflict_file = fopen(path, "w");
-
-    int idx, i, j;
-    for(idx = 0; idx < num_files; idx++) {
-
-        char *filename = IM[idx].filename;
-        Interval *intervals = IM[idx].intervals;
-        //fprintf(conflict_file, "#%d:%s\n", idx, filename);
-
-        // sort by offset
-        qsort(intervals, IM[idx].num_intervals, sizeof(Interval), compare_by_offset);
-
-        int i = 0, j = 0;
-        Interval *i1, *i2;
-
-        while(i < IM[idx].num_intervals-1) {
-            i1 = &intervals[i];
-            j = i + 1;
-
-            vector<Interval*> conflicts;
-            while(j < IM[idx].num_intervals) {
-                i2 = &intervals[j];
-
-                if(is_conflict(i1,i2)) {
-                    conflicts.push_back(i2);
-                }
-
-                if(i1->offset+i1->count > i2->offset) {
-                    j++;
-                } else {
-                    // skip the rest, as they will all have
-                    // a bigger starting offset
-                    break;
-                }
-            }
-
-            size_t num_conflict_pairs = conflicts.size();
-            if (num_conflict_pairs > 0) {
-                total_conflicts += num_conflict_pairs;
-
-                fwrite(&i1->rank, sizeof(int), 1, conflict_file);
-                fwrite(&i1->seqId, sizeof(int), 1, conflict_file);
-                fwrite(&num_conflict_pairs, sizeof(size_t), 1, conflict_file);
-
-                // previously intervals were sorted by starting offset
-                // when saving it out, we sort it by sequence id
-                sort(conflicts.begin(), conflicts.end(), compare_by_index);
-
-                // write out all conflict pairs
-                for (vector<Interval*>::iterator it = conflicts.begin(); it!=conflicts.end(); ++it) {
-                    i2 = *it;
-                    fwrite(&i2->rank, sizeof(int), 1, conflict_file);
-                    fwrite(&i2->seqId, sizeof(int), 1, conflict_file);
-                }
-                conflicts.clear();
-            }
-
-            // end of one starting operation
-            // move on to the next one
-            i++;
-            if (total_conflicts > conflicts_cap)
-                goto done;
-        } // end of one file
+static void put_int(string& buf, int v) {
+    buf.append((const char*) &v, sizeof(int));
+}
+
+/*
+ * Conflicts of intervals [first, last) of a file, each with
+ * the intervals that come after it, written to buf as
+ * rank, seqId, number of pairs, then (rank, seqId) of each
+ */
+static void detect_range(Detector* d, SortedFile& f, size_t first, size_t last,
+                         vector<Interval*>& conflicts, string& buf) {
+    Interval* intervals = f.intervals;
+    for (size_t i = first; i < last; i++) {
+        Interval* i1 = &intervals[i];
+        size_t end = i1->offset + i1->count;
+        conflicts.clear();
+
+        if (!i1->isRead) {
+            for (size_t j = i + 1; j < f.num_intervals && intervals[j].offset < end; j++)
+                if (is_conflict(i1, &intervals[j]))
+                    conflicts.push_back(&intervals[j]);
+        } else {
+            auto w = upper_bound(f.writes.begin(), f.writes.end(), i);
+            for (; w != f.writes.end() && intervals[*w].offset < end; ++w)
+                if (is_conflict(i1, &intervals[*w]))
+                    conflicts.push_back(&intervals[*w]);
+        }
+
+        size_t num_conflict_pairs = conflicts.size();
+        if (num_conflict_pairs == 0)
+            continue;
+
+        put_int(buf, i1->rank);
+        put_int(buf, i1->seqId);
+        buf.append((const char*) &num_conflict_pairs, sizeof(size_t));
+
+        // previously intervals were sorted by starting offset
+        // when saving it out, we sort it by sequence id
+        sort(conflicts.begin(), conflicts.end(), compare_by_index);
+        for (Interval* i2 : conflicts) {
+            put_int(buf, i2->rank);
+            put_int(buf, i2->seqId);
+        }
+        if (buf.size() >= OUTPUT_BUFFER_SIZE)
+            flush_output(d, buf);
+
+        if (d->total_conflicts.fetch_add(num_conflict_pairs) + num_conflict_pairs > (size_t) conflicts_cap)
+            return;
+    }
+}
+
+static void detect_worker(Detector* d) {
+    vector<Interval*> conflicts;
+    string buf;
+    buf.reserve(OUTPUT_BUFFER_SIZE + 1024);
+
+    while (d->total_conflicts <= (size_t) conflicts_cap) {
+        size_t task = d->next_task++;
+        if (task >= d->tasks.size())
+            break;
+        SortedFile& f = d->files[d->tasks[task].first];
+        size_t first = d->tasks[task].second;
+        size_t last  = min(first + CHUNK_INTERVALS, f.num_intervals);
+        detect_range(d, f, first, last, conflicts, buf);
     }
+    flush_output(d, buf);
+}
+
+static void sort_worker(Detector* d, vector<int>* order, atomic<size_t>* next) {
+    size_t k;
+    while ((k = (*next)++) < order->size()) {
+        SortedFile& f = d->files[(*order)[k]];
+        sort(f.intervals, f.intervals + f.num_intervals, compare_by_offset);
+        for (size_t i = 0; i < f.num_intervals; i++)
+            if (!f.intervals[i].isRead)
+                f.writes.push_back(i);
+    }
+}
+
+/*
+ * Files are sorted by a pool of threads, largest first, then
+ * split into chunks of CHUNK_INTERVALS intervals that are checked
+ * concurrently, so a single shared file is spread over all threads.
+ * Each thread buffers the conflicts it finds and appends them to
+ * conflicts.dat a few MB at a time; groups of different threads
+ * may interleave but are never split.
+ */
+void detect_conflicts(IntervalsMap *IM, int num_files, const char* base_dir, int nthreads) {
+    char path[512];
+    sprintf(path, "%s/conflicts.dat", base_dir);
 
-done:
-    fclose(conflict_file);
+    Detector d;
+    d.out = fopen(path, "w");
+    d.next_task = 0;
+    d.total_conflicts = 0;
+    d.files.resize(num_files);
+    vector<int> order(num_files);
+    for (int idx = 0; idx < num_files; idx++) {
+        d.files[idx].intervals = IM[idx].intervals;
+        d.files[idx].num_intervals = IM[idx].num_intervals;
+        order[idx] = idx;
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        return IM[a].num_intervals > IM[b].num_intervals;
+    });
+
+    vector<thread> threads;
+    atomic<size_t> next_file(0);
+    for (int t = 0; t < nthreads; t++)
+        threads.emplace_back(sort_worker, &d, &order, &next_file);
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+
+    for (int idx : order)
+        for (size_t first = 0; first < d.files[idx].num_intervals; first += CHUNK_INTERVALS)
+            d.tasks.push_back(make_pair(idx, first));
+
+    for (int t = 0; t < nthreads; t++)
+        threads.emplace_back(detect_worker, &d);
+    for (auto& t : threads)
+        t.join();
+
+    fclose(d.out);
 }
 
 int main(int argc, char* argv[]) {
 
+    int nthreads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch(opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-t threads] [path to traces] [max conflicts]\n", argv[0]);
+        return 1;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
     RecorderReader reader;
-    recorder_init_reader(argv[1], &reader);
+    recorder_init_reader(argv[optind], &reader);
 
-    if (argc == 3)
-        conflicts_cap = atoi(argv[2]);
+    if (optind + 1 < argc)
+        conflicts_cap = atoi(argv[optind + 1]);
 
     int i, num_files;
     IntervalsMap *IM = build_offset_intervals(&reader, &num_files);
 
-    detect_conflicts(IM, num_files, argv[1]);
+    detect_conflicts(IM, num_files, argv[optind], nthreads);
 
     // Free IM
     for(i = 0; i < num_files; i++) {
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "reader.h"
+#include "reader-private.h"
+
+/*
+ * Analytics computed on the compressed trace
+ *
+ * How often a call signature appears in a rank only depends
+ * on the grammar: a rule used k times contributes k times the
+ * symbols of its body. Counting these multiplicities once per
+ * rule gives exact totals without expanding any record.
+ */
+
+typedef struct OrderFrame_t {
+    int slot;
+    int sym;                // next symbol to visit
+} OrderFrame;
+
+/*
+ * Rules reachable from rule -1, each after all rules using it
+ * (reverse post-order). Returns the number of rules in order.
+ */
+static int topological_order(CFG* cfg, int* order) {
+    bool* visited = calloc(cfg->rule_slots, sizeof(bool));
+    OrderFrame* stack = malloc(sizeof(OrderFrame) * cfg->rule_slots);
+    int n = 0;
+
+    int top = 0;
+    stack[0] = (OrderFrame) {1, 0};
+    visited[1] = true;
+    while(top >= 0) {
+        OrderFrame* f = &stack[top];
+        RuleHash* rule = cfg->rule_table[f->slot];
+        if(f->sym == rule->symbols) {
+            order[n++] = f->slot;
+            top--;
+            continue;
+        }
+        int sym_val = rule->rule_body[2*f->sym];
+        f->sym++;
+        if(sym_val < 0 && !visited[-sym_val]) {
+            assert(-sym_val < cfg->rule_slots && cfg->rule_table[-sym_val]);
+            visited[-sym_val] = true;
+            stack[++top] = (OrderFrame) {-sym_val, 0};
+        }
+    }
+
+    // post-order has children first, reverse it
+    for(int i = 0; i < n/2; i++) {
+        int tmp = order[i];
+        order[i] = order[n-1-i];
+        order[n-1-i] = tmp;
+    }
+
+    free(stack);
+    free(visited);
+    return n;
+}
+
+size_t* recorder_count_call_signatures(RecorderReader* reader, int rank) {
+    reader_pin_rank(reader, rank);
+    CST* cst = reader_get_cst(reader, rank);
+    CFG* cfg = reader_get_cfg(reader, rank);
+    size_t* counts = calloc(cst->entries, sizeof(size_t));
+
+    int* order = malloc(sizeof(int) * cfg->rule_slots);
+    size_t* uses = calloc(cfg->rule_slots, sizeof(size_t));
+    int n = topological_order(cfg, order);
+
+    uses[1] = 1;    // rule -1
+    for(int i = 0; i < n; i++) {
+        RuleHash* rule = cfg->rule_table[order[i]];
+        size_t k = uses[order[i]];
+        for(int sym = 0; sym < rule->symbols; sym++) {
+            int sym_val = rule->rule_body[2*sym+0];
+            int sym_exp = rule->rule_body[2*sym+1];
+            if(sym_val >= 0) {
+                assert(sym_val < cst->entries);
+                counts[sym_val] += k * sym_exp;
+            } else {
+                uses[-sym_val] += k * sym_exp;
+            }
+        }
+    }
+
+    free(uses);
+    free(order);
+    reader_unpin_rank(reader, rank);
+    return counts;
+}
+
+static size_t str2sizet(const char* arg) {
+    size_t res = 0;
+    sscanf(arg, "%zu", &res);
+    return res;
+}
+
+/*
+ * File and bytes of a POSIX call, same conventions as
+ * build-offset-intervals.cpp. See reader-private.h.
+ */
+const char* posix_file_access(const char* func, Record* record, size_t* bytes, int* is_read) {
+    *bytes = 0;
+    *is_read = -1;      // neither read nor write
+    if(record->arg_count == 0)
+        return NULL;
+
+    if(strstr(func, "dir") || strstr(func, "link"))
+        return NULL;
+
+    if(strstr(func, "read") || strstr(func, "write") || strstr(func, "fprintf")) {
+        *is_read = strstr(func, "read") ? 1 : 0;
+        if(strstr(func, "writev") || strstr(func, "readv")) {
+            *bytes = str2sizet(record->args[1]);
+        } else if(strstr(func, "fwrite") || strstr(func, "fread")) {
+            if(record->arg_count < 4)
+                return NULL;
+            *bytes = str2sizet(record->args[1]) * str2sizet(record->args[2]);
+            return record->args[3];
+        } else if(strstr(func, "fprintf")) {
+            *bytes = str2sizet(record->args[1]);
+        } else if(record->arg_count > 2) {
+            *bytes = str2sizet(record->args[2]);
+        }
+        return record->args[0];
+    }
+
+    if(strstr(func, "open") || strstr(func, "close") || strstr(func, "seek") ||
+       strstr(func, "sync") || strstr(func, "stat") || strstr(func, "truncate"))
+        return record->args[0];
+
+    return NULL;
+}
+
+/*
+ * Find a file in the sorted array of a rank,
+ * adding it at its place if not there yet
+ */
+static FileStat* find_file(RankStats* stats, int* capacity, const char* filename) {
+    int lo = 0, hi = stats->num_files;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(stats->files[mid].filename, filename);
+        if(cmp == 0)
+            return &stats->files[mid];
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(stats->num_files == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        stats->files = realloc(stats->files, sizeof(FileStat) * (*capacity));
+    }
+    memmove(&stats->files[lo+1], &stats->files[lo], sizeof(FileStat) * (stats->num_files - lo));
+    stats->num_files++;
+
+    FileStat* file = &stats->files[lo];
+    memset(file, 0, sizeof(FileStat));
+    file->filename = strdup(filename);
+    return file;
+}
+
+void recorder_get_rank_stats(RecorderReader* reader, int rank, RankStats* stats) {
+    reader_pin_rank(reader, rank);
+    CST* cst = reader_get_cst(reader, rank);
+    size_t* counts = recorder_count_call_signatures(reader, rank);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->func_counts = calloc(reader->supported_funcs, sizeof(size_t));
+
+    int capacity = 0;   // of stats->files
+    for(int cs = 0; cs < cst->entries; cs++) {
+        if(counts[cs] == 0)
+            continue;
+
+        Record* record = recorder_get_call_signature(reader, rank, cs);
+        stats->records += counts[cs];
+        if(record->func_id == RECORDER_USER_FUNCTION) {
+            stats->user_func_count += counts[cs];
+        } else if(recorder_get_func_type(reader, record) == RECORDER_POSIX) {
+            size_t bytes;
+            int is_read;
+            const char* func = recorder_get_func_name(reader, record);
+            const char* filename = posix_file_access(func, record, &bytes, &is_read);
+            if(filename) {
+                FileStat* file = find_file(stats, &capacity, filename);
+                file->calls += counts[cs];
+                if(is_read == 1) {
+                    file->reads += counts[cs];
+                    file->bytes_read += counts[cs] * bytes;
+                } else if(is_read == 0) {
+                    file->writes += counts[cs];
+                    file->bytes_written += counts[cs] * bytes;
+                }
+            }
+        }
+        if(record->func_id != RECORDER_USER_FUNCTION)
+            stats->func_counts[record->func_id] += counts[cs];
+        recorder_free_record(record);
+    }
+    free(counts);
+    reader_unpin_rank(reader, rank);
+}
+
+void recorder_free_rank_stats(RankStats* stats) {
+    for(int i = 0; i < stats->num_files; i++)
+        free(stats->files[i].filename);
+    free(stats->files);
+    free(stats->func_counts);
+    memset(stats, 0, sizeof(*stats));
+}
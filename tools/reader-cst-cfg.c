@@ -4,12 +4,16 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <zlib.h>
+#include <pthread.h>
 #include "./reader-private.h"
 
 void reader_free_cst(CST* cst) {
-    for(int i = 0; i < cst->entries; i++)
+    for(int i = 0; i < cst->entries; i++) {
         free(cst->cs_list[i].key);
+        free(cst->records[i].args);
+    }
     free(cst->cs_list);
+    free(cst->records);
 }
 
 void reader_free_cfg(CFG* cfg) {
@@ -19,9 +23,60 @@ void reader_free_cfg(CFG* cfg) {
         free(r->rule_body);
         free(r);
     }
+    free(cfg->rule_table);
+    free(cfg->rule_lengths);
+    cfg->rule_table = NULL;
+    cfg->rule_lengths = NULL;
+    cfg->rule_slots = 0;
 }
 
 
+/**
+ * Decode every call signature once into cst->records
+ *
+ * The argument strings of a record are stored right after
+ * its args array, so each template takes a single allocation.
+ * Templates are immutable, decoded records are views of them.
+ */
+static void decode_cst_records(CST* cst) {
+    cst->records = malloc(cst->entries * sizeof(Record));
+    for(int i = 0; i < cst->entries; i++) {
+        Record* record = &cst->records[i];
+        memset(record, 0, sizeof(Record));
+
+        char* key = cst->cs_list[i].key;
+        int pos = 0;
+        memcpy(&record->tid, key+pos, sizeof(pthread_t));
+        pos += sizeof(pthread_t);
+        memcpy(&record->func_id, key+pos, sizeof(record->func_id));
+        pos += sizeof(record->func_id);
+        memcpy(&record->call_depth, key+pos, sizeof(record->call_depth));
+        pos += sizeof(record->call_depth);
+        memcpy(&record->arg_count, key+pos, sizeof(record->arg_count));
+        pos += sizeof(record->arg_count);
+
+        int arg_strlen;
+        memcpy(&arg_strlen, key+pos, sizeof(int));
+        pos += sizeof(int);
+
+        record->args = malloc(sizeof(char*) * record->arg_count + arg_strlen);
+        char* arg_str = (char*) (record->args + record->arg_count);
+        memcpy(arg_str, key+pos, arg_strlen);
+
+        // every argument is followed by a space
+        int ai = 0;
+        int start = 0;
+        for(int k = 0; k < arg_strlen; k++) {
+            if(arg_str[k] == ' ') {
+                arg_str[k] = 0;
+                record->args[ai++] = arg_str + start;
+                start = k + 1;
+            }
+        }
+        assert(ai == record->arg_count);
+    }
+}
+
 void reader_decode_cst_2_3(RecorderReader *reader, int rank, CST *cst) {
     cst->rank = rank;
     char cst_filename[1096] = {0};
@@ -44,6 +99,8 @@ void reader_decode_cst_2_3(RecorderReader *reader, int rank, CST *cst) {
         assert(cst->cs_list[i].terminal_id < cst->entries);
     }
     fclose(f);
+
+    decode_cst_records(cst);
 }
 
 void reader_decode_cfg_2_3(RecorderReader *reader, int rank, CFG* cfg) {
@@ -56,6 +113,10 @@ void reader_decode_cfg_2_3(RecorderReader *reader, int rank, CFG* cfg) {
     fread(&cfg->rules, sizeof(int), 1, f);
 
     cfg->cfg_head = NULL;
+    cfg->shared = NULL;
+    cfg->rule_slots = 0;
+    cfg->rule_table = NULL;
+    cfg->rule_lengths = NULL;
     for(int i = 0; i < cfg->rules; i++) {
         RuleHash *rule = malloc(sizeof(RuleHash));
 
@@ -99,6 +160,8 @@ void reader_decode_cst(int rank, void* buf, CST* cst) {
         memcpy(cs->key, buf, cs->key_len);
         buf += cs->key_len;
     }
+
+    decode_cst_records(cst);
 }
 
 void reader_decode_cfg(int rank, void* buf, CFG* cfg) {
@@ -109,6 +172,10 @@ void reader_decode_cfg(int rank, void* buf, CFG* cfg) {
     buf += sizeof(int);
 
     cfg->cfg_head = NULL;
+    cfg->shared = NULL;
+    cfg->rule_slots = 0;
+    cfg->rule_table = NULL;
+    cfg->rule_lengths = NULL;
     for(int i = 0; i < cfg->rules; i++) {
         RuleHash *rule = malloc(sizeof(RuleHash));
 
@@ -124,20 +191,315 @@ void reader_decode_cfg(int rank, void* buf, CFG* cfg) {
     }
 }
 
+/*
+ * Without interprocess compression, each rank has its own
+ * CST and CFG. They are loaded on first use and kept in an
+ * LRU cache bounded by RECORDER_READER_CACHE_MB (unbounded
+ * if not set). Pinned ranks are never evicted.
+ */
+typedef struct RankCache_t {
+    pthread_mutex_t lock;
+    size_t limit;           // bytes, 0 for no limit
+    size_t used;
+    size_t* bytes;          // bytes[rank]: approximate size of a loaded rank
+    int* pins;
+    int* prev;              // LRU list of loaded ranks, head is
+    int* next;              // the most recently used, -1 ends it
+    int head, tail;
+} RankCache;
+
+void reader_init_rank_cache(RecorderReader* reader) {
+    int nprocs = reader->metadata.total_ranks;
+    RankCache* cache = calloc(1, sizeof(RankCache));
+    pthread_mutex_init(&cache->lock, NULL);
+
+    const char* limit = getenv(RECORDER_READER_CACHE_MB);
+    if(limit)
+        cache->limit = (size_t) atol(limit) * 1024 * 1024;
+
+    cache->bytes = calloc(nprocs, sizeof(size_t));
+    cache->pins  = calloc(nprocs, sizeof(int));
+    cache->prev  = malloc(sizeof(int) * nprocs);
+    cache->next  = malloc(sizeof(int) * nprocs);
+    cache->head  = -1;
+    cache->tail  = -1;
+    reader->cache = cache;
+}
+
+static size_t rank_bytes(CST* cst, CFG* cfg) {
+    size_t bytes = sizeof(CST) + sizeof(CFG);
+    for(int i = 0; i < cst->entries; i++) {
+        bytes += sizeof(CallSignature) + sizeof(Record) + 2 * cst->cs_list[i].key_len;
+        bytes += sizeof(char*) * cst->records[i].arg_count;
+    }
+    RuleHash *r, *tmp;
+    HASH_ITER(hh, cfg->cfg_head, r, tmp)
+        bytes += sizeof(RuleHash) + sizeof(int) * 2 * r->symbols;
+    bytes += (sizeof(RuleHash*) + sizeof(size_t)) * cfg->rule_slots;
+    return bytes;
+}
+
+static void lru_unlink(RankCache* cache, int rank) {
+    if(cache->prev[rank] != -1) cache->next[cache->prev[rank]] = cache->next[rank];
+    else                        cache->head = cache->next[rank];
+    if(cache->next[rank] != -1) cache->prev[cache->next[rank]] = cache->prev[rank];
+    else                        cache->tail = cache->prev[rank];
+}
+
+static void lru_push_front(RankCache* cache, int rank) {
+    cache->prev[rank] = -1;
+    cache->next[rank] = cache->head;
+    if(cache->head != -1) cache->prev[cache->head] = rank;
+    cache->head = rank;
+    if(cache->tail == -1) cache->tail = rank;
+}
+
+static void unload_rank(RecorderReader* reader, int rank) {
+    RankCache* cache = reader->cache;
+    lru_unlink(cache, rank);
+    cache->used -= cache->bytes[rank];
+    cache->bytes[rank] = 0;
+    reader_free_cst(reader->csts[rank]);
+    reader_free_cfg(reader->cfgs[rank]);
+    free(reader->csts[rank]);
+    free(reader->cfgs[rank]);
+    reader->csts[rank] = NULL;
+    reader->cfgs[rank] = NULL;
+}
+
+// load a rank if needed and mark it as the most recently used
+// the caller holds cache->lock
+static void ensure_loaded(RecorderReader* reader, int rank) {
+    RankCache* cache = reader->cache;
+    if(reader->csts[rank]) {
+        lru_unlink(cache, rank);
+        lru_push_front(cache, rank);
+        return;
+    }
+
+    reader_load_rank(reader, rank);
+    cache->bytes[rank] = rank_bytes(reader->csts[rank], reader->cfgs[rank]);
+    cache->used += cache->bytes[rank];
+    lru_push_front(cache, rank);
+
+    // evict the least recently used ranks, except this one
+    int victim = cache->tail;
+    while(cache->limit && cache->used > cache->limit && victim != -1) {
+        int prev = cache->prev[victim];
+        if(victim != rank && cache->pins[victim] == 0)
+            unload_rank(reader, victim);
+        victim = prev;
+    }
+}
+
+void reader_free_rank_cache(RecorderReader* reader) {
+    RankCache* cache = reader->cache;
+    if(cache == NULL)
+        return;
+    while(cache->head != -1)
+        unload_rank(reader, cache->head);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->bytes);
+    free(cache->pins);
+    free(cache->prev);
+    free(cache->next);
+    free(cache);
+    reader->cache = NULL;
+}
+
+void reader_pin_rank(RecorderReader* reader, int rank) {
+    RankCache* cache = reader->cache;
+    if(cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    ensure_loaded(reader, rank);
+    cache->pins[rank]++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void reader_unpin_rank(RecorderReader* reader, int rank) {
+    RankCache* cache = reader->cache;
+    if(cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    assert(cache->pins[rank] > 0);
+    cache->pins[rank]--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
 CST* reader_get_cst(RecorderReader* reader, int rank) {
+    if(reader->cache == NULL)
+        return reader->csts[rank];
+
+    pthread_mutex_lock(&reader->cache->lock);
+    ensure_loaded(reader, rank);
     CST* cst = reader->csts[rank];
+    pthread_mutex_unlock(&reader->cache->lock);
     return cst;
 }
 
 CFG* reader_get_cfg(RecorderReader* reader, int rank) {
-    CFG* cfg;
-    if (reader->metadata.interprocess_compression)
-        cfg = reader->cfgs[reader->ug_ids[rank]];
-    else
-        cfg = reader->cfgs[rank];
+    if(reader->cache == NULL)
+        return reader->cfgs[rank];
+
+    pthread_mutex_lock(&reader->cache->lock);
+    ensure_loaded(reader, rank);
+    CFG* cfg = reader->cfgs[rank];
+    pthread_mutex_unlock(&reader->cache->lock);
     return cfg;
 }
 
+/**
+ * Look up a rule in the grammar. With interprocess grammar
+ * sharing, rules not found in the (private) grammar are
+ * searched in the shared rule dictionary.
+ */
+RuleHash* reader_get_rule(CFG* cfg, int rule_id) {
+    if(cfg->rule_table)
+        return (rule_id < 0 && -rule_id < cfg->rule_slots) ? cfg->rule_table[-rule_id] : NULL;
+
+    RuleHash *rule = NULL;
+    HASH_FIND_INT(cfg->cfg_head, &rule_id, rule);
+    if(rule == NULL && cfg->shared)
+        HASH_FIND_INT(cfg->shared->cfg_head, &rule_id, rule);
+    return rule;
+}
+
+typedef struct LengthFrame_t {
+    int slot;
+    int sym;                // next symbol to count
+    size_t length;          // terminals counted so far
+} LengthFrame;
+
+/*
+ * Count the terminals every rule expands to
+ * Rules are visited once in post order with an explicit
+ * stack, as grammars can be much deeper than the C stack.
+ */
+static void compute_rule_lengths(CFG* cfg) {
+    const size_t UNKNOWN = (size_t) -1;
+    cfg->rule_lengths = malloc(sizeof(size_t) * cfg->rule_slots);
+    for(int i = 0; i < cfg->rule_slots; i++)
+        cfg->rule_lengths[i] = UNKNOWN;
+
+    LengthFrame* stack = malloc(sizeof(LengthFrame) * cfg->rule_slots);
+    for(int root = 1; root < cfg->rule_slots; root++) {
+        if(cfg->rule_table[root] == NULL || cfg->rule_lengths[root] != UNKNOWN)
+            continue;
+
+        int top = 0;
+        stack[0] = (LengthFrame) {root, 0, 0};
+        while(top >= 0) {
+            LengthFrame* f = &stack[top];
+            RuleHash* rule = cfg->rule_table[f->slot];
+            if(f->sym == rule->symbols) {
+                cfg->rule_lengths[f->slot] = f->length;
+                top--;
+                continue;
+            }
+
+            int sym_val = rule->rule_body[2*f->sym+0];
+            int sym_exp = rule->rule_body[2*f->sym+1];
+            if(sym_val >= 0) {
+                f->length += sym_exp;
+                f->sym++;
+            } else if(cfg->rule_lengths[-sym_val] != UNKNOWN) {
+                f->length += sym_exp * cfg->rule_lengths[-sym_val];
+                f->sym++;
+            } else {
+                // the grammar is acyclic, so the stack
+                // never holds more than all rules
+                assert(-sym_val < cfg->rule_slots && cfg->rule_table[-sym_val]);
+                stack[++top] = (LengthFrame) {-sym_val, 0, 0};
+            }
+        }
+    }
+    free(stack);
+}
+
+typedef struct ReachFrame_t {
+    int slot;
+    int sym;                // next symbol to check
+    bool reaches;
+} ReachFrame;
+
+/*
+ * Find the rules whose expansion contains at least
+ * one of the given terminals (terminals[cs_id])
+ * Returns reaches[-rule_id], freed by the caller.
+ */
+bool* reader_rules_reaching(CFG* cfg, const bool* terminals) {
+    // 0: not visited, 1: being visited, 2: done
+    char* state = calloc(cfg->rule_slots, sizeof(char));
+    bool* reaches = calloc(cfg->rule_slots, sizeof(bool));
+
+    ReachFrame* stack = malloc(sizeof(ReachFrame) * cfg->rule_slots);
+    for(int root = 1; root < cfg->rule_slots; root++) {
+        if(cfg->rule_table[root] == NULL || state[root] == 2)
+            continue;
+
+        int top = 0;
+        stack[0] = (ReachFrame) {root, 0, false};
+        state[root] = 1;
+        while(top >= 0) {
+            ReachFrame* f = &stack[top];
+            RuleHash* rule = cfg->rule_table[f->slot];
+            if(f->sym == rule->symbols) {
+                reaches[f->slot] = f->reaches;
+                state[f->slot] = 2;
+                top--;
+                if(top >= 0 && f->reaches)
+                    stack[top].reaches = true;
+                continue;
+            }
+
+            int sym_val = rule->rule_body[2*f->sym];
+            if(sym_val >= 0) {
+                f->reaches = f->reaches || terminals[sym_val];
+                f->sym++;
+            } else if(state[-sym_val] == 2) {
+                f->reaches = f->reaches || reaches[-sym_val];
+                f->sym++;
+            } else {
+                assert(-sym_val < cfg->rule_slots && cfg->rule_table[-sym_val]);
+                f->sym++;
+                state[-sym_val] = 1;
+                stack[++top] = (ReachFrame) {-sym_val, 0, false};
+            }
+        }
+    }
+    free(stack);
+    free(state);
+    return reaches;
+}
+
+/**
+ * Build the flat rule table of a grammar, including
+ * the shared rules it may reference, so rules can be
+ * found by -rule_id without hash lookups.
+ * Must be called after cfg->shared is set.
+ */
+void reader_index_rules(CFG* cfg) {
+    RuleHash *r, *tmp;
+    int max_id = 1;
+    HASH_ITER(hh, cfg->cfg_head, r, tmp)
+        if(-r->rule_id > max_id) max_id = -r->rule_id;
+    if(cfg->shared)
+        HASH_ITER(hh, cfg->shared->cfg_head, r, tmp)
+            if(-r->rule_id > max_id) max_id = -r->rule_id;
+
+    cfg->rule_slots = max_id + 1;
+    cfg->rule_table = calloc(cfg->rule_slots, sizeof(RuleHash*));
+    if(cfg->shared)
+        HASH_ITER(hh, cfg->shared->cfg_head, r, tmp)
+            cfg->rule_table[-r->rule_id] = r;
+    // private rules take precedence, see reader_get_rule()
+    HASH_ITER(hh, cfg->cfg_head, r, tmp)
+        cfg->rule_table[-r->rule_id] = r;
+
+    compute_rule_lengths(cfg);
+}
+
 // Caller needs to free the record after use
 // by using recorder_free_record() call.
 Record* reader_cs_to_record(CallSignature *cs) {
@@ -176,3 +538,201 @@ Record* reader_cs_to_record(CallSignature *cs) {
     return record;
 }
 
+
+/**
+ * Instantiate the rank templates (see recorder-logger.h)
+ * in the arguments of a record for the given rank.
+ * With rank < 0, templates are turned into a readable
+ * form instead, e.g., 4096*r+0 or out.%04r.h5
+ */
+void reader_instantiate_args(Record* record, int rank) {
+    for(int i = 0; i < record->arg_count; i++) {
+        char* arg = record->args[i];
+        if(arg == NULL || arg[0] != RECORDER_TEMPLATE_MARK)
+            continue;
+
+        char* res = NULL;
+        if(arg[1] == RECORDER_TEMPLATE_AFFINE) {
+            long long a, b;
+            sscanf(arg+2, "%lld,%lld", &a, &b);
+            res = malloc(64);
+            if(rank < 0)
+                sprintf(res, "%lld*r+%lld", a, b);
+            else
+                sprintf(res, "%lld", a*rank+b);
+        } else if(arg[1] == RECORDER_TEMPLATE_GRID) {
+            long long P, a, c, b;
+            sscanf(arg+2, "%lld,%lld,%lld,%lld", &P, &a, &c, &b);
+            res = malloc(128);
+            if(rank < 0)
+                sprintf(res, "%lld*(r/%lld)+%lld*(r%%%lld)+%lld", a, P, c, P, b);
+            else
+                sprintf(res, "%lld", a*(rank/P) + c*(rank%P) + b);
+        } else if(arg[1] == RECORDER_TEMPLATE_STRING) {
+            char* text = strchr(arg+2, ',') + 1;
+            int width = atoi(arg+2);
+            int placeholders = 0;
+            for(char* c = text; *c; c++)
+                if(*c == RECORDER_TEMPLATE_RANK) placeholders++;
+
+            res = malloc(strlen(text) + placeholders*32 + 1);
+            int pos = 0;
+            for(char* c = text; *c; c++) {
+                if(*c != RECORDER_TEMPLATE_RANK)
+                    res[pos++] = *c;
+                else if(rank < 0 && width > 1)
+                    pos += sprintf(res+pos, "%%0%dr", width);
+                else if(rank < 0)
+                    pos += sprintf(res+pos, "%%r");
+                else
+                    pos += sprintf(res+pos, "%0*d", width, rank);
+            }
+            res[pos] = 0;
+        } else {
+            continue;
+        }
+
+        free(record->args[i]);
+        record->args[i] = res;
+    }
+}
+
+
+/*
+ * With intraprocess pattern recognition, the offset of these
+ * calls is stored relative to the previous access of the same
+ * call to the same file (see iopr_intraprocess()). The state is
+ * kept per first argument, the path or MPI file id, and closing
+ * the file forgets it, same as in the tracer.
+ */
+static const struct {
+    const char* func;
+    int offset_arg;
+} intraprocess_funcs[] = {
+    {"lseek", 1}, {"lseek64", 1},
+    {"pread", 3}, {"pread64", 3},
+    {"pwrite", 3}, {"pwrite64", 3},
+    {"MPI_File_set_view", 1},
+    {"MPI_File_read_at", 1}, {"MPI_File_read_at_all", 1},
+    {"MPI_File_write_at", 1}, {"MPI_File_write_at_all", 1},
+};
+#define NUM_INTRAPROCESS_FUNCS (sizeof(intraprocess_funcs) / sizeof(intraprocess_funcs[0]))
+#define OFFSET_SLOT_CLOSE -2
+
+typedef struct OffsetState_t {
+    char* file;                                 // key
+    long long offset[NUM_INTRAPROCESS_FUNCS];
+    long long delta[NUM_INTRAPROCESS_FUNCS];
+    UT_hash_handle hh;
+} OffsetState;
+
+void reader_init_offset_decoding(RecorderReader* reader) {
+    reader->offset_slots = malloc(sizeof(int) * reader->supported_funcs);
+    for(int i = 0; i < reader->supported_funcs; i++) {
+        reader->offset_slots[i] = -1;
+        if(strcmp(reader->func_list[i], "close") == 0 ||
+           strcmp(reader->func_list[i], "MPI_File_close") == 0)
+            reader->offset_slots[i] = OFFSET_SLOT_CLOSE;
+        for(size_t k = 0; k < NUM_INTRAPROCESS_FUNCS; k++)
+            if(strcmp(reader->func_list[i], intraprocess_funcs[k].func) == 0)
+                reader->offset_slots[i] = k;
+    }
+}
+
+void reader_reset_offset_states(OffsetState** states) {
+    OffsetState *state, *tmp;
+    HASH_ITER(hh, *states, state, tmp) {
+        HASH_DEL(*states, state);
+        free(state->file);
+        free(state);
+    }
+}
+
+struct OffsetState_t* reader_copy_offset_states(OffsetState* states) {
+    OffsetState *copies = NULL, *state, *tmp;
+    HASH_ITER(hh, states, state, tmp) {
+        OffsetState* copy = malloc(sizeof(OffsetState));
+        memcpy(copy, state, sizeof(OffsetState));
+        copy->file = strdup(state->file);
+        HASH_ADD_KEYPTR(hh, copies, copy->file, strlen(copy->file), copy);
+    }
+    return copies;
+}
+
+/*
+ * Whether reader_decode_offsets() needs to look at this record
+ */
+bool reader_has_offsets(RecorderReader* reader, Record* record) {
+    if(record->func_id < 0 || record->func_id >= reader->supported_funcs || record->arg_count == 0)
+        return false;
+    return reader->offset_slots[record->func_id] != -1;
+}
+
+/*
+ * Whether an argument of a function is needed to decode the
+ * offsets: the file the state is kept for, or the stored offset.
+ * Rewriting it changes the offsets decoded from later records.
+ */
+bool reader_is_offset_arg(RecorderReader* reader, int func_id, int arg) {
+    if(!reader->metadata.intraprocess_pattern_recognition ||
+       func_id < 0 || func_id >= reader->supported_funcs)
+        return false;
+    int slot = reader->offset_slots[func_id];
+    if(slot == -1)
+        return false;
+    return arg == 0 || (slot != OFFSET_SLOT_CLOSE && arg == intraprocess_funcs[slot].offset_arg);
+}
+
+// Turn the stored offset of a record back into
+// the absolute offset. Records of a rank must be given
+// in order, states keeps the per-file offsets seen so far.
+// The offset argument is pointed to offset_buf (at least
+// 32 bytes), its index is returned, or -1 if none was
+// changed. The old argument is not freed.
+int reader_decode_offsets(RecorderReader* reader, OffsetState** states, Record* record, char* offset_buf) {
+    if(!reader_has_offsets(reader, record))
+        return -1;
+    int slot = reader->offset_slots[record->func_id];
+
+    OffsetState* state = NULL;
+    char* file = record->args[0];
+    HASH_FIND_STR(*states, file, state);
+
+    if(slot == OFFSET_SLOT_CLOSE) {
+        if(state) {
+            HASH_DEL(*states, state);
+            free(state->file);
+            free(state);
+        }
+        return -1;
+    }
+
+    // e.g., dropped by an older recorder-filter
+    if(record->arg_count <= intraprocess_funcs[slot].offset_arg)
+        return -1;
+
+    if(state == NULL) {
+        state = calloc(1, sizeof(OffsetState));
+        state->file = strdup(file);
+        HASH_ADD_KEYPTR(hh, *states, state->file, strlen(state->file), state);
+    }
+
+    char* arg = record->args[intraprocess_funcs[slot].offset_arg];
+    long long offset;
+    if(arg[0] == 'd' && arg[1] == 'd') {
+        state->delta[slot] += atoll(arg+2);
+        offset = state->offset[slot] + state->delta[slot];
+    } else if(arg[0] == 'd') {
+        state->delta[slot] = atoll(arg+1);
+        offset = state->offset[slot] + state->delta[slot];
+    } else {
+        offset = atoll(arg);
+        state->delta[slot] = 0;
+    }
+    state->offset[slot] = offset;
+
+    int offset_arg = intraprocess_funcs[slot].offset_arg;
+    sprintf(offset_buf, "%lld", offset);
+    record->args[offset_arg] = offset_buf;
+    return offset_arg;
+}
@@ -34,6 +34,62 @@ typedef struct IntervalsMap_t {
 
 
 
+/**
+ * Trace files are mapped read-only and zlib blocks
+ * (see recorder_write_zlib()) are inflated directly
+ * from the mapping into the destination buffer.
+ */
+bool  map_file(const char* path, MappedFile* mf);
+void  unmap_file(MappedFile* mf);
+void* read_zlib(const void* src, size_t* consumed);
+uint32_t* read_timestamp_file(RecorderReader* reader, int rank);
+void  release_timestamps(RecorderReader* reader, uint32_t* ts_buf);
+
+
+/**
+ * Timestamps are stored as deltas to the tstart of the
+ * previous record, so each checkpoint keeps the tstart
+ * chained up to its first record. Every zlib block of the
+ * rank's section in recorder.ts starts with a checkpoint.
+ * Inside a block, checkpoints are taken at deflate block
+ * boundaries, with the last 32K of output as the dictionary
+ * to resume inflating from there (see zran.c in zlib).
+ * Uncompressed timestamps are cut into slices instead.
+ */
+typedef struct TimestampCheckpoint_t {
+    size_t offset;          // of the zlib block in the rank's section of recorder.ts
+    size_t size;            // bytes of the zlib block, including its header
+    size_t in;              // compressed bytes of the block before the checkpoint, 0 at its start
+    int    bits;            // bits of byte in-1 not consumed yet
+    int    skip;            // bytes to inflate and drop to get to record first
+    size_t first;           // index of the first record
+    size_t records;         // up to the next checkpoint
+    double tstart;          // tstart of record first-1, 0 for the first record
+    unsigned window_size;
+    unsigned char* window;  // dictionary, NULL at the start of a block
+} TimestampCheckpoint;
+
+typedef struct TimestampIndex_t {
+    int num_checkpoints;
+    TimestampCheckpoint* checkpoints;
+    size_t records;
+    double tstart;          // tstart of the first record
+    double tend;            // latest tend of all records
+} TimestampIndex;
+
+TimestampIndex* reader_get_timestamp_index(RecorderReader* reader, int rank);
+void reader_free_timestamp_index(TimestampIndex* idx);
+
+/**
+ * The timestamp index of all ranks can be saved to
+ * recorder.idx in the trace folder (see recorder-index),
+ * recorder_init_reader() then loads it instead of
+ * building it again. Returns 0 on success.
+ */
+#define RECORDER_INDEX_FILE "recorder.idx"
+int reader_write_index(RecorderReader* reader);
+
+
 /**
  * Read CST and CFG from files to RecorderReader
  *
@@ -54,10 +110,44 @@ void reader_decode_cst(int rank, void* buf, CST* cst);
 void reader_decode_cfg(int rank, void* buf, CFG* cfg);
 void reader_free_cst(CST *cst);
 void reader_free_cfg(CFG *cfg);
+
+/**
+ * Without interprocess compression, ranks are loaded on demand
+ * and cached, bounded by RECORDER_READER_CACHE_MB (in MB).
+ * A CST or CFG returned by reader_get_cst() and reader_get_cfg()
+ * may be evicted once another rank is loaded, unless the rank
+ * is pinned with reader_pin_rank() while it is used.
+ */
+#define RECORDER_READER_CACHE_MB "RECORDER_READER_CACHE_MB"
 CST* reader_get_cst(RecorderReader* reader, int rank);
 CFG* reader_get_cfg(RecorderReader* reader, int rank);
+void reader_pin_rank(RecorderReader* reader, int rank);
+void reader_unpin_rank(RecorderReader* reader, int rank);
+void reader_load_rank(RecorderReader* reader, int rank);
+void reader_init_rank_cache(RecorderReader* reader);
+void reader_free_rank_cache(RecorderReader* reader);
+RuleHash* reader_get_rule(CFG* cfg, int rule_id);
+void reader_index_rules(CFG* cfg);
+bool* reader_rules_reaching(CFG* cfg, const bool* terminals);
+
+/**
+ * File and bytes of a POSIX call, by the name of its function.
+ * Returns the file, NULL if the call does not name one. is_read
+ * is 1 for reads, 0 for writes and -1 for other calls, which
+ * move no bytes. Shared by the tools so they agree on them.
+ */
+const char* posix_file_access(const char* func, Record* record, size_t* bytes, int* is_read);
 
 Record* reader_cs_to_record(CallSignature *cs);
+void reader_instantiate_args(Record* record, int rank);
+
+struct OffsetState_t;       // per-file offsets of the rank being decoded
+void reader_init_offset_decoding(RecorderReader* reader);
+bool reader_has_offsets(RecorderReader* reader, Record* record);
+bool reader_is_offset_arg(RecorderReader* reader, int func_id, int arg);
+int  reader_decode_offsets(RecorderReader* reader, struct OffsetState_t** states, Record* record, char* offset_buf);
+void reader_reset_offset_states(struct OffsetState_t** states);
+struct OffsetState_t* reader_copy_offset_states(struct OffsetState_t* states);
 
 IntervalsMap* build_offset_intervals(RecorderReader *reader, int *num_files);
 
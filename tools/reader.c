@@ -4,69 +4,228 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
 #include "reader.h"
 #include "reader-private.h"
 
-void* read_zlib(FILE* source) {
-    const int CHUNK = 65536;
-    int ret;
-    unsigned have;
+/**
+ * Map a whole trace file read-only
+ * return false if the file can not be opened,
+ * an empty file is mapped to (NULL, 0)
+ */
+bool map_file(const char* path, MappedFile* mf) {
+    mf->addr = NULL;
+    mf->size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    mf->size = st.st_size;
+    if(mf->size > 0) {
+        mf->addr = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mf->addr == MAP_FAILED) {
+            mf->addr = NULL;
+            mf->size = 0;
+            close(fd);
+            return false;
+        }
+        madvise(mf->addr, mf->size, MADV_SEQUENTIAL);
+    }
+    close(fd);      // the mapping stays valid
+    return true;
+}
+
+void unmap_file(MappedFile* mf) {
+    if(mf->addr)
+        munmap(mf->addr, mf->size);
+    mf->addr = NULL;
+    mf->size = 0;
+}
+
+/*
+ * An initialized z_stream with its whole input and
+ * output. z_stream counts in uInt, so they are handed
+ * to it in pieces of at most UINT_MAX bytes.
+ */
+typedef struct Inflater_t {
     z_stream strm;
-    unsigned char out[CHUNK]; // TODO remove out, and store directly to uncompressed.
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK)
-        return NULL;
+    const unsigned char* in;
+    size_t in_left;         // not handed to strm yet
+    unsigned char* out;
+    size_t out_left;
+    unsigned char empty;
+} Inflater;
+
+/*
+ * @window_bits: as for inflateInit2(), negative for raw deflate data
+ */
+static bool inflater_init(Inflater* inf, int window_bits, const void* src, size_t src_size) {
+    memset(&inf->strm, 0, sizeof(z_stream));
+    if (inflateInit2(&inf->strm, window_bits) != Z_OK)
+        return false;
+    inf->in = src;
+    inf->in_left = src_size;
+    inf->out = NULL;
+    inf->out_left = 0;
+    inf->strm.avail_out = 0;
+    inf->strm.next_out  = &inf->empty;  // zlib wants a valid pointer even for empty output
+    return true;
+}
+
+static void inflater_set_output(Inflater* inf, void* dst, size_t dst_size) {
+    inf->out = dst;
+    inf->out_left = dst_size;
+    inf->strm.avail_out = 0;
+    inf->strm.next_out  = &inf->empty;
+}
+
+// bytes of the input consumed so far
+static size_t inflater_consumed(Inflater* inf, size_t src_size) {
+    return src_size - inf->in_left - inf->strm.avail_in;
+}
+
+static bool inflater_full(Inflater* inf) {
+    return inf->strm.avail_out == 0 && inf->out_left == 0;
+}
+
+/*
+ * One call to inflate(), topping up its input and output first
+ * return the inflate() result
+ */
+static int inflater_step(Inflater* inf, int flush) {
+    z_stream* strm = &inf->strm;
+    if (strm->avail_in == 0 && inf->in_left > 0) {
+        strm->avail_in = inf->in_left > UINT_MAX ? UINT_MAX : inf->in_left;
+        strm->next_in  = (unsigned char*) inf->in;
+        inf->in += strm->avail_in;
+        inf->in_left -= strm->avail_in;
+    }
+    if (strm->avail_out == 0 && inf->out_left > 0) {
+        strm->avail_out = inf->out_left > UINT_MAX ? UINT_MAX : inf->out_left;
+        strm->next_out  = inf->out;
+        inf->out += strm->avail_out;
+        inf->out_left -= strm->avail_out;
+    }
+    int ret = inflate(strm, flush);
+    assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
+    return ret;
+}
+
+/*
+ * Inflate until the output is full or the stream ends
+ * With prefix, stop once the output is full instead of
+ * requiring the stream to end there.
+ */
+static bool inflater_run(Inflater* inf, bool prefix) {
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        ret = inflater_step(inf, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return false;
+        if (prefix && inflater_full(inf))
+            break;
+    }
+    return true;
+}
+
+/**
+ * Inflate one zlib stream directly into dst
+ */
+static bool inflate_into(const void* src, size_t src_size, void* dst, size_t dst_size) {
+    Inflater inf;
+    if (!inflater_init(&inf, MAX_WBITS, src, src_size))
+        return false;
+    inflater_set_output(&inf, dst, dst_size);
+    bool ok = inflater_run(&inf, false);
+    (void)inflateEnd(&inf.strm);
+    return ok;
+}
 
-    // In the first two size_t we alway store comperssed_size
-    // and decompressed_size. See write_zlib in recorder-utils.c
+/**
+ * Decompress one block written by recorder_write_zlib()
+ *
+ * In the first two size_t we alway store comperssed_size
+ * and decompressed_size. See recorder_write_zlib() in
+ * lib/recorder-utils.c
+ *
+ * @src: [in] start of the block, typically inside a mapped file
+ * @consumed: [out] if not NULL, size of the block including the header
+ * @return: the decompressed buffer, need to be freed by the caller
+ */
+void* read_zlib(const void* src, size_t* consumed) {
     size_t compressed_size, decompressed_size;
-    fread(&compressed_size, sizeof(size_t), 1, source);
-    fread(&decompressed_size, sizeof(size_t), 1, source);
-    //printf("read zlib compressed size: %ld, decompressed size: %ld\n", 
-    //       compressed_size, decompressed_size);
-    //fflush(stdout);
-    void* compressed   = malloc(compressed_size);
-    void* decompressed = malloc(decompressed_size);
-    void* p_decompressed = decompressed;
-
-    strm.avail_in = fread(compressed, 1, compressed_size, source);
-    strm.next_in  = compressed;
-    assert(strm.avail_in == compressed_size);
-
-    /* run inflate() on input until output buffer not full */
-    do {
-        strm.avail_out = CHUNK;
-        strm.next_out  = out;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-        switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;     /* and fall through */
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                free(compressed);
-                free(decompressed);
-                return NULL;
-        }
-        have = CHUNK - strm.avail_out;
-        memcpy(p_decompressed, out, have);
-        p_decompressed += have;
-    } while (strm.avail_out == 0);
+    memcpy(&compressed_size, src, sizeof(size_t));
+    memcpy(&decompressed_size, src+sizeof(size_t), sizeof(size_t));
+    if(consumed)
+        *consumed = 2*sizeof(size_t) + compressed_size;
 
-    (void)inflateEnd(&strm);
-    free(compressed);
+    void* decompressed = malloc(decompressed_size);
+    if(!inflate_into(src+2*sizeof(size_t), compressed_size, decompressed, decompressed_size)) {
+        free(decompressed);
+        return NULL;
+    }
     return decompressed;
 }
 
+/**
+ * Map the file and decompress the first block
+ * Used for files that are read only once at init.
+ */
+static void* read_zlib_file(const char* path) {
+    MappedFile mf;
+    if(!map_file(path, &mf) || mf.addr == NULL) {
+        fprintf(stderr, "failed to read %s\n", path);
+        exit(1);
+    }
+    void* buf = read_zlib(mf.addr, NULL);
+    unmap_file(&mf);
+    return buf;
+}
+
+/**
+ * Map recorder.ts once and compute where the
+ * timestamps of each rank start, so decoding a rank
+ * does not need to reopen the file and reread the
+ * size header.
+ */
+static void map_timestamp_file(RecorderReader* reader) {
+    char ts_fname[1096] = {0};
+    sprintf(ts_fname, "%s/recorder.ts", reader->logs_dir);
+    if(!map_file(ts_fname, &reader->ts_map)) {
+        fprintf(stderr, "failed to read %s\n", ts_fname);
+        exit(1);
+    }
+
+    int nprocs = reader->metadata.total_ranks;
+    reader->ts_offsets = malloc(sizeof(size_t) * nprocs);
+    reader->ts_sizes   = malloc(sizeof(size_t) * nprocs);
+
+    // the first nprocs size_t store the buf size
+    // of timestamps of each rank
+    // see lib/recorder-timestamps.c
+    size_t offset = nprocs * sizeof(size_t);
+    assert(reader->ts_map.size >= offset);
+    memcpy(reader->ts_sizes, reader->ts_map.addr, offset);
+    for(int rank = 0; rank < nprocs; rank++) {
+        reader->ts_offsets[rank] = offset;
+        offset += reader->ts_sizes[rank];
+    }
+    assert(offset <= reader->ts_map.size);
+}
+
 void check_version(RecorderReader* reader, int* v_major, int* v_minor) {
     char version_file[1096] = {0};
     sprintf(version_file, "%s/VERSION", reader->logs_dir);
@@ -178,6 +337,8 @@ void read_metadata(RecorderReader* reader) {
     fclose(fp);
 }
 
+static void read_index_file(RecorderReader* reader);
+
 void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
     assert(logs_dir);
     assert(reader);
@@ -188,14 +349,20 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
     reader->hdf5_start_idx = -1;
     reader->pnetcdf_start_idx = -1;
     reader->netcdf_start_idx = -1;
-    reader->prev_tstart = 0.0;
-
     check_version(reader, &reader->trace_version_major, &reader->trace_version_minor);
 
     read_metadata(reader);
+    if(reader->metadata.intraprocess_pattern_recognition)
+        reader_init_offset_decoding(reader);
 
     int nprocs= reader->metadata.total_ranks;
 
+    reader->ts_index = calloc(nprocs, sizeof(TimestampIndex*));
+    if (!(reader->trace_version_major == 2 && reader->trace_version_minor == 3)) {
+        map_timestamp_file(reader);
+        read_index_file(reader);
+    }
+
     reader->ug_ids = malloc(sizeof(int) * nprocs);
     reader->ugs    = malloc(sizeof(CFG*) * nprocs);
     reader->csts   = malloc(sizeof(CST*) * nprocs);
@@ -210,11 +377,9 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
         // Read and parse the cst file
         char cst_fname[1096] = {0};
         sprintf(cst_fname, "%s/recorder.cst", reader->logs_dir);
-        FILE* cst_file = fopen(cst_fname, "rb");
-        buf_cst = read_zlib(cst_file);
+        buf_cst = read_zlib_file(cst_fname);
         reader->csts[0] = (CST*) malloc(sizeof(CST));
         reader_decode_cst(0, buf_cst, reader->csts[0]);
-        fclose(cst_file);
         free(buf_cst);
 
         char ug_metadata_fname[1096] = {0};
@@ -224,53 +389,78 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader) {
         fread(&reader->num_ugs, sizeof(int), 1, f);
         fclose(f);
 
+        // ug.cfg stores the unique grammars back to back
         char cfg_fname[1096] = {0};
         sprintf(cfg_fname, "%s/ug.cfg", reader->logs_dir);
-        FILE* cfg_file = fopen(cfg_fname, "rb");
+        MappedFile cfg_map;
+        if(!map_file(cfg_fname, &cfg_map)) {
+            fprintf(stderr, "failed to read %s\n", cfg_fname);
+            exit(1);
+        }
+        size_t pos = 0;
         for(int i = 0; i < reader->num_ugs; i++) {
-            buf_cfg = read_zlib(cfg_file);
+            size_t consumed;
+            assert(pos + 2*sizeof(size_t) <= cfg_map.size);
+            buf_cfg = read_zlib(cfg_map.addr + pos, &consumed);
+            pos += consumed;
             reader->ugs[i] = (CFG*) malloc(sizeof(CFG));
             reader_decode_cfg(i, buf_cfg, reader->ugs[i]);
             free(buf_cfg);
         }
-        fclose(cfg_file);
+        unmap_file(&cfg_map);
+
+        if(reader->metadata.interprocess_grammar_sharing) {
+            char sg_fname[1096] = {0};
+            sprintf(sg_fname, "%s/sg.cfg", reader->logs_dir);
+            buf_cfg = read_zlib_file(sg_fname);
+            reader->shared_cfg = (CFG*) malloc(sizeof(CFG));
+            reader_decode_cfg(-1, buf_cfg, reader->shared_cfg);
+            free(buf_cfg);
+
+            for(int i = 0; i < reader->num_ugs; i++)
+                reader->ugs[i]->shared = reader->shared_cfg;
+        }
+
+        for(int i = 0; i < reader->num_ugs; i++)
+            reader_index_rules(reader->ugs[i]);
 
         for(int rank = 0; rank < nprocs; rank++) {
             reader->csts[rank] = reader->csts[0];
             reader->cfgs[rank] = reader->ugs[reader->ug_ids[rank]];
         }
     } else { // interprocess_compression == false
+        // ranks are loaded on first use, see reader_get_cst()
+        memset(reader->csts, 0, sizeof(CST*) * nprocs);
+        memset(reader->cfgs, 0, sizeof(CFG*) * nprocs);
+        reader_init_rank_cache(reader);
+    }
+}
 
-        for(int rank = 0; rank < nprocs; rank++) {
-            if (reader->trace_version_major == 2 && reader->trace_version_minor == 3) {
-                reader->csts[rank] = (CST*) malloc(sizeof(CST));
-                reader_decode_cst_2_3(reader, rank, reader->csts[rank]);
-            } else {
-                char cst_fname[1096] = {0};
-                sprintf(cst_fname, "%s/%d.cst", reader->logs_dir, rank);
-                FILE* cst_file = fopen(cst_fname, "rb");
-                void* buf_cst = read_zlib(cst_file);
-                reader->csts[rank] = (CST*) malloc(sizeof(CST));
-                reader_decode_cst(rank, buf_cst, reader->csts[rank]);
-                free(buf_cst);
-                fclose(cst_file);
-            }
+/**
+ * Read the CST and CFG of one rank,
+ * without interprocess compression
+ */
+void reader_load_rank(RecorderReader *reader, int rank) {
+    reader->csts[rank] = (CST*) malloc(sizeof(CST));
+    reader->cfgs[rank] = (CFG*) malloc(sizeof(CFG));
 
-            if (reader->trace_version_major == 2 && reader->trace_version_minor == 3) {
-                reader->cfgs[rank] = (CFG*) malloc(sizeof(CFG));
-                reader_decode_cfg_2_3(reader, rank, reader->cfgs[rank]);
-            } else {
-                char cfg_fname[1096] = {0};
-                sprintf(cfg_fname, "%s/%d.cfg", reader->logs_dir, rank);
-                FILE* cfg_file = fopen(cfg_fname, "rb");
-                void* buf_cfg = read_zlib(cfg_file);
-                reader->cfgs[rank] = (CFG*) malloc(sizeof(CFG));
-                reader_decode_cfg(rank, buf_cfg, reader->cfgs[rank]);
-                free(buf_cfg);
-                fclose(cfg_file);
-            }
-        }
+    if (reader->trace_version_major == 2 && reader->trace_version_minor == 3) {
+        reader_decode_cst_2_3(reader, rank, reader->csts[rank]);
+        reader_decode_cfg_2_3(reader, rank, reader->cfgs[rank]);
+    } else {
+        char cst_fname[1096] = {0};
+        sprintf(cst_fname, "%s/%d.cst", reader->logs_dir, rank);
+        void* buf_cst = read_zlib_file(cst_fname);
+        reader_decode_cst(rank, buf_cst, reader->csts[rank]);
+        free(buf_cst);
+
+        char cfg_fname[1096] = {0};
+        sprintf(cfg_fname, "%s/%d.cfg", reader->logs_dir, rank);
+        void* buf_cfg = read_zlib_file(cfg_fname);
+        reader_decode_cfg(rank, buf_cfg, reader->cfgs[rank]);
+        free(buf_cfg);
     }
+    reader_index_rules(reader->cfgs[rank]);
 }
 
 void recorder_free_reader(RecorderReader *reader) {
@@ -283,11 +473,12 @@ void recorder_free_reader(RecorderReader *reader) {
             reader_free_cfg(reader->ugs[i]);
             free(reader->ugs[i]);
         }
-    } else {
-        for(int rank = 0; rank < reader->metadata.total_ranks; rank++) {
-            reader_free_cst(reader->csts[rank]);
-            reader_free_cfg(reader->cfgs[rank]);
+        if(reader->shared_cfg) {
+            reader_free_cfg(reader->shared_cfg);
+            free(reader->shared_cfg);
         }
+    } else {
+        reader_free_rank_cache(reader);
     }
 
     free(reader->csts);
@@ -297,6 +488,13 @@ void recorder_free_reader(RecorderReader *reader) {
     for(int i = 0; i < reader->supported_funcs; i++)
         free(reader->func_list[i]);
     free(reader->func_list);
+    free(reader->offset_slots);
+    free(reader->ts_offsets);
+    free(reader->ts_sizes);
+    unmap_file(&reader->ts_map);
+    for(int rank = 0; rank < reader->metadata.total_ranks; rank++)
+        reader_free_timestamp_index(reader->ts_index[rank]);
+    free(reader->ts_index);
 
     memset(reader, 0, sizeof(*reader));
 }
@@ -338,50 +536,333 @@ void recorder_free_record(Record* r) {
 
 #define TERMINAL_START_ID 0
 
-void rule_application(RecorderReader* reader, CFG* cfg, CST* cst, int rule_id, uint32_t* ts_buf,
-        void (*user_op)(Record*, void*), void* user_arg, int free_record) {
-    RuleHash *rule = NULL;
-    HASH_FIND_INT(cfg->cfg_head, &rule_id, rule);
-    assert(rule != NULL);
+/*
+ * A record decoded by a worker of recorder_decode_records_ordered(),
+ * turned back into a view of templates[terminal] when delivered
+ */
+typedef struct ChunkRecord_t {
+    int terminal;
+    int offset_arg;         // argument replaced by offset, -1 if none
+    double tstart, tend;
+    char offset[32];
+} ChunkRecord;
+
+/*
+ * State of one decode_records_core() call
+ *
+ * templates[i] is the pre-decoded call signature i
+ * (see CST.records), with rank templates instantiated
+ * for the rank being decoded if needed.
+ */
+typedef struct DecodeState_t {
+    RecorderReader* reader;
+    int rank;
+    CFG* cfg;
+    Record* templates;
+    bool* instantiated;     // instantiated[i]: templates[i] was copied for this rank
+    bool  view;             // pass views, or records owned by user_op
+    void (*user_op)(Record*, void*);
+    void* user_arg;
+    uint32_t* ts;           // timestamps of the next record
+    size_t pos;             // index of the next record
+    size_t first, last;     // only records [first, last) are passed to user_op
+    bool   replay;          // walk records before first to restore the offset states
+    double prev_tstart;     // timestamps are deltas to the previous tstart
+    struct OffsetState_t* offset_states;    // see reader_decode_offsets()
+    ChunkRecord* sink;      // if set, records are stored here instead of passed to user_op
+    RecordBatch* batch;     // if set, records are stored in its columns and passed to batch_op
+    void (*batch_op)(RecordBatch*, void*);
+
+    // filtered decode, see recorder_decode_records_filtered()
+    const bool* selected;   // selected[terminal]: pass its records to user_op
+    bool* walk_terminal;    // walk_terminal[terminal]: selected or has offsets to decode
+    bool* walk_rule;        // walk_rule[-rule_id]: reaches a terminal to walk
+
+    // while replaying, offset states are copied to snapshots[i]
+    // once the first snapshot_at[i] records have been walked
+    int num_snapshots, next_snapshot;
+    size_t* snapshot_at;
+    struct OffsetState_t** snapshots;
+    char* args[256];        // arguments of a view whose offset was decoded
+    char  offset[32];
+} DecodeState;
+
+/*
+ * A rule being expanded by rule_application()
+ */
+typedef struct ExpansionFrame_t {
+    RuleHash* rule;
+    int sym;                // current symbol
+    int rep;                // expansions of the current symbol done so far
+} ExpansionFrame;
+
+/*
+ * Expansion of a rule, stopped once ds->last is reached
+ * and resumed from there by the next expand() call
+ */
+typedef struct Expansion_t {
+    ExpansionFrame* stack;
+    int top;
+    int capacity;
+} Expansion;
+
+static Record* copy_record(Record* record) {
+    Record* copy = malloc(sizeof(Record));
+    memcpy(copy, record, sizeof(Record));
+    copy->args = malloc(sizeof(char*) * record->arg_count);
+    for(int i = 0; i < record->arg_count; i++)
+        copy->args[i] = strdup(record->args[i]);
+    return copy;
+}
+
+/*
+ * Rank templates depend on the rank being decoded,
+ * so call signatures using them are copied and
+ * instantiated once per decode_records_core() call.
+ */
+static void prepare_templates(DecodeState* ds, CST* cst) {
+    ds->templates = cst->records;
+    ds->instantiated = NULL;
+    if(!ds->reader->metadata.interprocess_pattern_recognition)
+        return;
+
+    for(int i = 0; i < cst->entries; i++) {
+        Record* record = &cst->records[i];
+        bool has_template = false;
+        for(int j = 0; j < record->arg_count; j++)
+            if(record->args[j][0] == RECORDER_TEMPLATE_MARK)
+                has_template = true;
+        if(!has_template)
+            continue;
+
+        if(ds->instantiated == NULL) {
+            ds->templates = malloc(sizeof(Record) * cst->entries);
+            memcpy(ds->templates, cst->records, sizeof(Record) * cst->entries);
+            ds->instantiated = calloc(cst->entries, sizeof(bool));
+        }
+        Record* copy = copy_record(record);
+        reader_instantiate_args(copy, ds->rank);
+        ds->templates[i] = *copy;
+        ds->instantiated[i] = true;
+        free(copy);
+    }
+}
+
+static void release_templates(DecodeState* ds, CST* cst) {
+    if(ds->instantiated == NULL)
+        return;
+    for(int i = 0; i < cst->entries; i++) {
+        if(!ds->instantiated[i]) continue;
+        for(int j = 0; j < ds->templates[i].arg_count; j++)
+            free(ds->templates[i].args[j]);
+        free(ds->templates[i].args);
+    }
+    free(ds->templates);
+    free(ds->instantiated);
+}
+
+static void emit_record(DecodeState* ds, int terminal) {
+    RecorderReader* reader = ds->reader;
+    Record record = ds->templates[terminal];
+    int offset_arg = -1;
+    if(reader->metadata.intraprocess_pattern_recognition &&
+       reader_has_offsets(reader, &record)) {
+        memcpy(ds->args, record.args, sizeof(char*) * record.arg_count);
+        record.args = ds->args;
+        offset_arg = reader_decode_offsets(reader, &ds->offset_states, &record, ds->offset);
+    }
+    ds->pos++;
+
+    if(ds->pos <= ds->first) {      // replayed only for the offsets
+        if(ds->next_snapshot < ds->num_snapshots &&
+           ds->pos == ds->snapshot_at[ds->next_snapshot])
+            ds->snapshots[ds->next_snapshot++] = reader_copy_offset_states(ds->offset_states);
+        return;
+    }
+
+    // update timestamps
+    uint32_t ts[2] = {ds->ts[0], ds->ts[1]};
+    ds->ts += 2;
+    record.tstart = ts[0] * reader->metadata.time_resolution + ds->prev_tstart;
+    record.tend   = ts[1] * reader->metadata.time_resolution + ds->prev_tstart;
+    ds->prev_tstart = record.tstart;
+
+    if(ds->selected && !ds->selected[terminal])
+        return;
+
+    if(ds->sink) {
+        ChunkRecord* c = ds->sink++;
+        c->terminal   = terminal;
+        c->offset_arg = offset_arg;
+        c->tstart     = record.tstart;
+        c->tend       = record.tend;
+        if(offset_arg != -1)
+            memcpy(c->offset, ds->offset, sizeof(c->offset));
+    } else if(ds->batch) {
+        RecordBatch* batch = ds->batch;
+        size_t row = batch->rows++;
+        if(batch->tstart)     batch->tstart[row]     = record.tstart;
+        if(batch->tend)       batch->tend[row]       = record.tend;
+        if(batch->func_id)    batch->func_id[row]    = record.func_id;
+        if(batch->cs_id)      batch->cs_id[row]      = terminal;
+        if(batch->call_depth) batch->call_depth[row] = record.call_depth;
+        if(batch->tid)        batch->tid[row]        = record.tid;
+        if(batch->offset)     batch->offset[row]     = offset_arg == -1 ? -1 : atoll(ds->offset);
+        if(batch->rows == batch->capacity) {
+            ds->batch_op(batch, ds->user_arg);
+            batch->first += batch->rows;
+            batch->rows = 0;
+        }
+    } else if(ds->view)
+        ds->user_op(&record, ds->user_arg);
+    else
+        ds->user_op(copy_record(&record), ds->user_arg);
+}
+
+/*
+ * Pass over n records without emitting them,
+ * only their timestamps are chained
+ */
+static void skip_records(DecodeState* ds, size_t n) {
+    double res = ds->reader->metadata.time_resolution;
+    for(size_t i = 0; i < n; i++)
+        ds->prev_tstart = ds->ts[2*i] * res + ds->prev_tstart;
+    ds->ts  += 2*n;
+    ds->pos += n;
+}
+
+static void init_expansion(Expansion* e, CFG* cfg, int rule_id) {
+    e->capacity = 64;
+    e->stack = malloc(sizeof(ExpansionFrame) * e->capacity);
+    e->top = 0;
+    e->stack[0].rule = reader_get_rule(cfg, rule_id);
+    e->stack[0].sym  = 0;
+    e->stack[0].rep  = 0;
+    assert(e->stack[0].rule != NULL);
+}
 
-    for(int i = 0; i < rule->symbols; i++) {
-        int sym_val = rule->rule_body[2*i+0];
-        int sym_exp = rule->rule_body[2*i+1];
+/*
+ * Emit the terminals of an expansion in order, up to ds->last
+ *
+ * Rules are expanded with an explicit stack, nested
+ * rules can be much deeper than the C stack allows.
+ *
+ * Only records [ds->first, ds->last) are emitted. Whole
+ * repetitions of rules that end before ds->first are
+ * skipped using the expanded length of the rules, unless
+ * they have to be replayed to restore the offset states.
+ * With a filter, rules and terminals that need no walk
+ * are passed over as a whole. Nothing past ds->last is
+ * consumed, so the expansion can go on with a larger
+ * ds->last.
+ */
+static void expand(DecodeState* ds, Expansion* e) {
+    CFG* cfg = ds->cfg;
+
+    while(e->top >= 0 && ds->pos < ds->last) {
+        ExpansionFrame* f = &e->stack[e->top];
+        if(f->sym == f->rule->symbols) {
+            e->top--;
+            continue;
+        }
+
+        int sym_val = f->rule->rule_body[2*f->sym+0];
+        int sym_exp = f->rule->rule_body[2*f->sym+1];
 
         if (sym_val >= TERMINAL_START_ID) { // terminal
-            for(int j = 0; j < sym_exp; j++) {
-                Record* record = reader_cs_to_record(&(cst->cs_list[sym_val]));
-                // update timestamps
-                uint32_t ts[2] = {ts_buf[0], ts_buf[1]};
-                ts_buf += 2;
-                record->tstart = ts[0] * reader->metadata.time_resolution + reader->prev_tstart;
-                record->tend   = ts[1] * reader->metadata.time_resolution + reader->prev_tstart;
-                reader->prev_tstart = record->tstart;
-
-                user_op(record, user_arg);
-                if(free_record)
-                    recorder_free_record(record);
+            size_t n = sym_exp - f->rep;    // records left
+            if(!ds->replay && ds->pos < ds->first) {
+                size_t skip = ds->first - ds->pos < n ? ds->first - ds->pos : n;
+                ds->pos += skip;
+                f->rep += skip;
+                n -= skip;
+            }
+            if(ds->walk_terminal && !ds->walk_terminal[sym_val] && ds->pos >= ds->first) {
+                size_t skip = ds->last - ds->pos < n ? ds->last - ds->pos : n;
+                skip_records(ds, skip);
+                f->rep += skip;
+                n -= skip;
+            }
+            for(; n > 0 && ds->pos < ds->last; n--, f->rep++)
+                emit_record(ds, sym_val);
+            if(f->rep == sym_exp) {
+                f->sym++;
+                f->rep = 0;
+            }
+        } else if (f->rep == sym_exp) {     // non-terminal done
+            f->sym++;
+            f->rep = 0;
+        } else {                            // expand the non-terminal once more
+            if(!ds->replay && ds->pos < ds->first) {
+                size_t length = cfg->rule_lengths[-sym_val];
+                size_t skip = length ? (ds->first - ds->pos) / length : (size_t) sym_exp;
+                if(skip > (size_t) (sym_exp - f->rep))
+                    skip = sym_exp - f->rep;
+                f->rep  += skip;
+                ds->pos += skip * length;
+                if(f->rep == sym_exp)
+                    continue;
+            }
+            if(ds->walk_rule && !ds->walk_rule[-sym_val] && ds->pos >= ds->first) {
+                // whole repetitions up to ds->last, the rest is walked into
+                size_t length = cfg->rule_lengths[-sym_val];
+                size_t skip = length ? (ds->last - ds->pos) / length : (size_t) sym_exp;
+                if(skip > (size_t) (sym_exp - f->rep))
+                    skip = sym_exp - f->rep;
+                skip_records(ds, skip * length);
+                f->rep += skip;
+                if(f->rep == sym_exp || ds->pos == ds->last)
+                    continue;
             }
-        } else {                            // non-terminal (i.e., rule)
-            for(int j = 0; j < sym_exp; j++)
-                rule_application(reader, cfg, cst, sym_val, ts_buf, user_op, user_arg, free_record);
+            f->rep++;
+            if(e->top + 1 == e->capacity) {
+                e->capacity *= 2;
+                e->stack = realloc(e->stack, sizeof(ExpansionFrame) * e->capacity);
+            }
+            e->top++;
+            e->stack[e->top].rule = cfg->rule_table[-sym_val];
+            e->stack[e->top].sym  = 0;
+            e->stack[e->top].rep  = 0;
+            assert(e->stack[e->top].rule != NULL);
         }
     }
 }
 
-// caller must free the timestamp
-// buffer after use
+/*
+ * Expand a rule and emit its terminals in order,
+ * see expand()
+ */
+void rule_application(DecodeState* ds, int rule_id) {
+    Expansion e;
+    init_expansion(&e, ds->cfg, rule_id);
+    expand(ds, &e);
+    free(e.stack);
+}
+
+/**
+ * Return the timestamps of a rank, two uint32_t per record.
+ *
+ * Uncompressed timestamps are returned in place, i.e., as a
+ * pointer into the mapped recorder.ts. Compressed timestamps
+ * are inflated directly into a single buffer. The tracer grows
+ * its timestamp buffer instead of flushing it and writes it out
+ * once at finalize (see ts_write_out()), so a section normally
+ * holds a single zlib block. Several blocks, e.g., from
+ * concatenated sections, are inflated one after the other.
+ *
+ * Use release_timestamps() once done.
+ */
 uint32_t* read_timestamp_file(RecorderReader* reader, int rank) {
 
-    char ts_fname[1096] = {0};
     uint32_t* ts_buf = NULL;
 
     if (reader->trace_version_major==2 && reader->trace_version_minor==3) {
+        char ts_fname[1096] = {0};
         sprintf(ts_fname, "%s/%d.ts", reader->logs_dir, rank);
         FILE* ts_file = fopen(ts_fname, "rb");
         fseek(ts_file, 0, SEEK_END);
         long filesize = ftell(ts_file);
-        fseek(ts_file, 0, SEEK_CUR);
+        fseek(ts_file, 0, SEEK_SET);
 
         ts_buf = (uint32_t*) malloc(filesize); 
         fread(ts_buf, 1, filesize, ts_file);
@@ -390,87 +871,1209 @@ uint32_t* read_timestamp_file(RecorderReader* reader, int rank) {
         return ts_buf;
     }
 
-    int nprocs = reader->metadata.total_ranks;
+    void* section = reader->ts_map.addr + reader->ts_offsets[rank];
+    size_t section_size = reader->ts_sizes[rank];
 
-    sprintf(ts_fname, "%s/recorder.ts", reader->logs_dir);
-    FILE* ts_file = fopen(ts_fname, "rb");
+    if (!reader->metadata.ts_compression)
+        return (uint32_t*) section;
 
-    // the first nprocs size_t store the buf size 
-    // of timestamps of each rank
-    // see lib/recorder-timestamps.c
-    size_t buf_sizes[nprocs];
-    fread(buf_sizes, sizeof(size_t), nprocs, ts_file);
+    size_t total = 0, pos = 0;
+    while (pos + 2*sizeof(size_t) <= section_size) {
+        size_t compressed_size, decompressed_size;
+        memcpy(&compressed_size, section+pos, sizeof(size_t));
+        memcpy(&decompressed_size, section+pos+sizeof(size_t), sizeof(size_t));
+        total += decompressed_size;
+        pos += 2*sizeof(size_t) + compressed_size;
+    }
+
+    ts_buf = (uint32_t*) malloc(total);
+    void* dst = ts_buf;
+    pos = 0;
+    while (pos + 2*sizeof(size_t) <= section_size) {
+        size_t compressed_size, decompressed_size;
+        memcpy(&compressed_size, section+pos, sizeof(size_t));
+        memcpy(&decompressed_size, section+pos+sizeof(size_t), sizeof(size_t));
+        if (!inflate_into(section+pos+2*sizeof(size_t), compressed_size, dst, decompressed_size)) {
+            fprintf(stderr, "failed to decompress timestamps of rank %d\n", rank);
+            exit(1);
+        }
+        dst += decompressed_size;
+        pos += 2*sizeof(size_t) + compressed_size;
+    }
+    return ts_buf;
+}
+
+void release_timestamps(RecorderReader* reader, uint32_t* ts_buf) {
+    char* p = (char*) ts_buf;
+    char* base = reader->ts_map.addr;
+    if (base == NULL || p < base || p >= base + reader->ts_map.size)
+        free(ts_buf);
+}
+
+
+/*
+ * Chain the tstart of the records of a checkpoint, starting
+ * with record first of the rank, and widen the time span
+ * of the rank with them
+ */
+static void scan_records(TimestampIndex* idx, uint32_t* ts, size_t first, size_t records,
+                         double res, double* prev_tstart) {
+    for (size_t i = 0; i < records; i++) {
+        // same arithmetic as emit_record()
+        double tstart = ts[2*i+0] * res + *prev_tstart;
+        double tend   = ts[2*i+1] * res + *prev_tstart;
+        if (first + i == 0)
+            idx->tstart = tstart;
+        if (tend > idx->tend)
+            idx->tend = tend;
+        *prev_tstart = tstart;
+    }
+}
+
+/*
+ * Output between two checkpoints of a zlib block, so a
+ * range of records needs to inflate at most this much
+ * before its first record
+ */
+#define TS_CHECKPOINT_SPAN  (1<<20)
+
+static TimestampCheckpoint* add_checkpoint(TimestampIndex* idx) {
+    idx->checkpoints = realloc(idx->checkpoints, sizeof(TimestampCheckpoint) * (idx->num_checkpoints+1));
+    TimestampCheckpoint* cp = &idx->checkpoints[idx->num_checkpoints++];
+    memset(cp, 0, sizeof(*cp));
+    return cp;
+}
+
+/*
+ * Inflate one zlib block of timestamps into ts and add its
+ * checkpoints: one at its start and one at the first deflate
+ * block boundary after every TS_CHECKPOINT_SPAN of output.
+ */
+static bool index_zlib_block(TimestampIndex* idx, const void* block, size_t offset, uint32_t* ts) {
+    size_t compressed_size, decompressed_size;
+    memcpy(&compressed_size, block, sizeof(size_t));
+    memcpy(&decompressed_size, block+sizeof(size_t), sizeof(size_t));
+    const unsigned char* src = block + 2*sizeof(size_t);
+    unsigned char* out = (unsigned char*) ts;
+    size_t first = idx->records;
+    size_t records = decompressed_size / (2*sizeof(uint32_t));
+
+    TimestampCheckpoint* cp = add_checkpoint(idx);
+    cp->offset = offset;
+    cp->size   = 2*sizeof(size_t) + compressed_size;
+    cp->first  = first;
+
+    Inflater inf;
+    if (!inflater_init(&inf, MAX_WBITS, src, compressed_size))
+        return false;
+    inflater_set_output(&inf, out, decompressed_size);
+
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        ret = inflater_step(&inf, Z_BLOCK);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            (void)inflateEnd(&inf.strm);
+            return false;
+        }
+        // at the end of a deflate block that is not the last one
+        int data_type = inf.strm.data_type;
+        if (ret == Z_STREAM_END || !(data_type & 128) || (data_type & 64))
+            continue;
+        size_t produced = decompressed_size - inf.out_left - inf.strm.avail_out;
+        size_t next = (produced + 2*sizeof(uint32_t) - 1) / (2*sizeof(uint32_t));
+        if (produced - (idx->checkpoints[idx->num_checkpoints-1].first - first) * 2*sizeof(uint32_t) < TS_CHECKPOINT_SPAN ||
+            next >= records)
+            continue;
+
+        unsigned window_size = produced < 32768 ? produced : 32768;
+        cp = add_checkpoint(idx);
+        cp->offset = offset;
+        cp->size   = 2*sizeof(size_t) + compressed_size;
+        cp->in     = inflater_consumed(&inf, compressed_size);
+        cp->bits   = data_type & 7;
+        cp->skip   = next * 2*sizeof(uint32_t) - produced;
+        cp->first  = first + next;
+        cp->window_size = window_size;
+        cp->window = malloc(window_size);
+        memcpy(cp->window, out + produced - window_size, window_size);
+    }
+    (void)inflateEnd(&inf.strm);
+    return true;
+}
+
+/**
+ * Build (once) the timestamp index of a rank
+ *
+ * Timestamps are stored as deltas to the tstart of the previous
+ * record, so every checkpoint keeps the tstart chained up to its
+ * first record and decoding can start at any of them. See
+ * TimestampCheckpoint for where checkpoints are taken.
+ */
+TimestampIndex* reader_get_timestamp_index(RecorderReader* reader, int rank) {
+    if (reader->ts_index[rank])
+        return reader->ts_index[rank];
+
+    TimestampIndex* idx = calloc(1, sizeof(TimestampIndex));
+    double res = reader->metadata.time_resolution;
+    double prev_tstart = 0;
 
-    // calculate the starting offset of the desired rank
-    // nprocs*sizeof(size_t) + offset
-    size_t offset = 0;
-    for(int r = 0; r < rank; r++) {
-        offset += buf_sizes[r];
+    if (reader->trace_version_major==2 && reader->trace_version_minor==3) {
+        // a single checkpoint, see read_timestamp_range()
+        reader_pin_rank(reader, rank);
+        idx->records = reader_get_cfg(reader, rank)->rule_lengths[1];   // length of rule -1
+        reader_unpin_rank(reader, rank);
+        add_checkpoint(idx)->records = idx->records;
+
+        uint32_t* ts = read_timestamp_file(reader, rank);
+        scan_records(idx, ts, 0, idx->records, res, &prev_tstart);
+        release_timestamps(reader, ts);
+        reader->ts_index[rank] = idx;
+        return idx;
     }
-    fseek(ts_file, offset, SEEK_CUR);
 
-    // finally read to the buffer
+    void* section = reader->ts_map.addr + reader->ts_offsets[rank];
+    size_t section_size = reader->ts_sizes[rank];
+
     if (reader->metadata.ts_compression) {
-        ts_buf = (uint32_t*) read_zlib(ts_file);
+        uint32_t* ts = NULL;
+        size_t ts_capacity = 0;
+        size_t pos = 0;
+        while (pos + 2*sizeof(size_t) <= section_size) {
+            size_t compressed_size, decompressed_size;
+            memcpy(&compressed_size, section+pos, sizeof(size_t));
+            memcpy(&decompressed_size, section+pos+sizeof(size_t), sizeof(size_t));
+            if (decompressed_size > ts_capacity) {
+                ts_capacity = decompressed_size;
+                ts = realloc(ts, ts_capacity);
+            }
+            int c = idx->num_checkpoints;
+            if (!index_zlib_block(idx, section+pos, pos, ts)) {
+                fprintf(stderr, "failed to decompress timestamps of rank %d\n", rank);
+                exit(1);
+            }
+
+            // chain the tstart up to each new checkpoint
+            size_t block_first = idx->records;
+            idx->records += decompressed_size / (2*sizeof(uint32_t));
+            for (; c < idx->num_checkpoints; c++) {
+                TimestampCheckpoint* cp = &idx->checkpoints[c];
+                size_t end = c+1 < idx->num_checkpoints ? idx->checkpoints[c+1].first : idx->records;
+                cp->records = end - cp->first;
+                cp->tstart  = prev_tstart;
+                scan_records(idx, ts + 2*(cp->first - block_first), cp->first, cp->records, res, &prev_tstart);
+            }
+            pos += 2*sizeof(size_t) + compressed_size;
+        }
+        free(ts);
     } else {
-        ts_buf = (uint32_t*) malloc(buf_sizes[rank]); 
-        fread(ts_buf, 1, buf_sizes[rank], ts_file);
+        uint32_t* ts = (uint32_t*) section;
+        size_t records = section_size / (2*sizeof(uint32_t));
+        size_t span = TS_CHECKPOINT_SPAN / (2*sizeof(uint32_t));
+        for (size_t first = 0; first < records; first += span) {
+            TimestampCheckpoint* cp = add_checkpoint(idx);
+            cp->first   = first;
+            cp->records = records - first < span ? records - first : span;
+            cp->offset  = first * 2*sizeof(uint32_t);
+            cp->size    = cp->records * 2*sizeof(uint32_t);
+            cp->tstart  = prev_tstart;
+            scan_records(idx, ts + 2*first, first, cp->records, res, &prev_tstart);
+        }
+        idx->records = records;
     }
-    fclose(ts_file);
-    return ts_buf;
+
+    reader->ts_index[rank] = idx;
+    return idx;
 }
 
+void reader_free_timestamp_index(TimestampIndex* idx) {
+    if (idx == NULL)
+        return;
+    for (int c = 0; c < idx->num_checkpoints; c++)
+        free(idx->checkpoints[c].window);
+    free(idx->checkpoints);
+    free(idx);
+}
 
-void decode_records_core(RecorderReader *reader, int rank,
-        void (*user_op)(Record*, void*), void* user_arg, bool free_record) {
+/*
+ * recorder.idx stores the timestamp index of every rank:
+ * an IndexHeader, then for each rank its number of records,
+ * time span, number of checkpoints and the checkpoints, each
+ * followed by its window.
+ */
+#define RECORDER_INDEX_MAGIC    0x58444952      // "RIDX"
+#define RECORDER_INDEX_VERSION  2
+
+typedef struct IndexHeader_t {
+    int    magic;
+    int    version;
+    int    nprocs;
+    size_t ts_size;         // size of recorder.ts, to detect a stale index
+} IndexHeader;
+
+// a TimestampCheckpoint without its window
+typedef struct IndexCheckpoint_t {
+    size_t offset;
+    size_t size;
+    size_t in;
+    size_t first;
+    size_t records;
+    double tstart;
+    int    bits;
+    int    skip;
+    unsigned window_size;
+} IndexCheckpoint;
+
+int reader_write_index(RecorderReader* reader) {
+    if (reader->trace_version_major==2 && reader->trace_version_minor==3)
+        return -1;
+
+    char idx_fname[1096] = {0};
+    sprintf(idx_fname, "%s/%s", reader->logs_dir, RECORDER_INDEX_FILE);
+    FILE* f = fopen(idx_fname, "wb");
+    if (f == NULL)
+        return -1;
+
+    IndexHeader header = {RECORDER_INDEX_MAGIC, RECORDER_INDEX_VERSION,
+                          reader->metadata.total_ranks, reader->ts_map.size};
+    fwrite(&header, sizeof(header), 1, f);
+    for (int rank = 0; rank < reader->metadata.total_ranks; rank++) {
+        TimestampIndex* idx = reader_get_timestamp_index(reader, rank);
+        fwrite(&idx->records, sizeof(size_t), 1, f);
+        fwrite(&idx->tstart, sizeof(double), 1, f);
+        fwrite(&idx->tend, sizeof(double), 1, f);
+        fwrite(&idx->num_checkpoints, sizeof(int), 1, f);
+        for (int c = 0; c < idx->num_checkpoints; c++) {
+            TimestampCheckpoint* cp = &idx->checkpoints[c];
+            IndexCheckpoint icp;
+            memset(&icp, 0, sizeof(icp));
+            icp.offset  = cp->offset;
+            icp.size    = cp->size;
+            icp.in      = cp->in;
+            icp.first   = cp->first;
+            icp.records = cp->records;
+            icp.tstart  = cp->tstart;
+            icp.bits    = cp->bits;
+            icp.skip    = cp->skip;
+            icp.window_size = cp->window_size;
+            fwrite(&icp, sizeof(icp), 1, f);
+            fwrite(cp->window, 1, cp->window_size, f);
+        }
+    }
 
-    CST* cst = reader_get_cst(reader, rank);
-    CFG* cfg = reader_get_cfg(reader, rank);
+    int ok = !ferror(f);
+    if (fclose(f) != 0 || !ok)
+        return -1;
+    return 0;
+}
 
-    reader->prev_tstart = 0.0;
+/*
+ * Load recorder.idx if present, so the timestamp index
+ * of the ranks does not need to be rebuilt. A stale or
+ * damaged index, or one of an older version, is ignored.
+ */
+static void read_index_file(RecorderReader* reader) {
+    char idx_fname[1096] = {0};
+    sprintf(idx_fname, "%s/%s", reader->logs_dir, RECORDER_INDEX_FILE);
+    FILE* f = fopen(idx_fname, "rb");
+    if (f == NULL)
+        return;
 
-    uint32_t* ts_buf = read_timestamp_file(reader, rank);
+    int nprocs = reader->metadata.total_ranks;
+    IndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              header.magic   == RECORDER_INDEX_MAGIC &&
+              header.version == RECORDER_INDEX_VERSION &&
+              header.nprocs  == nprocs &&
+              header.ts_size == reader->ts_map.size;
+
+    TimestampIndex** ts_index = calloc(nprocs, sizeof(TimestampIndex*));
+    for (int rank = 0; ok && rank < nprocs; rank++) {
+        TimestampIndex* idx = calloc(1, sizeof(TimestampIndex));
+        ts_index[rank] = idx;
+        int num_checkpoints;
+        ok = fread(&idx->records, sizeof(size_t), 1, f) == 1 &&
+             fread(&idx->tstart, sizeof(double), 1, f) == 1 &&
+             fread(&idx->tend, sizeof(double), 1, f) == 1 &&
+             fread(&num_checkpoints, sizeof(int), 1, f) == 1 &&
+             num_checkpoints >= 0;
+        for (int c = 0; ok && c < num_checkpoints; c++) {
+            IndexCheckpoint icp;
+            ok = fread(&icp, sizeof(icp), 1, f) == 1 && icp.window_size <= 32768;
+            if (!ok)
+                break;
+            TimestampCheckpoint* cp = add_checkpoint(idx);
+            cp->offset  = icp.offset;
+            cp->size    = icp.size;
+            cp->in      = icp.in;
+            cp->first   = icp.first;
+            cp->records = icp.records;
+            cp->tstart  = icp.tstart;
+            cp->bits    = icp.bits;
+            cp->skip    = icp.skip;
+            if (icp.window_size > 0) {
+                cp->window_size = icp.window_size;
+                cp->window = malloc(icp.window_size);
+                ok = fread(cp->window, 1, icp.window_size, f) == icp.window_size;
+            }
+        }
+    }
+    fclose(f);
+
+    if (ok) {
+        free(reader->ts_index);
+        reader->ts_index = ts_index;
+    } else {
+        fprintf(stderr, "ignoring %s, it does not match this trace or reader version\n", idx_fname);
+        for (int rank = 0; rank < nprocs; rank++)
+            reader_free_timestamp_index(ts_index[rank]);
+        free(ts_index);
+    }
+}
+
+void recorder_get_rank_span(RecorderReader* reader, int rank, size_t* records, double* tstart, double* tend) {
+    TimestampIndex* idx = reader_get_timestamp_index(reader, rank);
+    if (records) *records = idx->records;
+    if (tstart)  *tstart  = idx->tstart;
+    if (tend)    *tend    = idx->tend;
+}
+
+// index of the last checkpoint at or before the given record
+static int find_checkpoint(TimestampIndex* idx, size_t record) {
+    int lo = 0, hi = idx->num_checkpoints - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (idx->checkpoints[mid].first <= record)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Inflate size bytes of timestamps starting at record
+ * cp->first, resuming the zlib block at the checkpoint
+ */
+static bool inflate_from_checkpoint(void* section, TimestampCheckpoint* cp, void* dst, size_t size) {
+    const unsigned char* src = section + cp->offset + 2*sizeof(size_t);
+    size_t src_size = cp->size - 2*sizeof(size_t);
+
+    Inflater inf;
+    if (cp->in == 0) {
+        if (!inflater_init(&inf, MAX_WBITS, src, src_size))
+            return false;
+    } else {
+        // raw deflate data from the boundary on, with the bits
+        // of the boundary byte that belong to the next block
+        if (!inflater_init(&inf, -MAX_WBITS, src + cp->in, src_size - cp->in))
+            return false;
+        if ((cp->bits && inflatePrime(&inf.strm, cp->bits, src[cp->in-1] >> (8 - cp->bits)) != Z_OK) ||
+            inflateSetDictionary(&inf.strm, cp->window, cp->window_size) != Z_OK) {
+            (void)inflateEnd(&inf.strm);
+            return false;
+        }
+    }
+
+    // the checkpoint may be inside the timestamps of record first-1
+    unsigned char skipped[2*sizeof(uint32_t)];
+    bool ok = true;
+    if (cp->skip > 0) {
+        inflater_set_output(&inf, skipped, cp->skip);
+        ok = inflater_run(&inf, true);
+    }
+    if (ok) {
+        inflater_set_output(&inf, dst, size);
+        ok = inflater_run(&inf, true) && inflater_full(&inf);
+    }
+    (void)inflateEnd(&inf.strm);
+    return ok;
+}
+
+/**
+ * Read the timestamps of records [first, last)
+ *
+ * Decompression starts at the closest checkpoint before
+ * record first and stops at record last.
+ * @ts: [out] timestamps of record first
+ * @prev_tstart: [out] tstart of record first-1, 0 if first is 0
+ * @return: the buffer to release with release_timestamps()
+ */
+static uint32_t* read_timestamp_range(RecorderReader* reader, int rank, size_t first, size_t last,
+                                      uint32_t** ts, double* prev_tstart) {
+    TimestampIndex* idx = reader_get_timestamp_index(reader, rank);
+    double res = reader->metadata.time_resolution;
+    uint32_t* buf;
+    size_t buf_first;       // record whose timestamps start buf
+
+    if (reader->trace_version_major==2 && reader->trace_version_minor==3) {
+        buf = read_timestamp_file(reader, rank);
+        buf_first = 0;
+        *prev_tstart = 0;
+    } else {
+        int c = find_checkpoint(idx, first);
+        void* section = reader->ts_map.addr + reader->ts_offsets[rank];
+        buf_first = idx->checkpoints[c].first;
+        *prev_tstart = idx->checkpoints[c].tstart;
+
+        if (!reader->metadata.ts_compression) {
+            buf = (uint32_t*) (section + idx->checkpoints[c].offset);
+        } else {
+            // from the checkpoint to the end of its zlib block,
+            // then from the start of the next ones
+            buf = malloc((last - buf_first) * 2*sizeof(uint32_t));
+            size_t done = buf_first;
+            while (done < last) {
+                TimestampCheckpoint* cp = &idx->checkpoints[c];
+                size_t end = done;
+                for (; c < idx->num_checkpoints && idx->checkpoints[c].offset == cp->offset; c++)
+                    end += idx->checkpoints[c].records;
+                if (end > last)
+                    end = last;
+                if (!inflate_from_checkpoint(section, cp, buf + 2*(done - buf_first),
+                                             (end - done) * 2*sizeof(uint32_t))) {
+                    fprintf(stderr, "failed to decompress timestamps of rank %d\n", rank);
+                    exit(1);
+                }
+                done = end;
+            }
+        }
+    }
+
+    for (size_t i = buf_first; i < first; i++)
+        *prev_tstart = buf[2*(i-buf_first)] * res + *prev_tstart;
+    *ts = buf + 2*(first - buf_first);
+    return buf;
+}
+
+static void init_decode_state(DecodeState* ds, RecorderReader *reader, int rank, size_t first, size_t last,
+        void (*user_op)(Record*, void*), void* user_arg, bool view) {
+    memset(ds, 0, sizeof(*ds));
+    reader_pin_rank(reader, rank);      // unpinned by end_decode_state()
+    ds->reader   = reader;
+    ds->rank     = rank;
+    ds->cfg      = reader_get_cfg(reader, rank);
+    ds->view     = view;
+    ds->user_op  = user_op;
+    ds->user_arg = user_arg;
+    ds->first    = first;
+    ds->last     = last;
+    ds->replay   = first > 0 && reader->metadata.intraprocess_pattern_recognition;
+
+    size_t records = ds->cfg->rule_lengths[1];    // length of rule -1
+    if (ds->last > records)
+        ds->last = records;
+}
+
+static void end_decode_state(DecodeState* ds) {
+    reader_unpin_rank(ds->reader, ds->rank);
+}
+
+/*
+ * Decode records [ds->first, ds->last) with
+ * templates already prepared. The timestamps
+ * are read here unless ds->ts is already set.
+ */
+static void run_decode(DecodeState* ds) {
+    RecorderReader* reader = ds->reader;
+    if (ds->first >= ds->last)
+        return;
 
-    rule_application(reader, cfg, cst, -1, ts_buf, user_op, user_arg, free_record);
+    uint32_t* ts_buf = NULL;
+    if (ds->ts) {
+        // shared with other decodes, see decode_split()
+    } else if (ds->first == 0 && ds->last == ds->cfg->rule_lengths[1]) {
+        ts_buf = read_timestamp_file(reader, ds->rank);
+        ds->ts = ts_buf;
+    } else {
+        ts_buf = read_timestamp_range(reader, ds->rank, ds->first, ds->last, &ds->ts, &ds->prev_tstart);
+    }
 
-    free(ts_buf);
+    rule_application(ds, -1);
+    reader_reset_offset_states(&ds->offset_states);
+    if (ts_buf)
+        release_timestamps(reader, ts_buf);
+}
+
+void decode_records_core(RecorderReader *reader, int rank, size_t first, size_t last,
+        void (*user_op)(Record*, void*), void* user_arg, bool view) {
+
+    DecodeState ds;
+    init_decode_state(&ds, reader, rank, first, last, user_op, user_arg, view);
+    if (ds.first < ds.last) {
+        CST* cst = reader_get_cst(reader, rank);
+        prepare_templates(&ds, cst);
+        run_decode(&ds);
+        release_templates(&ds, cst);
+    }
+    end_decode_state(&ds);
 }
 
 // Decode all records for one rank
 // one record at a time
 void recorder_decode_records(RecorderReader *reader, int rank,
         void (*user_op)(Record*, void*), void* user_arg) {
-    decode_records_core(reader, rank, user_op, user_arg, true);
+    decode_records_core(reader, rank, 0, SIZE_MAX, user_op, user_arg, true);
 }
 
 void recorder_decode_records2(RecorderReader *reader, int rank,
         void (*user_op)(Record*, void*), void* user_arg) {
-    decode_records_core(reader, rank, user_op, user_arg, false);
+    decode_records_core(reader, rank, 0, SIZE_MAX, user_op, user_arg, false);
 }
 
+void recorder_decode_range(RecorderReader *reader, int rank, size_t first, size_t last,
+        void (*user_op)(Record*, void*), void* user_arg) {
+    decode_records_core(reader, rank, first, last, user_op, user_arg, true);
+}
 
-/**
- * Similar to rule application, but only calcuate
- * the total number of calls if uncompressed.
+void recorder_decode_batch(RecorderReader *reader, int rank, RecordBatch* batch,
+        void (*batch_op)(RecordBatch*, void*), void* user_arg) {
+
+    assert(batch->capacity > 0);
+    batch->rows  = 0;
+    batch->first = 0;
+
+    DecodeState ds;
+    init_decode_state(&ds, reader, rank, 0, SIZE_MAX, NULL, user_arg, true);
+    ds.batch    = batch;
+    ds.batch_op = batch_op;
+    if (ds.first < ds.last) {
+        CST* cst = reader_get_cst(reader, rank);
+        prepare_templates(&ds, cst);
+        run_decode(&ds);
+        release_templates(&ds, cst);
+    }
+    end_decode_state(&ds);
+
+    if (batch->rows > 0) {
+        batch_op(batch, user_arg);
+        batch->first += batch->rows;
+        batch->rows = 0;
+    }
+}
+
+Record* recorder_copy_record(Record* record) {
+    return copy_record(record);
+}
+
+Record* recorder_get_call_signature(RecorderReader *reader, int rank, int cs_id) {
+    reader_pin_rank(reader, rank);
+    CST* cst = reader_get_cst(reader, rank);
+    Record* record = NULL;
+    if (cs_id >= 0 && cs_id < cst->entries)
+        record = copy_record(&cst->records[cs_id]);
+    reader_unpin_rank(reader, rank);
+    if (record == NULL)
+        return NULL;
+    if (reader->metadata.interprocess_pattern_recognition)
+        reader_instantiate_args(record, rank);
+    return record;
+}
+
+bool* recorder_select_call_signatures(RecorderReader *reader, int rank,
+        bool (*predicate)(Record*, void*), void* user_arg) {
+    reader_pin_rank(reader, rank);
+    CST* cst = reader_get_cst(reader, rank);
+    bool* selected = calloc(cst->entries, sizeof(bool));
+    for (int i = 0; i < cst->entries; i++) {
+        Record* record = recorder_get_call_signature(reader, rank, i);
+        selected[i] = predicate(record, user_arg);
+        recorder_free_record(record);
+    }
+    reader_unpin_rank(reader, rank);
+    return selected;
+}
+
+/*
+ * Walk only the selected terminals and the rules reaching them
  */
-size_t get_uncompressed_count(RecorderReader* reader, CFG* cfg, int rule_id) {
-    RuleHash *rule = NULL;
-    HASH_FIND_INT(cfg->cfg_head, &rule_id, rule);
-    assert(rule != NULL);
+static void select_terminals(DecodeState* ds, CST* cst, const bool* selected) {
+    RecorderReader* reader = ds->reader;
+
+    // offsets are relative to the previous access of the file,
+    // so records with offsets are walked even if not selected
+    ds->selected = selected;
+    ds->walk_terminal = malloc(sizeof(bool) * cst->entries);
+    for (int i = 0; i < cst->entries; i++) {
+        ds->walk_terminal[i] = selected[i] ||
+            (reader->metadata.intraprocess_pattern_recognition &&
+             reader_has_offsets(reader, &ds->templates[i]));
+    }
+    ds->walk_rule = reader_rules_reaching(ds->cfg, ds->walk_terminal);
+}
 
-    size_t count = 0;
+typedef struct FilterOp_t {
+    DecodeState* ds;
+    void (*user_op)(Record*, size_t, void*);
+    void* user_arg;
+} FilterOp;
 
-    for(int i = 0; i < rule->symbols; i++) {
-        int sym_val = rule->rule_body[2*i+0];
-        int sym_exp = rule->rule_body[2*i+1];
-        if (sym_val >= TERMINAL_START_ID) { // terminal
-            count += sym_exp;
-        } else {                            // non-terminal (i.e., rule)
-            count += sym_exp * get_uncompressed_count(reader, cfg, sym_val);
+static void filter_op(Record* record, void* arg) {
+    FilterOp* op = (FilterOp*) arg;
+    op->user_op(record, op->ds->pos - 1, op->user_arg);
+}
+
+void recorder_decode_records_filtered(RecorderReader *reader, int rank, const bool* selected,
+        void (*user_op)(Record*, size_t, void*), void* user_arg) {
+
+    DecodeState ds;
+    FilterOp op = {&ds, user_op, user_arg};
+    init_decode_state(&ds, reader, rank, 0, SIZE_MAX, filter_op, &op, true);
+    if (ds.first >= ds.last) {
+        end_decode_state(&ds);
+        return;
+    }
+
+    CST* cst = reader_get_cst(reader, rank);
+    prepare_templates(&ds, cst);
+    select_terminals(&ds, cst, selected);
+
+    run_decode(&ds);
+
+    free(ds.walk_terminal);
+    free(ds.walk_rule);
+    release_templates(&ds, cst);
+    end_decode_state(&ds);
+}
+
+/*
+ * A decode of a rank that is resumed batch after batch,
+ * see recorder_open_cursor()
+ */
+struct RecordCursor_t {
+    DecodeState ds;
+    Expansion expansion;
+    FilterOp op;
+    CST* cst;
+    size_t records;
+    bool* selected;         // copy, the caller may free its own
+    uint32_t* ts_buf;       // all timestamps, 2.3 traces only
+};
+
+RecordCursor* recorder_open_cursor(RecorderReader *reader, int rank, const bool* selected) {
+    RecordCursor* cursor = calloc(1, sizeof(RecordCursor));
+    DecodeState* ds = &cursor->ds;
+    init_decode_state(ds, reader, rank, 0, SIZE_MAX, filter_op, &cursor->op, true);
+    cursor->op.ds = ds;
+    cursor->records = ds->last;
+    ds->last = 0;
+
+    cursor->cst = reader_get_cst(reader, rank);
+    prepare_templates(ds, cursor->cst);
+    if (selected) {
+        cursor->selected = malloc(cursor->cst->entries * sizeof(bool));
+        memcpy(cursor->selected, selected, cursor->cst->entries * sizeof(bool));
+        select_terminals(ds, cursor->cst, cursor->selected);
+    }
+    init_expansion(&cursor->expansion, ds->cfg, -1);
+
+    if (reader->trace_version_major==2 && reader->trace_version_minor==3)
+        cursor->ts_buf = read_timestamp_file(reader, rank);
+    else
+        reader_get_timestamp_index(reader, rank);
+    return cursor;
+}
+
+size_t recorder_cursor_decode(RecordCursor* cursor, size_t records,
+        void (*user_op)(Record*, size_t, void*), void* user_arg) {
+    DecodeState* ds = &cursor->ds;
+    size_t first = ds->pos;
+    size_t last  = cursor->records - first < records ? cursor->records : first + records;
+    if (first >= last)
+        return 0;
+
+    // tstart is chained from the previous batch
+    uint32_t* ts_buf = NULL;
+    double prev_tstart;
+    if (cursor->ts_buf)
+        ds->ts = cursor->ts_buf + 2*first;
+    else
+        ts_buf = read_timestamp_range(ds->reader, ds->rank, first, last, &ds->ts, &prev_tstart);
+
+    cursor->op.user_op  = user_op;
+    cursor->op.user_arg = user_arg;
+    ds->last = last;
+    expand(ds, &cursor->expansion);
+
+    if (ts_buf)
+        release_timestamps(ds->reader, ts_buf);
+    return last - first;
+}
+
+void recorder_close_cursor(RecordCursor* cursor) {
+    DecodeState* ds = &cursor->ds;
+    reader_reset_offset_states(&ds->offset_states);
+    free(cursor->expansion.stack);
+    free(ds->walk_terminal);
+    free(ds->walk_rule);
+    free(cursor->selected);
+    if (cursor->ts_buf)
+        release_timestamps(ds->reader, cursor->ts_buf);
+    release_templates(ds, cursor->cst);
+    end_decode_state(ds);
+    free(cursor);
+}
+
+/*
+ * Index of the first record with tstart >= t
+ * tstart never decreases, so search the checkpoints
+ * first and then scan the records of a single one.
+ */
+static size_t find_record_by_time(RecorderReader *reader, int rank, double t) {
+    TimestampIndex* idx = reader_get_timestamp_index(reader, rank);
+    if (idx->records == 0)
+        return 0;
+
+    // last checkpoint before t
+    int lo = 0, hi = idx->num_checkpoints - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (idx->checkpoints[mid].tstart < t)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    TimestampCheckpoint* cp = &idx->checkpoints[lo];
+    uint32_t* ts;
+    double tstart;
+    uint32_t* buf = read_timestamp_range(reader, rank, cp->first, cp->first + cp->records, &ts, &tstart);
+    size_t i;
+    for (i = 0; i < cp->records; i++) {
+        tstart = ts[2*i] * reader->metadata.time_resolution + tstart;
+        if (tstart >= t)
+            break;
+    }
+    release_timestamps(reader, buf);
+    return cp->first + i;
+}
+
+void recorder_decode_time_window(RecorderReader *reader, int rank, double t0, double t1,
+        void (*user_op)(Record*, void*), void* user_arg) {
+    size_t first = find_record_by_time(reader, rank, t0);
+    size_t last  = find_record_by_time(reader, rank, t1);
+    decode_records_core(reader, rank, first, last, user_op, user_arg, true);
+}
+
+/*
+ * A unit of work of recorder_decode_records_parallel()
+ */
+typedef struct DecodeTask_t {
+    int rank;
+    size_t records;             // expanded record count, used for balancing
+} DecodeTask;
+
+/*
+ * Task queue of one worker. The owner pops from the head,
+ * idle workers steal from the tail.
+ */
+typedef struct TaskQueue_t {
+    pthread_mutex_t lock;
+    DecodeTask* tasks;
+    int head, tail;             // tasks[head, tail) are left
+    size_t records;             // records left in the queue
+} TaskQueue;
+
+typedef struct DecodePool_t {
+    RecorderReader* reader;
+    int nthreads;
+    TaskQueue* queues;
+    void (*user_op)(Record*, int, int, void*);
+    void* user_arg;
+} DecodePool;
+
+typedef struct DecodeWorker_t {
+    DecodePool* pool;
+    int thread;
+    int rank;                   // rank being decoded
+} DecodeWorker;
+
+static bool pop_task(TaskQueue* q, DecodeTask* task, bool steal) {
+    bool found = false;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *task = steal ? q->tasks[--q->tail] : q->tasks[q->head++];
+        q->records -= task->records;
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static void parallel_op(Record* record, void* arg) {
+    DecodeWorker* worker = (DecodeWorker*) arg;
+    worker->pool->user_op(record, worker->rank, worker->thread, worker->pool->user_arg);
+}
+
+static void* decode_worker(void* arg) {
+    DecodeWorker* worker = (DecodeWorker*) arg;
+    DecodePool* pool = worker->pool;
+    DecodeTask task;
+
+    while (1) {
+        bool found = pop_task(&pool->queues[worker->thread], &task, false);
+
+        // steal from the queue with the most records left
+        while (!found) {
+            int victim = -1;
+            size_t most = 0;
+            for (int i = 0; i < pool->nthreads; i++) {
+                if (pool->queues[i].records > most) {
+                    most = pool->queues[i].records;
+                    victim = i;
+                }
+            }
+            if (victim == -1) {
+                // the counts are read unlocked, make sure
+                // every queue is really empty
+                for (int i = 0; i < pool->nthreads && !found; i++)
+                    found = pop_task(&pool->queues[i], &task, true);
+                if (!found)
+                    return NULL;
+            } else {
+                found = pop_task(&pool->queues[victim], &task, true);
+            }
+        }
+
+        worker->rank = task.rank;
+        decode_records_core(pool->reader, task.rank, 0, SIZE_MAX, parallel_op, worker, true);
+    }
+}
+
+/*
+ * Timestamps are two per record, so the sizes in their
+ * block headers give the number of records without
+ * loading the grammar of the rank
+ */
+size_t recorder_get_num_records(RecorderReader* reader, int rank) {
+    if (reader->ts_index[rank])
+        return reader->ts_index[rank]->records;
+
+    if (reader->trace_version_major==2 && reader->trace_version_minor==3) {
+        reader_pin_rank(reader, rank);
+        size_t records = reader_get_cfg(reader, rank)->rule_lengths[1];
+        reader_unpin_rank(reader, rank);
+        return records;
+    }
+
+    void* section = reader->ts_map.addr + reader->ts_offsets[rank];
+    size_t section_size = reader->ts_sizes[rank];
+    if (!reader->metadata.ts_compression)
+        return section_size / (2*sizeof(uint32_t));
+
+    size_t bytes = 0, pos = 0;
+    while (pos + 2*sizeof(size_t) <= section_size) {
+        size_t compressed_size, decompressed_size;
+        memcpy(&compressed_size, section+pos, sizeof(size_t));
+        memcpy(&decompressed_size, section+pos+sizeof(size_t), sizeof(size_t));
+        bytes += decompressed_size;
+        pos += 2*sizeof(size_t) + compressed_size;
+    }
+    return bytes / (2*sizeof(uint32_t));
+}
+
+static int compare_tasks(const void* a, const void* b) {
+    size_t ra = ((DecodeTask*)a)->records, rb = ((DecodeTask*)b)->records;
+    return ra < rb ? 1 : (ra > rb ? -1 : 0);
+}
+
+void recorder_decode_records_parallel(RecorderReader* reader, int* ranks, int num_ranks, int nthreads,
+        void (*user_op)(Record*, int, int, void*), void* user_arg) {
+
+    if (ranks == NULL)
+        num_ranks = reader->metadata.total_ranks;
+    if (num_ranks <= 0)
+        return;
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > num_ranks)
+        nthreads = num_ranks;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    // largest ranks first, each given to the least loaded queue
+    DecodeTask* tasks = malloc(sizeof(DecodeTask) * num_ranks);
+    for (int i = 0; i < num_ranks; i++) {
+        tasks[i].rank = ranks ? ranks[i] : i;
+        tasks[i].records = recorder_get_num_records(reader, tasks[i].rank);
+    }
+    qsort(tasks, num_ranks, sizeof(DecodeTask), compare_tasks);
+
+    DecodePool pool;
+    pool.reader   = reader;
+    pool.nthreads = nthreads;
+    pool.user_op  = user_op;
+    pool.user_arg = user_arg;
+    pool.queues   = calloc(nthreads, sizeof(TaskQueue));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].tasks = malloc(sizeof(DecodeTask) * num_ranks);
+    }
+    for (int i = 0; i < num_ranks; i++) {
+        TaskQueue* q = &pool.queues[0];
+        for (int k = 1; k < nthreads; k++)
+            if (pool.queues[k].records < q->records)
+                q = &pool.queues[k];
+        q->tasks[q->tail++] = tasks[i];
+        q->records += tasks[i].records;
+    }
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * nthreads);
+    DecodeWorker* workers = malloc(sizeof(DecodeWorker) * nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].pool   = &pool;
+        workers[i].thread = i;
+        workers[i].rank   = -1;
+        pthread_create(&threads[i], NULL, decode_worker, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].tasks);
+    }
+    free(pool.queues);
+    free(threads);
+    free(workers);
+    free(tasks);
+}
+
+/*
+ * A slice of a rank decoded by one thread,
+ * see recorder_decode_records_split()
+ */
+typedef struct SplitChunk_t {
+    size_t first, last;
+    uint32_t* ts;                           // timestamps of record first
+    double prev_tstart;                     // tstart of record first-1
+    struct OffsetState_t* offset_states;    // offsets before first
+    ChunkRecord* records;                   // ordered delivery only
+    bool done;
+} SplitChunk;
+
+typedef struct SplitDecode_t {
+    DecodeState proto;          // templates prepared once for all chunks
+    int nchunks;
+    SplitChunk* chunks;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int next;                   // next chunk to decode
+    bool ordered;
+    int delivered;              // chunks passed to user_op (ordered only)
+    int window;                 // max chunks decoded ahead of delivery
+    void (*user_op)(Record*, size_t, int, void*);
+    void* user_arg;
+} SplitDecode;
+
+typedef struct SplitWorker_t {
+    SplitDecode* split;
+    int thread;
+    size_t index;               // index of the next record
+} SplitWorker;
+
+static void split_op(Record* record, void* arg) {
+    SplitWorker* worker = (SplitWorker*) arg;
+    worker->split->user_op(record, worker->index++, worker->thread, worker->split->user_arg);
+}
+
+static void* split_worker(void* arg) {
+    SplitWorker* worker = (SplitWorker*) arg;
+    SplitDecode* split = worker->split;
+
+    while (1) {
+        pthread_mutex_lock(&split->lock);
+        while (split->ordered && split->next < split->nchunks &&
+               split->next >= split->delivered + split->window)
+            pthread_cond_wait(&split->cond, &split->lock);
+        if (split->next >= split->nchunks) {
+            pthread_mutex_unlock(&split->lock);
+            return NULL;
+        }
+        SplitChunk* chunk = &split->chunks[split->next++];
+        pthread_mutex_unlock(&split->lock);
+
+        DecodeState ds = split->proto;
+        ds.first = chunk->first;
+        ds.last  = chunk->last;
+        ds.ts    = chunk->ts;
+        ds.prev_tstart = chunk->prev_tstart;
+        ds.offset_states = chunk->offset_states;
+        chunk->offset_states = NULL;
+        if (split->ordered) {
+            chunk->records = malloc(sizeof(ChunkRecord) * (chunk->last - chunk->first));
+            ds.sink = chunk->records;
+        } else {
+            worker->index = chunk->first;
+            ds.user_arg = worker;
+        }
+        run_decode(&ds);
+
+        pthread_mutex_lock(&split->lock);
+        chunk->done = true;
+        pthread_cond_broadcast(&split->cond);
+        pthread_mutex_unlock(&split->lock);
+    }
+}
+
+static void deliver_chunk(DecodeState* proto, SplitChunk* chunk,
+                          void (*user_op)(Record*, void*), void* user_arg) {
+    char* args[256];
+    for (size_t i = 0; i < chunk->last - chunk->first; i++) {
+        ChunkRecord* c = &chunk->records[i];
+        Record record = proto->templates[c->terminal];
+        if (c->offset_arg != -1) {
+            memcpy(args, record.args, sizeof(char*) * record.arg_count);
+            args[c->offset_arg] = c->offset;
+            record.args = args;
+        }
+        record.tstart = c->tstart;
+        record.tend   = c->tend;
+        user_op(&record, user_arg);
+    }
+}
+
+/*
+ * Split rule -1 of a rank into chunks of records, decoded
+ * concurrently. Each chunk skips the records before it with
+ * the rule lengths. The timestamps are inflated once and
+ * shared by all chunks, one pass over them gives the tstart
+ * each chunk starts from. With intraprocess pattern recognition
+ * one sequential pass first walks the rank to record the
+ * offset states at each chunk.
+ */
+static void decode_split(RecorderReader* reader, int rank, int nthreads, bool ordered,
+        void (*user_op)(Record*, size_t, int, void*),
+        void (*ordered_op)(Record*, void*), void* user_arg) {
+
+    SplitDecode split;
+    memset(&split, 0, sizeof(split));
+    init_decode_state(&split.proto, reader, rank, 0, SIZE_MAX, split_op, NULL, true);
+    size_t records = split.proto.last;
+    if (records == 0) {
+        end_decode_state(&split.proto);
+        return;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+
+    // a few chunks per thread to even out the load, but not
+    // so small that skipping and the threads dominate; a small
+    // rank is a single chunk decoded by a single thread
+    const size_t min_chunk = 1<<16;
+    size_t nchunks = (size_t)nthreads * 4;
+    if (nchunks > (records + min_chunk - 1) / min_chunk)
+        nchunks = (records + min_chunk - 1) / min_chunk;
+    if ((size_t)nthreads > nchunks)
+        nthreads = nchunks;
+
+    split.nchunks  = nchunks;
+    split.chunks   = calloc(nchunks, sizeof(SplitChunk));
+    split.ordered  = ordered;
+    split.window   = 2 * nthreads;
+    split.user_op  = user_op;
+    split.user_arg = user_arg;
+    for (size_t k = 0; k < nchunks; k++) {
+        split.chunks[k].first = records * k / nchunks;
+        split.chunks[k].last  = records * (k+1) / nchunks;
+    }
+
+    CST* cst = reader_get_cst(reader, rank);
+    prepare_templates(&split.proto, cst);
+
+    uint32_t* ts_buf = read_timestamp_file(reader, rank);
+    double res = reader->metadata.time_resolution;
+    double prev_tstart = 0;
+    for (size_t k = 0; k < nchunks; k++) {
+        SplitChunk* chunk = &split.chunks[k];
+        chunk->ts = ts_buf + 2*chunk->first;
+        chunk->prev_tstart = prev_tstart;
+        for (size_t i = chunk->first; i < chunk->last; i++)
+            prev_tstart = ts_buf[2*i] * res + prev_tstart;
+    }
+
+    if (reader->metadata.intraprocess_pattern_recognition && nchunks > 1) {
+        size_t* snapshot_at = malloc(sizeof(size_t) * (nchunks-1));
+        struct OffsetState_t** snapshots = calloc(nchunks-1, sizeof(struct OffsetState_t*));
+        for (size_t k = 1; k < nchunks; k++)
+            snapshot_at[k-1] = split.chunks[k].first;
+
+        DecodeState ds = split.proto;
+        ds.first  = ds.last = split.chunks[nchunks-1].first;
+        ds.replay = true;
+        ds.num_snapshots = nchunks - 1;
+        ds.snapshot_at   = snapshot_at;
+        ds.snapshots     = snapshots;
+        rule_application(&ds, -1);
+        reader_reset_offset_states(&ds.offset_states);
+
+        for (size_t k = 1; k < nchunks; k++)
+            split.chunks[k].offset_states = snapshots[k-1];
+        free(snapshot_at);
+        free(snapshots);
+    }
+
+    pthread_mutex_init(&split.lock, NULL);
+    pthread_cond_init(&split.cond, NULL);
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * nthreads);
+    SplitWorker* workers = malloc(sizeof(SplitWorker) * nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].split  = &split;
+        workers[i].thread = i;
+        workers[i].index  = 0;
+        pthread_create(&threads[i], NULL, split_worker, &workers[i]);
+    }
+
+    if (ordered) {
+        for (size_t k = 0; k < nchunks; k++) {
+            SplitChunk* chunk = &split.chunks[k];
+            pthread_mutex_lock(&split.lock);
+            while (!chunk->done)
+                pthread_cond_wait(&split.cond, &split.lock);
+            pthread_mutex_unlock(&split.lock);
+
+            deliver_chunk(&split.proto, chunk, ordered_op, user_arg);
+            free(chunk->records);
+
+            pthread_mutex_lock(&split.lock);
+            split.delivered++;
+            pthread_cond_broadcast(&split.cond);
+            pthread_mutex_unlock(&split.lock);
         }
     }
 
-    return count;
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&split.lock);
+    pthread_cond_destroy(&split.cond);
+    release_timestamps(reader, ts_buf);
+    release_templates(&split.proto, cst);
+    end_decode_state(&split.proto);
+    free(split.chunks);
+    free(threads);
+    free(workers);
+}
+
+void recorder_decode_records_split(RecorderReader* reader, int rank, int nthreads,
+        void (*user_op)(Record*, size_t, int, void*), void* user_arg) {
+    decode_split(reader, rank, nthreads, false, user_op, NULL, user_arg);
+}
+
+void recorder_decode_records_ordered(RecorderReader* reader, int rank, int nthreads,
+        void (*user_op)(Record*, void*), void* user_arg) {
+    decode_split(reader, rank, nthreads, true, NULL, user_op, user_arg);
+}
+
+/**
+ * The total number of calls if uncompressed,
+ * see compute_rule_lengths()
+ */
+size_t get_uncompressed_count(RecorderReader* reader, CFG* cfg, int rule_id) {
+    assert(reader_get_rule(cfg, rule_id) != NULL);
+    return cfg->rule_lengths[-rule_id];
 }
 
 
@@ -16,6 +16,7 @@ typedef struct CST_t {
     int rank;
     int entries;
     CallSignature *cs_list; // CallSignature is defined in recorder-logger.h
+    Record *records;        // records[i]: cs_list[i] decoded once, see recorder_decode_records()
 } CST;
 
 typedef struct RuleHash_t {
@@ -29,8 +30,19 @@ typedef struct CFG_t {
     int rank;
     int rules;
     RuleHash* cfg_head;
+    struct CFG_t* shared;   // shared rule dictionary, NULL if interprocess_grammar_sharing is off
+
+    // flat index built by reader_index_rules(), including shared rules
+    int        rule_slots;      // max(-rule_id) + 1
+    RuleHash** rule_table;      // rule_table[-rule_id], NULL if no such rule
+    size_t*    rule_lengths;    // rule_lengths[-rule_id]: number of terminals the rule expands to
 } CFG;
 
+typedef struct MappedFile_t {
+    void*  addr;            // NULL if the file is empty
+    size_t size;
+} MappedFile;
+
 typedef struct RecorderReader_t {
 
     RecorderMetadata metadata;
@@ -44,8 +56,6 @@ typedef struct RecorderReader_t {
     int pnetcdf_start_idx;
     int netcdf_start_idx;
 
-    double prev_tstart;
-
     // in the case of metadata.interprocess_compression = true
     // store the unique grammars in ugs.
     // cfgs[rank] = ugs[ug_ids[rank]];
@@ -53,12 +63,35 @@ typedef struct RecorderReader_t {
     int*  ug_ids;	// index of unique grammar in cfgs
     CFG** ugs;      // store actual grammars
 
+    // in the case of metadata.interprocess_grammar_sharing = true
+    // rules used by multiple ranks are stored once in sg.cfg
+    // and referenced by every unique grammar
+    CFG*  shared_cfg;
+
     // in the case of metadata.interprocess_compression = false
     // we have one file for each rank's cst and one file
-    // for each rank's cfg. We directly store them in csts[rnak] 
-    // and cfgs[rank]. 
+    // for each rank's cfg. They are loaded on first use into
+    // csts[rank] and cfgs[rank], NULL if not loaded, see
+    // reader_get_cst()
     CST** csts;
     CFG** cfgs;     
+    struct RankCache_t* cache;
+
+    // in the case of metadata.intraprocess_pattern_recognition = true
+    // offsets are stored relative to the previous access of the
+    // same call, see reader_decode_offsets()
+    int*  offset_slots;     // func id -> slot in OffsetState, -1 if none
+
+    // recorder.ts is mapped once at init, timestamps of a rank
+    // start at ts_offsets[rank] and take ts_sizes[rank] bytes
+    MappedFile ts_map;
+    size_t*    ts_offsets;
+    size_t*    ts_sizes;
+
+    // timestamp checkpoints of each rank, read from recorder.idx
+    // if present, otherwise built on first use by
+    // recorder_decode_range() and recorder_decode_time_window()
+    struct TimestampIndex_t** ts_index;
 
     int trace_version_major;
     int trace_version_minor;
@@ -100,6 +133,8 @@ void recorder_init_reader(const char* logs_dir, RecorderReader *reader);
 void recorder_free_reader(RecorderReader *reader);
 
 void recorder_free_record(Record* r);
+// deep copy of a record, e.g., to keep a view passed to user_op()
+Record* recorder_copy_record(Record* r);
 
 /**
  * This function reads all records of a rank
@@ -110,13 +145,215 @@ void recorder_free_record(Record* r);
  * void user_op(Record *r, void* user_arg);
  * void* user_arg can be used to pass in user argument.
  *
+ * The record is a view of a call signature that was decoded
+ * only once: the reader owns it and its arguments, they must
+ * not be modified or freed and are only valid during user_op().
+ * Copy what needs to be kept.
  */
 void recorder_decode_records(RecorderReader* reader, int rank,
                              void (*user_op)(Record* r, void* user_arg), void* user_arg);
 // used by to implement read_all_records for recorder_viz
+// same as above but user_op() takes ownership of the record,
+// which can be freed with recorder_free_record()
 void recorder_decode_records2(RecorderReader* reader, int rank,
                              void (*user_op)(Record* r, void* user_arg), void* user_arg);
 
+/**
+ * Columns of decoded records, see recorder_decode_batch()
+ *
+ * The caller allocates each column with room for capacity rows,
+ * columns left NULL are not filled. Row i holds the record
+ * first+i of the rank.
+ */
+typedef struct RecordBatch_t {
+    size_t capacity;
+    size_t rows;                // rows filled, set by the reader
+    size_t first;               // set by the reader
+    double*        tstart;
+    double*        tend;
+    int*           func_id;
+    int*           cs_id;       // call signature, see recorder_get_call_signature()
+    unsigned char* call_depth;
+    pthread_t*     tid;
+    // with metadata.intraprocess_pattern_recognition, the absolute
+    // offset argument if the call signature stores it relative to
+    // the previous access, -1 otherwise
+    long long*     offset;
+} RecordBatch;
+
+/**
+ * Decode all records of a rank into columns
+ *
+ * batch_op() is called each time the columns of batch are full,
+ * and once more for the remaining rows, with batch->rows > 0.
+ * The columns are reused for the next rows once it returns.
+ * Arguments are not copied per record, they are shared by all
+ * records of a call signature and can be looked up by cs_id.
+ */
+void recorder_decode_batch(RecorderReader* reader, int rank, RecordBatch* batch,
+                           void (*batch_op)(RecordBatch* batch, void* user_arg), void* user_arg);
+
+/**
+ * Return the call signature cs_id of a rank as a record,
+ * with rank templates instantiated for the rank.
+ * tstart and tend are not set. Returns NULL if cs_id
+ * is out of range; free with recorder_free_record().
+ */
+Record* recorder_get_call_signature(RecorderReader* reader, int rank, int cs_id);
+
+/**
+ * Select call signatures of a rank, e.g., by function
+ *
+ * predicate() is called once per call signature, see
+ * recorder_get_call_signature(); the record is only
+ * valid during the call. Returns selected[cs_id],
+ * to be freed by the caller.
+ */
+bool* recorder_select_call_signatures(RecorderReader* reader, int rank,
+                                      bool (*predicate)(Record* cs, void* user_arg), void* user_arg);
+
+/**
+ * Decode only the records of the selected call signatures
+ *
+ * user_op() gets the record and its index in the rank,
+ * as if all records were decoded. Rules of the grammar
+ * that reach no selected call signature are passed over
+ * as a whole, only their timestamps are chained.
+ * Records are views, same as recorder_decode_records().
+ */
+void recorder_decode_records_filtered(RecorderReader* reader, int rank, const bool* selected,
+                                      void (*user_op)(Record* r, size_t index, void* user_arg),
+                                      void* user_arg);
+
+/**
+ * Decode the records of a rank a batch at a time
+ *
+ * recorder_cursor_decode() goes on with the next records
+ * of the rank, at most the given number of them, and
+ * returns how many were passed over, 0 once all were.
+ * user_op() is called as with recorder_decode_records_filtered(),
+ * with selected NULL for all records. Only the state of
+ * the expansion and the timestamps of one batch are kept,
+ * so many ranks can be decoded side by side, e.g., to merge
+ * them in time order. A cursor keeps its rank loaded until
+ * it is closed. Cursors of different ranks can be used by
+ * different threads.
+ */
+typedef struct RecordCursor_t RecordCursor;
+RecordCursor* recorder_open_cursor(RecorderReader* reader, int rank, const bool* selected);
+size_t recorder_cursor_decode(RecordCursor* cursor, size_t records,
+                              void (*user_op)(Record* r, size_t index, void* user_arg), void* user_arg);
+void recorder_close_cursor(RecordCursor* cursor);
+
+/**
+ * Decode only the records [first, last) of a rank
+ *
+ * Records are numbered from 0 in the order recorder_decode_records()
+ * passes them; last is clamped to the number of records. Repetitions
+ * of grammar rules that end before first are skipped as a whole and
+ * timestamps are decompressed from the closest checkpoint before first
+ * (see recorder-index) up to last.
+ * Records are views, same as recorder_decode_records().
+ */
+void recorder_decode_range(RecorderReader* reader, int rank, size_t first, size_t last,
+                           void (*user_op)(Record* r, void* user_arg), void* user_arg);
+
+/**
+ * Decode the records of a rank with t0 <= tstart < t1
+ *
+ * Same as recorder_decode_range(), the range is found
+ * with the timestamp checkpoints of the rank.
+ */
+void recorder_decode_time_window(RecorderReader* reader, int rank, double t0, double t1,
+                                 void (*user_op)(Record* r, void* user_arg), void* user_arg);
+
+/**
+ * Number of records of a rank, tstart of its first record
+ * and latest tend, from the timestamp checkpoints, without
+ * decoding the grammar. Any output may be NULL.
+ */
+void recorder_get_rank_span(RecorderReader* reader, int rank, size_t* records, double* tstart, double* tend);
+
+/**
+ * Number of records of a rank, read from the headers of
+ * its timestamps (or recorder.idx) without decompressing
+ * them. Cheap enough to plan work over all ranks.
+ */
+size_t recorder_get_num_records(RecorderReader* reader, int rank);
+
+/**
+ * Decode the records of several ranks with a pool of threads
+ *
+ * ranks: the ranks to decode, or NULL for all ranks (num_ranks is then ignored)
+ * nthreads: number of threads, <= 0 to use one per online core
+ *
+ * user_op() is called with the rank of the record and the index
+ * of the calling thread ([0, nthreads)), so per-thread results
+ * can be kept without locking. Records of a rank are passed
+ * in order by one thread; different ranks are decoded
+ * concurrently. Records are views, same as recorder_decode_records().
+ *
+ * Ranks are handed out by expanded record count, largest first,
+ * and idle threads steal ranks from the busiest queue.
+ */
+void recorder_decode_records_parallel(RecorderReader* reader, int* ranks, int num_ranks, int nthreads,
+                                      void (*user_op)(Record* r, int rank, int thread, void* user_arg),
+                                      void* user_arg);
+
+/**
+ * Decode the records of one rank with several threads
+ *
+ * The rank is split into chunks of consecutive records that are
+ * decoded concurrently, which helps when one rank dominates the
+ * decode time. nthreads <= 0 uses one thread per online core.
+ *
+ * recorder_decode_records_split() calls user_op() from the worker
+ * threads, with the index of the record in the rank and of the
+ * calling thread ([0, nthreads)). Records of a chunk arrive in
+ * order, chunks do not.
+ *
+ * recorder_decode_records_ordered() calls user_op() from the calling
+ * thread with every record in order, same as recorder_decode_records(),
+ * while the following chunks are decoded by the other threads.
+ *
+ * Records are views, same as recorder_decode_records().
+ */
+void recorder_decode_records_split(RecorderReader* reader, int rank, int nthreads,
+                                   void (*user_op)(Record* r, size_t index, int thread, void* user_arg),
+                                   void* user_arg);
+void recorder_decode_records_ordered(RecorderReader* reader, int rank, int nthreads,
+                                     void (*user_op)(Record* r, void* user_arg), void* user_arg);
+
+/**
+ * Analytics on the compressed trace, see reader-analytics.c
+ *
+ * These only walk the grammar and the call signatures of
+ * a rank, their cost does not depend on the number of records.
+ */
+
+// counts[i]: number of records of call signature i in the rank,
+// the array has reader_get_cst(reader, rank)->entries elements
+size_t* recorder_count_call_signatures(RecorderReader* reader, int rank);
+
+typedef struct FileStat_t {
+    char*  filename;
+    size_t calls;           // POSIX calls on the file
+    size_t reads, writes;
+    size_t bytes_read;      // as requested by the calls
+    size_t bytes_written;
+} FileStat;
+
+typedef struct RankStats_t {
+    size_t    records;
+    size_t*   func_counts;      // func_counts[func_id], reader->supported_funcs elements
+    size_t    user_func_count;  // records of RECORDER_USER_FUNCTION
+    int       num_files;
+    FileStat* files;            // files named by POSIX calls, sorted by name
+} RankStats;
+
+void recorder_get_rank_stats(RecorderReader* reader, int rank, RankStats* stats);
+void recorder_free_rank_stats(RankStats* stats);
+
 const char* recorder_get_func_name(RecorderReader* reader, Record* record);
 
 /*
@@ -1,283 +1,510 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <memory>
 #include <algorithm>
 #include <string>
-#include <map>
+#include <stdexcept>
 #include <filesystem>
 #include <regex>
 #include <getopt.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <zlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 extern "C" {
 #include "reader.h"
+#include "reader-private.h"
 #include "recorder-sequitur.h"
 }
 
-static char formatting_record[32];
 static char filtered_trace_dir[1024];
-static CallSignature* global_cst = NULL;
 
 
-template <typename KeyType>
-class Interval {
-public:
-    KeyType lower;
-    KeyType upper;
-
-    Interval(KeyType l, KeyType u) : lower(l), upper(u) {}
-};
-
-template <typename KeyType, typename ValueType>
-class IntervalTable {
-public:
-    ValueType& operator[](const KeyType& key) {
-        auto it = std::lower_bound(data.begin(), data.end(), key,
-                                   [](const auto& lhs, const auto& rhs) { return lhs.first.upper <= rhs; });
-        return it->second;
-    }
-
-    void insert(const Interval<KeyType>& interval, const ValueType& value) {
-        data.push_back({interval, value});
-        std::sort(data.begin(), data.end(),
-                  [](const auto& lhs, const auto& rhs) { return lhs.first.lower < rhs.first.lower; });
+/**
+ * Just enough JSON to read filter files,
+ * so the tools need no other library
+ */
+struct JsonValue {
+    enum Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+    bool   boolean = false;
+    double number = 0;
+    std::string str;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* get(const std::string& key) const {
+        for (auto& member : members)
+            if (member.first == key)
+                return &member.second;
+        return nullptr;
     }
-
-
-    std::vector<std::pair<Interval<KeyType>, ValueType>> data;
 };
 
-template <typename KeyType, typename ValueType>
-class MultiIndexIntervalTable {
+class JsonParser {
 public:
-    void insert(const std::string& index, const Interval<KeyType>& interval, const ValueType& value) {
-        indices[index].insert(interval, value);
-    }
+    JsonParser(const std::string& text) : text(text), pos(0) {}
 
-    void insert(const std::string& index) {
-        // Ensure the index exists without adding intervals
-        if (indices.find(index) == indices.end()) {
-            indices[index] = IntervalTable<KeyType, ValueType>();
-        }
+    JsonValue parse() {
+        JsonValue v = value();
+        skip_space();
+        if (pos != text.size())
+            fail("unexpected characters after the end");
+        return v;
     }
 
-    ValueType& operator[](const std::pair<std::string, KeyType>& key) {
-        const std::string& index = key.first;
-        const KeyType& key_value = key.second;
-        return indices[index][key_value];
-    }
+private:
+    const std::string& text;
+    size_t pos;
 
-    void printIntervals(const std::string& index) const {
-        const auto& table = indices.at(index);
-        for (const auto& pair : table.data) {
-            std::cout << "[" << pair.first.lower << ", " << pair.first.upper << ") : " << pair.second << "\n";
-        }
+    [[noreturn]] void fail(const std::string& what) {
+        int line = 1 + std::count(text.begin(), text.begin() + std::min(pos, text.size()), '\n');
+        throw std::runtime_error(what + " at line " + std::to_string(line));
     }
 
-    auto begin() {
-        return indices.begin();
+    void skip_space() {
+        while (pos < text.size() && isspace((unsigned char) text[pos]))
+            pos++;
     }
 
-    auto end() {
-        return indices.end();
+    bool consume(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c))
+            fail(std::string("expected '") + c + "'");
+    }
+
+    bool literal(const char* word) {
+        size_t len = strlen(word);
+        if (text.compare(pos, len, word) != 0)
+            return false;
+        pos += len;
+        return true;
+    }
+
+    JsonValue value() {
+        skip_space();
+        if (pos >= text.size())
+            fail("unexpected end of file");
+
+        JsonValue v;
+        char c = text[pos];
+        if (c == '{') {
+            pos++;
+            v.type = JsonValue::OBJECT;
+            if (consume('}'))
+                return v;
+            do {
+                std::string key = string();
+                expect(':');
+                v.members.push_back({key, value()});
+            } while (consume(','));
+            expect('}');
+        } else if (c == '[') {
+            pos++;
+            v.type = JsonValue::ARRAY;
+            if (consume(']'))
+                return v;
+            do {
+                v.items.push_back(value());
+            } while (consume(','));
+            expect(']');
+        } else if (c == '"') {
+            v.type = JsonValue::STRING;
+            v.str = string();
+        } else if (literal("true") || literal("false")) {
+            v.type = JsonValue::BOOL;
+            v.boolean = (c == 't');
+        } else if (literal("null")) {
+            v.type = JsonValue::NUL;
+        } else {
+            const char* start = text.c_str() + pos;
+            char* end;
+            v.type = JsonValue::NUMBER;
+            v.number = strtod(start, &end);
+            if (end == start)
+                fail(std::string("unexpected character '") + c + "'");
+            pos += end - start;
+        }
+        return v;
+    }
+
+    std::string string() {
+        skip_space();
+        if (pos >= text.size() || text[pos] != '"')
+            fail("expected a string");
+        pos++;
+
+        std::string s;
+        while (true) {
+            if (pos >= text.size())
+                fail("unterminated string");
+            char c = text[pos++];
+            if (c == '"')
+                break;
+            if (c != '\\') {
+                s += c;
+                continue;
+            }
+            if (pos >= text.size())
+                fail("unterminated string");
+            char e = text[pos++];
+            switch (e) {
+                case '"': case '\\': case '/': s += e; break;
+                case 'b': s += '\b'; break;
+                case 'f': s += '\f'; break;
+                case 'n': s += '\n'; break;
+                case 'r': s += '\r'; break;
+                case 't': s += '\t'; break;
+                case 'u': {
+                    for (size_t i = pos; i < pos + 4; i++)
+                        if (i >= text.size() || !isxdigit((unsigned char) text[i]))
+                            fail("invalid \\u escape");
+                    unsigned cp = strtoul(text.substr(pos, 4).c_str(), nullptr, 16);
+                    pos += 4;
+                    // UTF-8, surrogate pairs are not combined
+                    if (cp < 0x80) {
+                        s += (char) cp;
+                    } else if (cp < 0x800) {
+                        s += (char) (0xC0 | (cp >> 6));
+                        s += (char) (0x80 | (cp & 0x3F));
+                    } else {
+                        s += (char) (0xE0 | (cp >> 12));
+                        s += (char) (0x80 | ((cp >> 6) & 0x3F));
+                        s += (char) (0x80 | (cp & 0x3F));
+                    }
+                    break;
+                }
+                default:
+                    fail(std::string("invalid escape '\\") + e + "'");
+            }
+        }
+        return s;
     }
-
-
-private:
-    std::map<std::string, IntervalTable<KeyType, ValueType>> indices;  // Map from index name to IntervalTable
 };
 
-template <typename KeyType, typename ValueType>
-class Filter {
-public:
-    std::string func_name;
-    MultiIndexIntervalTable<KeyType, ValueType> indices;
 
-    Filter(const std::string& name) : func_name(name) {}
-    Filter(const std::string& name, const MultiIndexIntervalTable<KeyType, ValueType>& miit)
-            : func_name(name), indices(miit) {}
+/**
+ * Filters are given as a JSON file, e.g.,
+ *
+ *  {"filters": [
+ *      {"func": "pwrite",
+ *       "args": [{"index": 2, "ranges": [[0, 4096, "small"], [4096, null, "large"]]},
+ *                {"index": 3, "drop": true}]},
+ *      {"func": "open",
+ *       "args": [{"index": 0, "patterns": [["^(.*)\\.[0-9]+$", "$1.N"]]}]}
+ *  ]}
+ *
+ * The rules of an argument are applied to its value:
+ *  - "ranges": integers in [lower, upper) become the given value,
+ *    a null bound is unbounded. Ranges may not overlap.
+ *  - "patterns": values matching a regular expression (the first
+ *    one in the list) become the given value, where $n refers to
+ *    the n-th group of the match.
+ *  - "drop": the argument is removed.
+ * Arguments without a rule, or matching none, are kept as they are.
+ *
+ * Filters are applied to the call signatures, not to the records,
+ * so arguments that are not the same for every record of a signature
+ * can not be filtered, an error is reported instead:
+ *  - with intraprocess pattern recognition, the file and the offset
+ *    of the calls in intraprocess_funcs (see reader-cst-cfg.c), offsets
+ *    are stored relative to the previous call on the same file.
+ *  - rank templates (see recorder-logger.h), only with a range or a
+ *    pattern, they can still be dropped.
+ *
+ * The filters are compiled against the functions of the trace into
+ * a table indexed by func id, and the ranges of an argument into a
+ * sorted array, so applying them does not depend on how many there are.
+ */
+struct ArgRange {
+    long long lower, upper;
+    std::string value;
 };
 
-template <typename KeyType, typename ValueType>
-class Filters {
-private:
-    std::vector<Filter<KeyType, ValueType>> filters;
+struct ArgRule {
+    int  index;
+    bool drop = false;
+    std::vector<ArgRange> ranges;                               // sorted by lower bound
+    std::vector<std::pair<std::regex, std::string>> patterns;   // first match wins
+};
 
-public:
-    void addFilter(const Filter<KeyType, ValueType>& filter) {
-        filters.push_back(filter);
-    }
-/*
-    void addFilter(const std::string& name, const MultiIndexIntervalTable<KeyType, ValueType>& miit) {
-        filters.emplace_back(name, miit);
-    }
-*/
-    const Filter<KeyType, ValueType>& getFilter(size_t index) const {
-        if (index < filters.size()) {
-            return filters[index];
-        } else {
-            throw std::out_of_range("Index out of range");
-        }
-    }
+struct FuncFilter {
+    std::string func;
+    std::vector<ArgRule> rules;                                 // sorted by index
+};
 
-    size_t size() const {
-        return filters.size();
-    }
+struct FilterTable {
+    std::vector<std::unique_ptr<FuncFilter>> funcs;             // [func_id], NULL if not filtered
+    int num_filters = 0;
+};
 
-    // in case for accessing the underlying vector
-    const std::vector<Filter<KeyType, ValueType>>& getFilters() const {
-        return filters;
-    }
+// a JSON number or string as an argument value
+static std::string scalar_to_string(const JsonValue& v, const std::string& what) {
+    if (v.type == JsonValue::STRING)
+        return v.str;
+    if (v.type == JsonValue::NUMBER) {
+        char buf[64];
+        if (v.number == floor(v.number) && fabs(v.number) < 1e18)
+            snprintf(buf, sizeof(buf), "%lld", (long long) v.number);
+        else
+            snprintf(buf, sizeof(buf), "%g", v.number);
+        return buf;
+    }
+    throw std::runtime_error(what + ": expected a number or a string");
+}
 
-    auto begin() {
-        return filters.begin();
-    }
+static long long range_bound(const JsonValue& v, long long unbounded, const std::string& what) {
+    if (v.type == JsonValue::NUL)
+        return unbounded;
+    if (v.type != JsonValue::NUMBER || v.number != floor(v.number))
+        throw std::runtime_error(what + ": range bounds must be integers or null");
+    return (long long) v.number;
+}
 
-    auto end() {
-        return filters.end();
+static ArgRule compile_arg_rule(const JsonValue& spec, const std::string& func) {
+    const JsonValue* index = spec.get("index");
+    if (spec.type != JsonValue::OBJECT || !index || index->type != JsonValue::NUMBER ||
+        index->number < 0 || index->number > INT_MAX || index->number != floor(index->number))
+        throw std::runtime_error(func + ": every argument rule needs an integer \"index\" >= 0");
+
+    ArgRule rule;
+    rule.index = (int) index->number;
+    std::string what = func + " argument " + std::to_string(rule.index);
+
+    const JsonValue* drop = spec.get("drop");
+    rule.drop = drop && drop->type == JsonValue::BOOL && drop->boolean;
+
+    if (const JsonValue* ranges = spec.get("ranges")) {
+        if (ranges->type != JsonValue::ARRAY)
+            throw std::runtime_error(what + ": \"ranges\" must be an array");
+        for (auto& r : ranges->items) {
+            if (r.type != JsonValue::ARRAY || r.items.size() != 3)
+                throw std::runtime_error(what + ": a range is [lower, upper, value]");
+            ArgRange range;
+            range.lower = range_bound(r.items[0], LLONG_MIN, what);
+            range.upper = range_bound(r.items[1], LLONG_MAX, what);
+            range.value = scalar_to_string(r.items[2], what);
+            if (range.lower >= range.upper)
+                throw std::runtime_error(what + ": empty range");
+            rule.ranges.push_back(range);
+        }
+        std::sort(rule.ranges.begin(), rule.ranges.end(),
+                  [](const ArgRange& lhs, const ArgRange& rhs) { return lhs.lower < rhs.lower; });
+        for (size_t i = 1; i < rule.ranges.size(); i++)
+            if (rule.ranges[i].lower < rule.ranges[i-1].upper)
+                throw std::runtime_error(what + ": ranges overlap");
+    }
+
+    if (const JsonValue* patterns = spec.get("patterns")) {
+        if (patterns->type != JsonValue::ARRAY)
+            throw std::runtime_error(what + ": \"patterns\" must be an array");
+        for (auto& p : patterns->items) {
+            if (p.type != JsonValue::ARRAY || p.items.size() != 2 || p.items[0].type != JsonValue::STRING)
+                throw std::runtime_error(what + ": a pattern is [regex, value]");
+            try {
+                rule.patterns.push_back({std::regex(p.items[0].str, std::regex::optimize),
+                                         scalar_to_string(p.items[1], what)});
+            } catch (const std::regex_error& e) {
+                throw std::runtime_error(what + ": invalid regex \"" + p.items[0].str + "\": " + e.what());
+            }
+        }
     }
 
-};
+    if (rule.drop && (!rule.ranges.empty() || !rule.patterns.empty()))
+        throw std::runtime_error(what + ": a dropped argument has no ranges or patterns");
+    return rule;
+}
 
+void compile_filters(const JsonValue& spec, RecorderReader* reader, FilterTable* filters) {
+    const JsonValue* list = spec.type == JsonValue::ARRAY ? &spec : spec.get("filters");
+    if (!list || list->type != JsonValue::ARRAY)
+        throw std::runtime_error("expected {\"filters\": [...]}");
+
+    filters->funcs.clear();
+    filters->funcs.resize(reader->supported_funcs);
+
+    for (auto& f : list->items) {
+        const JsonValue* func = f.get("func");
+        if (f.type != JsonValue::OBJECT || !func || func->type != JsonValue::STRING)
+            throw std::runtime_error("every filter needs a \"func\"");
+
+        int func_id = -1;
+        for (int i = 0; i < reader->supported_funcs; i++)
+            if (func->str == reader->func_list[i])
+                func_id = i;
+        if (func_id < 0)
+            throw std::runtime_error("unknown function \"" + func->str + "\"");
+
+        // all filters of a function are merged
+        auto& filter = filters->funcs[func_id];
+        if (!filter) {
+            filter.reset(new FuncFilter());
+            filter->func = func->str;
+        }
 
-std::vector<std::string> splitStringBySpace(const std::string& input) {
-    std::vector<std::string> result;
-    std::istringstream stream(input);
-    std::string token;
-    while (std::getline(stream, token, ' ')) {
-        result.push_back(token);
+        const JsonValue* args = f.get("args");
+        if (args && args->type != JsonValue::ARRAY)
+            throw std::runtime_error(func->str + ": \"args\" must be an array");
+        for (size_t i = 0; args && i < args->items.size(); i++) {
+            ArgRule rule = compile_arg_rule(args->items[i], func->str);
+            if (reader_is_offset_arg(reader, func_id, rule.index))
+                throw std::runtime_error(func->str + ": argument " + std::to_string(rule.index) +
+                                         " is needed to decode the offsets of this trace"
+                                         " (intraprocess pattern recognition)");
+            for (auto& other : filter->rules)
+                if (other.index == rule.index)
+                    throw std::runtime_error(func->str + ": argument " + std::to_string(rule.index) +
+                                             " has more than one rule");
+            filter->rules.push_back(std::move(rule));
+        }
+        std::sort(filter->rules.begin(), filter->rules.end(),
+                  [](const ArgRule& lhs, const ArgRule& rhs) { return lhs.index < rhs.index; });
+        filters->num_filters++;
     }
-    return result;
 }
 
-/**
- * TODO: no need to read a text file and process this mannually.
- * It would be easier just writing filters in a json file
- * and use an existing library to read; it will automatically
- * handles the strings, floats and arrays.
- */
-std::pair<std::string, std::string> splitIntoNumberAndRanges(const std::string& input) {
-    std::regex pattern(R"((\d+)\[(.*)\])"); // Matches format "<number>[<ranges>]"
-    std::smatch match;
-    if (std::regex_match(input, match, pattern)) {
-        return {match[1], match[2]}; // Return the number and range array
+// a rule other than drop on an argument of a CST entry
+static void check_cst_templates(CST* cst, FilterTable* filters) {
+    for (int i = 0; i < cst->entries; i++) {
+        Record* record = &cst->records[i];
+        if (record->func_id < 0 || record->func_id >= (int) filters->funcs.size())
+            continue;
+        FuncFilter* filter = filters->funcs[record->func_id].get();
+        if (filter == NULL)
+            continue;
+        for (auto& rule : filter->rules)
+            if (!rule.drop && rule.index < record->arg_count && record->args[rule.index] &&
+                record->args[rule.index][0] == RECORDER_TEMPLATE_MARK)
+                // the value differs from rank to rank
+                throw std::runtime_error(filter->func + ": argument " + std::to_string(rule.index) +
+                                         " is a rank template (interprocess pattern recognition),"
+                                         " it can only be dropped");
     }
-    return {"", ""};
 }
 
+/*
+ * Rank templates can only be told apart in the call signatures,
+ * so all CSTs are scanned before anything is written
+ */
+void check_template_args(RecorderReader* reader, FilterTable* filters) {
+    if (!reader->metadata.interprocess_pattern_recognition)
+        return;
 
-template <typename KeyType, typename ValueType>
-IntervalTable<KeyType, ValueType> parseRanges(const std::string& ranges) {
-    IntervalTable<KeyType, ValueType> table;
-    std::regex range_pattern(R"((\d+):(\d+)-(\d+))"); // Matches format "<lower>:<upper>-<value>"
-    auto it = std::sregex_iterator(ranges.begin(), ranges.end(), range_pattern);
-    auto end = std::sregex_iterator();
-
-    for (; it != end; ++it) {
-        KeyType lower = std::stoi((*it)[1]);
-        KeyType upper = std::stoi((*it)[2]);
-        ValueType value = std::stoi((*it)[3]);
-        table.insert(Interval<KeyType>(lower, upper), value);
+    if (reader->metadata.interprocess_compression) {
+        check_cst_templates(reader->csts[0], filters);
+        return;
+    }
+    for (int rank = 0; rank < reader->metadata.total_ranks; rank++) {
+        reader_pin_rank(reader, rank);
+        try {
+            check_cst_templates(reader_get_cst(reader, rank), filters);
+        } catch (...) {
+            reader_unpin_rank(reader, rank);
+            throw;
+        }
+        reader_unpin_rank(reader, rank);
     }
-
-    return table;
 }
 
-
-void read_filters(char* filter_path, Filters<int, int> *filters){
-    std::string fpath(filter_path);
-    std::ifstream ffile(fpath);
+void read_filters(const char* filter_path, RecorderReader* reader, FilterTable* filters) {
+    std::ifstream ffile(filter_path);
     if (!ffile.is_open()) {
-        std::cerr << "Error: Unable to open file at " << fpath<< "\n";
+        std::cerr << "Error: Unable to open file at " << filter_path << "\n";
+        exit(1);
     }
+    std::stringstream text;
+    text << ffile.rdbuf();
 
-    std::string fline;
-    while (std::getline(ffile, fline)) {
-        if (fline.empty()) continue; // Skip empty lines
-
-        std::vector<std::string> substrings = splitStringBySpace(fline);
-        if (substrings.empty()) continue; // Skip lines with no content
-
-        std::string func_name = substrings.at(0);
-        substrings.erase(substrings.begin());
-        MultiIndexIntervalTable<int, int> indices;
+    try {
+        std::string spec = text.str();
+        compile_filters(JsonParser(spec).parse(), reader, filters);
+        check_template_args(reader, filters);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << filter_path << ": " << e.what() << "\n";
+        exit(1);
+    }
+    std::cout << "Successfully read " << filters->num_filters << " filters.\n";
+}
 
-        for (const auto& substring : substrings) {
-            if (substring.find('[') != std::string::npos) {
-                auto [number, ranges] = splitIntoNumberAndRanges(substring);
-                if (!number.empty() && !ranges.empty()) {
-                    IntervalTable<int, int> table = parseRanges<int, int>(ranges);
-                    for (const auto& [interval, value] : table.data) {
-                        indices.insert(number, interval, value);
-                    }
-                } else {
-                    std::cerr << "Warning: Invalid range format in substring '" << substring << "'\n";
-                }
-            } else {
-                indices.insert(substring);
-            }
-        }
+// integer value of an argument, false if it is not a plain integer
+// (e.g., a rank template or an offset stored relative to the previous one)
+static bool parse_int_arg(const char* arg, long long* value) {
+    if(arg == NULL || arg[0] == '\0')
+        return false;
+    char* end;
+    errno = 0;
+    *value = strtoll(arg, &end, 10);
+    return *end == '\0' && errno == 0;
+}
 
-        filters->addFilter(Filter(func_name, indices));
+static std::string apply_arg_rule(const ArgRule& rule, const char* arg) {
+    long long value;
+    if (!rule.ranges.empty() && parse_int_arg(arg, &value)) {
+        auto it = std::upper_bound(rule.ranges.begin(), rule.ranges.end(), value,
+                                   [](long long v, const ArgRange& range) { return v < range.lower; });
+        if (it != rule.ranges.begin() && value < (--it)->upper)
+            return it->value;
     }
-    std::cout << "Successfully read filters.\n";
+
+    std::cmatch match;
+    for (auto& [pattern, format] : rule.patterns)
+        if (std::regex_search(arg, match, pattern))
+            return match.format(format);
+    return arg;
 }
 
-void apply_filter_to_record(Record* record, Record* new_record, RecorderReader *reader, Filters<int, int> *filters){
+/**
+ * Apply the filter of the record's function, if any, to its
+ * arguments. Returns false if there is none, new_record is
+ * then a shallow copy of record.
+ */
+bool apply_filter_to_record(Record* record, Record* new_record, FilterTable* filters){
 
     // duplicate the original record and then
     // make modifications to the new record
     memcpy(new_record, record, sizeof(Record));
 
-    std::string func_name = recorder_get_func_name(reader, record);
-    for(auto &filter:*filters) {
-        if(filter.func_name == func_name) {
-            std::vector<std::string> new_args;
-
-            // TODO: should the filters include the same number of incides as the actual call?
-            for(auto it = filter.indices.begin(); it != filter.indices.end(); ++it) {
-                // for each index in the filter
-                int index = stoi(it->first);
-                auto &intervalTable = it->second;
-
-                // Clustering
-                int arg_modified = 0;
-                for(auto &interval : intervalTable.data) {
-                    if(atoi(record->args[index]) >= interval.first.lower && atoi(record->args[index]) < interval.first.upper) {
-                        new_args.push_back(std::to_string(interval.second));
-                        arg_modified = 1;
-                        break;
-                    }
-                }
-
-                if (!arg_modified)
-                    new_args.push_back(record->args[index]);
-            }
-
-            // Overwrite the orginal record with modified args
-            new_record->arg_count = new_args.size();
-            new_record->args = (char**) malloc(sizeof(char*) * new_record->arg_count);
-            for(int i = 0; i < new_record->arg_count; i++) {
-                new_record->args[i] = strdup(new_args[i].c_str());
-            }
-        }
-    }
+    if (record->func_id < 0 || record->func_id >= (int) filters->funcs.size())
+        return false;
+    FuncFilter* filter = filters->funcs[record->func_id].get();
+    if (filter == NULL)
+        return false;
+
+    std::vector<std::string> new_args;
+    auto rule = filter->rules.begin();
+    for (int i = 0; i < record->arg_count; i++) {
+        while (rule != filter->rules.end() && rule->index < i)
+            ++rule;
+        const char* arg = record->args[i] ? record->args[i] : "???";
+        if (rule == filter->rules.end() || rule->index != i)
+            new_args.push_back(arg);
+        else if (rule->drop)
+            continue;
+        else    // never a rank template, see check_template_args()
+            new_args.push_back(apply_arg_rule(*rule, arg));
+    }
+
+    // Overwrite the orginal record with modified args
+    new_record->arg_count = new_args.size();
+    new_record->args = (char**) malloc(sizeof(char*) * new_record->arg_count);
+    for(int i = 0; i < new_record->arg_count; i++) {
+        new_record->args[i] = strdup(new_args[i].c_str());
+    }
+    return true;
 }
 
-/**
- * helper structure for passing arguments
- * to the iterate_record() function
- */
-typedef struct IterArg_t {
-    int rank;
-    RecorderReader* reader;
-    Grammar         local_cfg;
-    Filters<int,int>* filters;
-} IterArg;
-
-
 /**
  * this function is directly copied from recorder/lib/recorder-cst-cfg.c
  * to avoid adding dependency to the entire recorder library.
@@ -333,7 +560,9 @@ void recorder_write_zlib(unsigned char* buf, size_t buf_size, FILE* out_file) {
     unsigned have;
     z_stream strm;
 
-    unsigned char out[buf_size];
+    // on the heap, grammars of large traces do not fit on the stack
+    size_t out_size = buf_size > 0 ? buf_size : 1;
+    std::vector<unsigned char> out(out_size);
 
     /* allocate deflate state */
     strm.zalloc = Z_NULL;
@@ -351,13 +580,13 @@ void recorder_write_zlib(unsigned char* buf, size_t buf_size, FILE* out_file) {
     /* run deflate() on input until output buffer not full, finish
        compression if all of source has been read in */
     do {
-        strm.avail_out = buf_size;
-        strm.next_out = out;
+        strm.avail_out = out_size;
+        strm.next_out = out.data();
         ret = deflate(&strm, Z_FINISH);    /* no bad return value */
         assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-        have = buf_size - strm.avail_out;
+        have = out_size - strm.avail_out;
         compressed_size += have;
-        if (fwrite(out, 1, have, out_file) != have) {
+        if (fwrite(out.data(), 1, have, out_file) != have) {
             printf("[recorder-filter] fatal error: zlib write out error.");
             (void)deflateEnd(&strm);
             return;
@@ -374,214 +603,344 @@ void recorder_write_zlib(unsigned char* buf, size_t buf_size, FILE* out_file) {
     fseek(out_file, compressed_size, SEEK_CUR);
 }
 
-void save_updated_metadata(RecorderReader* reader) {
-    char old_metadata_filename[2048] = {0};
-    char new_metadata_filename[2048] = {0};
-    FILE* srcfh;
-    FILE* dstfh;
-    void* fhdata;
-
-    sprintf(old_metadata_filename, "%s/recorder.mt", reader->logs_dir);
-    sprintf(new_metadata_filename, "%s/recorder.mt", filtered_trace_dir);
-
-    srcfh = fopen(old_metadata_filename, "rb");
-    dstfh = fopen(new_metadata_filename, "wb");
-
-    // first copy the entire old meatdata file to the new metadata file
-    size_t res = 0;
-    fseek(srcfh, 0, SEEK_END);
-    long metafh_size = ftell(srcfh);
-    fhdata = malloc(metafh_size);
-    fseek(srcfh, 0, SEEK_SET);
-    res = fread(fhdata , 1, metafh_size, srcfh);
-    if (ferror(srcfh)) {
-        perror("Error reading metadata file\n");
+static FILE* open_output(const char* name) {
+    char filename[2048];
+    snprintf(filename, sizeof(filename), "%s/%s", filtered_trace_dir, name);
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        perror(filename);
         exit(1);
     }
-    res = fwrite(fhdata, 1, metafh_size, dstfh);
-
-    // then update the inter-process compression flag.
-    int oldval = reader->metadata.interprocess_compression;
-    reader->metadata.interprocess_compression = 0;
-    fseek(dstfh, 0, SEEK_SET);
-    fwrite(&reader->metadata, sizeof(RecorderMetadata), 1, dstfh);
-    reader->metadata.interprocess_compression = oldval;
+    return f;
+}
 
-    fclose(srcfh);
-    fclose(dstfh);
-    free(fhdata);
+// copy a file of the original trace that filtering does not change
+static void copy_trace_file(RecorderReader* reader, const char* name, bool required) {
+    std::filesystem::path src = std::filesystem::path(reader->logs_dir) / name;
+    std::filesystem::path dst = std::filesystem::path(filtered_trace_dir) / name;
+    if (!required && !std::filesystem::exists(src))
+        return;
+    std::error_code ec;
+    std::filesystem::copy_file(src, dst, std::filesystem::copy_options::overwrite_existing, ec);
+    if (ec) {
+        std::cerr << "Error: unable to copy " << src << ": " << ec.message() << "\n";
+        exit(1);
+    }
 }
 
-void save_filtered_trace(RecorderReader* reader, IterArg* iter_args) {
 
-    size_t cst_data_len;
-    char* cst_data = serialize_cst(global_cst, &cst_data_len);
-
-    for(int rank = 0; rank < reader->metadata.total_ranks; rank++) {
-        char filename[1024] = {0};
-        sprintf(filename, "%s/%d.cfg", filtered_trace_dir, rank);
-        FILE* f = fopen(filename, "wb");
-        int integers;
-        int* cfg_data = serialize_grammar(&(iter_args[rank].local_cfg), &integers);
-        recorder_write_zlib((unsigned char*)cfg_data, sizeof(int)*integers, f);
-        fclose(f);
-        free(cfg_data);
+/**
+ * A filter maps the arguments of a call signature to the same
+ * new arguments every time, so it is applied once per CST entry
+ * instead of once per record. Entries that become identical are
+ * merged, update_terminal_id[old terminal] gives the new terminal
+ * of every entry and is then applied to the grammars as they are.
+ */
+typedef struct FilteredCST_t {
+    CallSignature* cst;             // uthash, in new terminal id order
+    int  entries;
+    int* update_terminal_id;
+} FilteredCST;
+
+void filter_cst(RecorderReader* reader, CST* cst, FilterTable* filters, FilteredCST* fcst) {
+    fcst->cst = NULL;
+    fcst->entries = 0;
+    fcst->update_terminal_id = (int*) malloc(sizeof(int) * (cst->entries > 0 ? cst->entries : 1));
+
+    for (int i = 0; i < cst->entries; i++) {
+        Record* record = &cst->records[i];
+        Record new_record;
+        bool filtered = apply_filter_to_record(record, &new_record, filters);
+
+        int key_len;
+        char* key = compose_cs_key(&new_record, &key_len);
+
+        CallSignature *entry = NULL;
+        HASH_FIND(hh, fcst->cst, key, key_len, entry);
+        if (entry) {
+            entry->count += cst->cs_list[i].count;
+            free(key);
+        } else {
+            entry = (CallSignature*) malloc(sizeof(CallSignature));
+            entry->key = key;
+            entry->key_len = key_len;
+            entry->rank = cst->cs_list[i].rank;
+            entry->terminal_id = fcst->entries++;
+            entry->count = cst->cs_list[i].count;
+            HASH_ADD_KEYPTR(hh, fcst->cst, entry->key, entry->key_len, entry);
+        }
+        fcst->update_terminal_id[i] = entry->terminal_id;
 
-        // write out global cst, all ranks have the same copy
-        sprintf(filename, "%s/%d.cst", filtered_trace_dir, rank);
-        f = fopen(filename, "wb");
-        recorder_write_zlib((unsigned char*)cst_data, cst_data_len, f);
-        fclose(f);
+        if (filtered) {
+            for (int a = 0; a < new_record.arg_count; a++)
+                free(new_record.args[a]);
+            free(new_record.args);
+        }
     }
+}
 
-    free(cst_data);
+void free_filtered_cst(FilteredCST* fcst) {
+    cleanup_cst(fcst->cst);
+    free(fcst->update_terminal_id);
+}
 
-    // Update metadata and write out
-    save_updated_metadata(reader);
-
-    // Save timestamps
-    // for now, we simply copy the timestamp files from
-    // the original trace folder, if we want to cut some
-    // records, we also need to cut timestamps
-    char cmd[1024];
-    sprintf(cmd, "cp %s/recorder.ts %s/recorder.ts", reader->logs_dir, filtered_trace_dir);
-    system(cmd);
-
-    // Similarly, simply copy the version file from the
-    // original trace folder.
-    sprintf(cmd, "cp %s/VERSION %s/VERSION", reader->logs_dir, filtered_trace_dir);
-    system(cmd);
+void save_filtered_cst(FilteredCST* fcst, const char* name) {
+    size_t cst_data_len;
+    char* cst_data = serialize_cst(fcst->cst, &cst_data_len);
+    FILE* f = open_output(name);
+    recorder_write_zlib((unsigned char*)cst_data, cst_data_len, f);
+    fclose(f);
+    free(cst_data);
 }
 
 /**
- * This function addes one record to the CFG and CST
- * the implementation is identical to that of the
- * recorder-logger.c
+ * The reader keeps the rules of a grammar as they were
+ * serialized, turn them back into a Grammar (with the same
+ * rule ids) so sequitur_update() can remap its terminals
  */
-static int current_cfg_terminal = 0;
-void grow_cst_cfg(Grammar* cfg, Record* record) {
-    int key_len;
-    char* key = compose_cs_key(record, &key_len);
+void cfg_to_grammar(CFG* cfg, Grammar* grammar) {
+    grammar->rules = NULL;
+    grammar->digram_table = NULL;
+    grammar->start_rule_id = -1;
+    grammar->rule_id = -1;
+    grammar->twins_removal = true;
+    grammar->optimization_budget = 0;
+
+    // cfg_head keeps the rules in file order, the main rule first
+    RuleHash *r, *tmp;
+    HASH_ITER(hh, cfg->cfg_head, r, tmp) {
+        Symbol* rule = new_symbol(r->rule_id, 1, false, NULL);
+        rule_put(&grammar->rules, rule);
+        for (int i = 0; i < r->symbols; i++) {
+            int val = r->rule_body[2*i], exp = r->rule_body[2*i+1];
+            Symbol* sym = new_symbol(val, exp, val >= 0, NULL);
+            sym->rule = rule;
+            DL_APPEND(rule->rule_body, sym);
+        }
+        if (r->rule_id <= grammar->rule_id)
+            grammar->rule_id = r->rule_id - 1;
+    }
+}
 
-    CallSignature *entry = NULL;
-    HASH_FIND(hh, global_cst, key, key_len, entry);
-    if(entry) {                         // Found
-        entry->count++;
-        free(key);
-    } else {                            // Not exist, add to hash table
-        entry = (CallSignature*) malloc(sizeof(CallSignature));
-        entry->key = key;
-        entry->key_len = key_len;
-        entry->rank = 0;
-        entry->terminal_id = current_cfg_terminal++;
-        entry->count = 1;
-        HASH_ADD_KEYPTR(hh, global_cst, entry->key, entry->key_len, entry);
-    }
-
-    append_terminal(cfg, entry->terminal_id, 1);
+/**
+ * Remap the terminals of a grammar and append it to f.
+ * Terminals merged by the filter usually make new repetitions,
+ * the grammar is re-optimized for them within the given budget.
+ * Grammars that use shared rules (see sg.cfg) are not, their
+ * rules are not all known here.
+ */
+void save_filtered_grammar(CFG* cfg, FilteredCST* fcst, int optimization_budget, FILE* f) {
+    Grammar grammar;
+    cfg_to_grammar(cfg, &grammar);
+    sequitur_update(&grammar, fcst->update_terminal_id);
+
+    if (cfg->shared == NULL && cfg->rank >= 0)
+        grammar.optimization_budget = optimization_budget;
+
+    int integers;
+    int* cfg_data = serialize_grammar(&grammar, &integers);
+    recorder_write_zlib((unsigned char*)cfg_data, sizeof(int)*integers, f);
+    free(cfg_data);
+    sequitur_cleanup(&grammar);
 }
 
 /**
- * This is a helper (debug) function that prints out
- * the recorded function call
+ * The filtered trace keeps the layout of the original one:
+ * with interprocess compression, the merged CST is filtered
+ * once and all unique grammars (and the shared rules) are
+ * remapped with it. Otherwise each rank has its own CST and
+ * grammar. Timestamps and metadata do not change.
  */
-static void print_record(Record* record, RecorderReader *reader) {
-    int decimal =  log10(1 / reader->metadata.time_resolution);
-    sprintf(formatting_record, "%%.%df %%.%df %%s %%d %%d (", decimal, decimal);
+void save_filtered_trace(RecorderReader* reader, FilterTable* filters, int optimization_budget) {
+    int nprocs = reader->metadata.total_ranks;
+    size_t old_entries = 0, new_entries = 0;
+
+    if (reader->metadata.interprocess_compression) {
+        FilteredCST fcst;
+        filter_cst(reader, reader->csts[0], filters, &fcst);
+        save_filtered_cst(&fcst, "recorder.cst");
+        old_entries = reader->csts[0]->entries;
+        new_entries = fcst.entries;
+
+        FILE* f = open_output("ug.cfg");
+        for (int i = 0; i < reader->num_ugs; i++)
+            save_filtered_grammar(reader->ugs[i], &fcst, optimization_budget, f);
+        fclose(f);
 
-    bool user_func = (record->func_id == RECORDER_USER_FUNCTION);
-    const char* func_name = recorder_get_func_name(reader, record);
+        if (reader->shared_cfg) {
+            f = open_output("sg.cfg");
+            save_filtered_grammar(reader->shared_cfg, &fcst, optimization_budget, f);
+            fclose(f);
+        }
+        copy_trace_file(reader, "ug.mt", true);
+        free_filtered_cst(&fcst);
+    } else {
+        for (int rank = 0; rank < nprocs; rank++) {
+            reader_pin_rank(reader, rank);
+            CST* cst = reader_get_cst(reader, rank);
+            CFG* cfg = reader_get_cfg(reader, rank);
+
+            FilteredCST fcst;
+            filter_cst(reader, cst, filters, &fcst);
+            old_entries += cst->entries;
+            new_entries += fcst.entries;
+
+            char name[64];
+            sprintf(name, "%d.cst", rank);
+            save_filtered_cst(&fcst, name);
+
+            sprintf(name, "%d.cfg", rank);
+            FILE* f = open_output(name);
+            save_filtered_grammar(cfg, &fcst, optimization_budget, f);
+            fclose(f);
+
+            free_filtered_cst(&fcst);
+            reader_unpin_rank(reader, rank);
+        }
+    }
 
-    fprintf(stdout, formatting_record, record->tstart, record->tend, // record->tid
-                func_name, record->call_depth);
+    // Timestamps are copied as they are: filtering changes the
+    // arguments of records, never which records there are.
+    // The index of recorder.ts (if any) therefore still holds.
+    copy_trace_file(reader, "recorder.mt", true);
+    copy_trace_file(reader, "recorder.ts", true);
+    copy_trace_file(reader, "VERSION", true);
+    copy_trace_file(reader, RECORDER_INDEX_FILE, false);
 
-    for(int arg_id = 0; !user_func && arg_id < record->arg_count; arg_id++) {
-        char *arg = record->args[arg_id];
-        fprintf(stdout, " %s", arg);
-    }
-    fprintf(stdout, " )\n");
+    printf("[recorder-filter] %zu call signatures filtered into %zu\n", old_entries, new_entries);
 }
 
+
 /**
- * Function that processes one record at a time
- * The pointer of this function is passed
- * to the recorder_decode_records() call.
- *
- * In this function:
- * 1. we apply the filters
- * 2. then build the cst and cfg
+ * Check the filtered trace: its records, decoded, must be the
+ * records of the original trace with the filters applied to each
+ * of them. Both are decoded side by side a batch at a time.
  */
-void iterate_record(Record* record, void* arg) {
+#define CHECK_BATCH (1<<16)
 
-    IterArg *ia = (IterArg*) arg;
+struct CheckBatch {
+    FilterTable* filters;
+    std::vector<std::string> records;
+};
 
-    // debug purpose; print out the original record
-    printf("old:");
-    print_record(record, ia->reader);
+// what must match: timestamps, depth, function and arguments
+static std::string record_key(Record* record) {
+    int key_len;
+    char* key = compose_cs_key(record, &key_len);
+    std::string res(key, key_len);
+    free(key);
+    res.append((const char*) &record->tstart, sizeof(double));
+    res.append((const char*) &record->tend, sizeof(double));
+    return res;
+}
 
-    // apply fiter to the record
-    // then add it to the cst and cfg.
+static void add_filtered_record(Record* record, size_t index, void* arg) {
+    CheckBatch* batch = (CheckBatch*) arg;
     Record new_record;
-    apply_filter_to_record(record, &new_record, ia->reader, ia->filters);
+    bool filtered = apply_filter_to_record(record, &new_record, batch->filters);
+    batch->records.push_back(record_key(&new_record));
+    if (filtered) {
+        for (int a = 0; a < new_record.arg_count; a++)
+            free(new_record.args[a]);
+        free(new_record.args);
+    }
+}
 
-    // debug purpose; print out the modified record
-    printf("new:");
-    print_record(&new_record, ia->reader);
+static void add_record(Record* record, size_t index, void* arg) {
+    ((CheckBatch*) arg)->records.push_back(record_key(record));
+}
 
-    grow_cst_cfg(&ia->local_cfg, &new_record);
+bool check_filtered_trace(RecorderReader* reader, FilterTable* filters) {
+    RecorderReader filtered;
+    recorder_init_reader(filtered_trace_dir, &filtered);
+
+    int bad_ranks = 0;
+    for (int rank = 0; rank < reader->metadata.total_ranks; rank++) {
+        RecordCursor* expected_cursor = recorder_open_cursor(reader, rank, NULL);
+        RecordCursor* actual_cursor = recorder_open_cursor(&filtered, rank, NULL);
+        CheckBatch expected, actual;
+        expected.filters = filters;
+
+        size_t first = 0, n;
+        while (true) {
+            expected.records.clear();
+            actual.records.clear();
+            n = recorder_cursor_decode(expected_cursor, CHECK_BATCH, add_filtered_record, &expected);
+            recorder_cursor_decode(actual_cursor, CHECK_BATCH, add_record, &actual);
+            if (expected.records != actual.records) {
+                size_t i = 0;
+                while (i < expected.records.size() && i < actual.records.size() &&
+                       expected.records[i] == actual.records[i])
+                    i++;
+                fprintf(stderr, "[recorder-filter] rank %d: record %zu differs\n", rank, first + i);
+                bad_ranks++;
+                break;
+            }
+            if (n == 0)
+                break;
+            first += n;
+        }
+
+        recorder_close_cursor(expected_cursor);
+        recorder_close_cursor(actual_cursor);
+    }
+
+    recorder_free_reader(&filtered);
+    if (bad_ranks == 0)
+        printf("[recorder-filter] checked the records of %d ranks\n", reader->metadata.total_ranks);
+    return bad_ranks == 0;
 }
 
 
 int main(int argc, char** argv) {
 
-    if (argc != 3) {
-        printf("usage: recorder-filter /path/to/trace-folder /path/to/filter-file\n");
+    int optimization_budget = 0;
+    bool check = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:c")) != -1) {
+        switch(opt) {
+            case 'o':
+                optimization_budget = atoi(optarg);
+                break;
+            case 'c':
+                check = true;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("usage: recorder-filter [-o steps] [-c] /path/to/trace-folder /path/to/filter.json\n"
+               "  -o  step budget to re-optimize each filtered grammar, see RECORDER_GRAMMAR_OPTIMIZATION\n"
+               "  -c  decode the filtered trace and check it against the original one\n");
         exit(1);
     }
 
-    char* trace_dir = argv[1];
-    char* filter_path = argv[2];
-
-    Filters<int, int> filters;
-    read_filters(filter_path, &filters);
+    char* trace_dir = argv[optind];
+    char* filter_path = argv[optind+1];
 
     RecorderReader reader;
     recorder_init_reader(trace_dir, &reader);
+    if (reader.trace_version_major == 2 && reader.trace_version_minor == 3) {
+        fprintf(stderr, "[recorder-filter] traces of version 2.3 are not supported\n");
+        exit(1);
+    }
+
+    // function names are resolved against this trace
+    FilterTable filters;
+    read_filters(filter_path, &reader, &filters);
 
     // create a new folder to store the filtered trace files
     sprintf(filtered_trace_dir, "%s/_filtered", reader.logs_dir);
-    if(access(filtered_trace_dir, F_OK) != -1)
-        rmdir(filtered_trace_dir);
     mkdir(filtered_trace_dir, S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH);
 
-    // Prepare the arguments to pass to each rank
-    // when iterating local records
-    IterArg *iter_args = (IterArg*) malloc(sizeof(IterArg));
-    for(int rank = 0; rank < reader.metadata.total_ranks; rank++) {
-        iter_args[rank].rank       = rank;
-        iter_args[rank].reader     = &reader;
-        iter_args[rank].filters    = &filters;
-        // initialize local CFG
-        sequitur_init(&(iter_args[rank].local_cfg));
-    }
+    save_filtered_trace(&reader, &filters, optimization_budget);
 
-    // Go through each rank's records
-    for(int rank = 0; rank < reader.metadata.total_ranks; rank++) {
-        // this call iterates through all records of one rank
-        // each record is processed by the iterate_record() function
-        recorder_decode_records(&reader, rank, iterate_record, &(iter_args[rank]));
-    }
+    int ret = 0;
+    if (check && !check_filtered_trace(&reader, &filters))
+        ret = 1;
 
-    // At this point we should have built the global cst and each
-    // rank's local cfg. Now let's write them out.
-    save_filtered_trace(&reader, iter_args);
-
-    // clean up everything
-    cleanup_cst(global_cst);
-    for(int rank = 0; rank < reader.metadata.total_ranks; rank++) {
-        sequitur_cleanup(&iter_args[rank].local_cfg);
-    }
     recorder_free_reader(&reader);
-
+    return ret;
 }
-
@@ -0,0 +1,67 @@
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "reader.h"
+#include "reader-private.h"
+
+/*
+ * Write recorder.idx into a trace folder
+ *
+ * The reader then loads the timestamp checkpoints and the
+ * span of every rank from it, instead of decompressing
+ * all timestamps of a rank the first time it is used.
+ */
+int main(int argc, char **argv) {
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch(opt) {
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-v] [path to traces]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-v] [path to traces]\n", argv[0]);
+        return 1;
+    }
+
+    // rebuild from the trace itself, not from an older index
+    char idx_fname[1096] = {0};
+    sprintf(idx_fname, "%s/%s", argv[optind], RECORDER_INDEX_FILE);
+    unlink(idx_fname);
+
+    RecorderReader reader;
+    recorder_init_reader(argv[optind], &reader);
+
+    if (reader.trace_version_major == 2 && reader.trace_version_minor == 3) {
+        fprintf(stderr, "traces of version 2.3 have no recorder.ts to index\n");
+        recorder_free_reader(&reader);
+        return 1;
+    }
+
+    size_t total = 0;
+    for (int rank = 0; rank < reader.metadata.total_ranks; rank++) {
+        size_t records;
+        double tstart, tend;
+        recorder_get_rank_span(&reader, rank, &records, &tstart, &tend);
+        total += records;
+        if (verbose)
+            printf("rank %d: %zu records, %.6f - %.6f\n", rank, records, tstart, tend);
+    }
+
+    if (reader_write_index(&reader) != 0) {
+        fprintf(stderr, "failed to write %s\n", idx_fname);
+        recorder_free_reader(&reader);
+        return 1;
+    }
+    printf("%s: %d ranks, %zu records\n", idx_fname, reader.metadata.total_ranks, total);
+
+    recorder_free_reader(&reader);
+    return 0;
+}
@@ -2,11 +2,13 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
 #include "reader.h"
 #include "reader-private.h"
 #include "recorder-logger.h"
@@ -18,6 +20,7 @@ void print_cst(RecorderReader* reader, CST* cst) {
 
     for(int i = 0; i < cst->entries; i++) {
         Record* record = reader_cs_to_record(&cst->cs_list[i]);
+        reader_instantiate_args(record, -1);
 
         const char* func_name = recorder_get_func_name(reader, record);
         printf("%s(", func_name);
@@ -33,52 +36,624 @@ void print_cst(RecorderReader* reader, CST* cst) {
     }
 }
 
-void print_statistics(RecorderReader* reader, CST* cst) {
+/*
+ * Job-wide totals, counted on the grammars of
+ * all ranks without decoding the records
+ */
+typedef struct JobFileStat_t {
+    FileStat stat;                  // stat.filename is the key
+    int ranks;                      // ranks that named the file
+    UT_hash_handle hh;
+} JobFileStat;
 
-    int* unique_signature = (int*) malloc(sizeof(int)*reader->supported_funcs);
-    int* call_count = (int*) malloc(sizeof(int)*reader->supported_funcs);
-    memset(unique_signature, 0, sizeof(int)*reader->supported_funcs);
-    memset(call_count, 0, sizeof(int)*reader->supported_funcs);
+typedef struct JobStats_t {
+    int*    unique_signature;       // of rank 0, per func id
+    size_t* call_count;             // per func id
+    size_t  user_count;
+    size_t  total, posix, mpi, mpiio, hdf5, pnetcdf, netcdf;
+} JobStats;
 
-    int mpi_count = 0, mpiio_count = 0, netcdf_count = 0;
-    int pnetcdf_count = 0, hdf5_count = 0, posix_count = 0;
+void collect_statistics(RecorderReader* reader, CST* cst, JobStats* js, JobFileStat** files) {
+
+    js->unique_signature = (int*) calloc(reader->supported_funcs, sizeof(int));
+    js->call_count = (size_t*) calloc(reader->supported_funcs, sizeof(size_t));
+    int* unique_signature = js->unique_signature;
+    size_t* call_count = js->call_count;
 
     for(int i = 0; i < cst->entries; i++) {
-        Record* record = reader_cs_to_record(&cst->cs_list[i]);
-        const char* func_name = recorder_get_func_name(reader, record);
+        if(cst->records[i].func_id != RECORDER_USER_FUNCTION)
+            unique_signature[cst->records[i].func_id]++;
+    }
+
+    size_t user_count = 0;
+    for(int rank = 0; rank < reader->metadata.total_ranks; rank++) {
+        RankStats stats;
+        recorder_get_rank_stats(reader, rank, &stats);
+        for(int i = 0; i < reader->supported_funcs; i++)
+            call_count[i] += stats.func_counts[i];
+        user_count += stats.user_func_count;
+
+        for(int i = 0; i < stats.num_files; i++) {
+            FileStat* fs = &stats.files[i];
+            JobFileStat* file = NULL;
+            HASH_FIND_STR(*files, fs->filename, file);
+            if(file == NULL) {
+                file = calloc(1, sizeof(JobFileStat));
+                file->stat.filename = strdup(fs->filename);
+                HASH_ADD_KEYPTR(hh, *files, file->stat.filename, strlen(file->stat.filename), file);
+            }
+            file->ranks++;
+            file->stat.calls         += fs->calls;
+            file->stat.reads         += fs->reads;
+            file->stat.writes        += fs->writes;
+            file->stat.bytes_read    += fs->bytes_read;
+            file->stat.bytes_written += fs->bytes_written;
+        }
+        recorder_free_rank_stats(&stats);
+    }
 
-        int type = recorder_get_func_type(reader, record);
+    size_t mpi_count = 0, mpiio_count = 0, netcdf_count = 0;
+    size_t pnetcdf_count = 0, hdf5_count = 0, posix_count = 0;
+    for(int i = 0; i < reader->supported_funcs; i++) {
+        if(call_count[i] == 0)
+            continue;
+        Record record = {.func_id = i};
+        int type = recorder_get_func_type(reader, &record);
         if(type == RECORDER_MPI)
-            mpi_count += cst->cs_list[i].count;
+            mpi_count += call_count[i];
         if(type == RECORDER_MPIIO)
-            mpiio_count += cst->cs_list[i].count;
+            mpiio_count += call_count[i];
         if(type == RECORDER_HDF5)
-            hdf5_count += cst->cs_list[i].count;
+            hdf5_count += call_count[i];
         if(type == RECORDER_PNETCDF)
-            pnetcdf_count += cst->cs_list[i].count;
+            pnetcdf_count += call_count[i];
         if(type == RECORDER_NETCDF)
-            netcdf_count += cst->cs_list[i].count;
+            netcdf_count += call_count[i];
         if(type == RECORDER_POSIX)
-            posix_count += cst->cs_list[i].count;
+            posix_count += call_count[i];
+    }
 
-        unique_signature[record->func_id]++;
-        call_count[record->func_id] += cst->cs_list[i].count;
+    js->user_count = user_count;
+    js->posix   = posix_count;
+    js->mpi     = mpi_count;
+    js->mpiio   = mpiio_count;
+    js->hdf5    = hdf5_count;
+    js->pnetcdf = pnetcdf_count;
+    js->netcdf  = netcdf_count;
+    js->total   = posix_count + mpi_count + mpiio_count + hdf5_count + pnetcdf_count + netcdf_count + user_count;
+}
 
-        recorder_free_record(record);
-    }
-    long int total = posix_count + mpi_count + mpiio_count + hdf5_count + pnetcdf_count;
-    printf("Total: %ld\nPOSIX: %d\nMPI: %d\nMPI-IO: %d\nHDF5: %d\nPnetCDF: %d\nNetCDF: %d\n",
-           total, posix_count, mpi_count, mpiio_count, hdf5_count, pnetcdf_count, netcdf_count);
+void print_statistics(RecorderReader* reader, JobStats* js) {
+    printf("Total: %zu\nPOSIX: %zu\nMPI: %zu\nMPI-IO: %zu\nHDF5: %zu\nPnetCDF: %zu\nNetCDF: %zu\n",
+           js->total, js->posix, js->mpi, js->mpiio, js->hdf5, js->pnetcdf, js->netcdf);
+    if(js->user_count > 0)
+        printf("User functions: %zu\n", js->user_count);
 
     printf("\n%-25s %18s %18s\n", "Func", "Unique Signature", "Total Call Count");
     for(int i = 0; i < reader->supported_funcs; i++) {
-        if(unique_signature[i] > 0) {
-            printf("%-25s %18d %18d\n", reader->func_list[i], unique_signature[i], call_count[i]);
+        if(js->unique_signature[i] > 0 || js->call_count[i] > 0) {
+            printf("%-25s %18d %18zu\n", reader->func_list[i], js->unique_signature[i], js->call_count[i]);
+        }
+    }
+}
+
+void print_files(JobFileStat* files) {
+    printf("\n%-40s %8s %12s %12s %16s %16s\n", "File", "Ranks", "Reads", "Writes", "Bytes Read", "Bytes Written");
+    JobFileStat *file, *tmp;
+    HASH_ITER(hh, files, file, tmp) {
+        printf("%-40s %8d %12zu %12zu %16zu %16zu\n", file->stat.filename, file->ranks,
+               file->stat.reads, file->stat.writes, file->stat.bytes_read, file->stat.bytes_written);
+    }
+}
+
+static int compare_files(JobFileStat* a, JobFileStat* b) {
+    return strcmp(a->stat.filename, b->stat.filename);
+}
+
+/*
+ * Latency, bytes and bandwidth, from one parallel pass over the records
+ *
+ * Latencies are counted in ticks of the time resolution, in log-scale
+ * buckets: values below SUB_BUCKETS are exact, larger ones share a
+ * bucket with values of the same power of two and the same top
+ * SUB_BITS bits (within 1/SUB_BUCKETS), as in HDR histograms.
+ * Each decoding thread fills its own histograms, merged at the end.
+ */
+#define SUB_BITS        5
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define MAX_TICK_BITS   48              // longer latencies are clamped
+#define NUM_BUCKETS     ((MAX_TICK_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+#define DEFAULT_BW_BINS 20
+
+typedef struct Histogram_t {
+    size_t    count;
+    double    total;            // seconds
+    uint64_t  max;              // ticks
+    uint64_t* buckets;          // NUM_BUCKETS, NULL until the first call
+} Histogram;
+
+enum { LAYER_POSIX, LAYER_MPIIO, NUM_LAYERS };
+enum { DIR_READ, DIR_WRITE };
+
+typedef struct PerfStats_t {
+    Histogram* latency;             // [supported_funcs + 1], the last one for all user functions
+    size_t     bytes[NUM_LAYERS][2];
+    size_t     unknown_type_calls;  // MPI-IO calls with a derived or unnamed datatype
+    double*    bw_bytes[2];         // POSIX bytes per time bin, read and write
+} PerfStats;
+
+/*
+ * Where the size of a call is, decided once per function:
+ * for MPI-IO args[count_arg] elements of datatype args[type_arg],
+ * POSIX calls are left to posix_file_access()
+ */
+typedef struct FuncAccess_t {
+    signed char layer;          // -1 if the call moves no data
+    signed char dir;
+    signed char count_arg, type_arg;
+} FuncAccess;
+
+typedef struct PerfPass_t {
+    RecorderReader* reader;
+    FuncAccess* access;
+    PerfStats*  threads;
+    int         bins;
+    double      t_begin, bin_width;
+} PerfPass;
+
+static int bucket_of(uint64_t v) {
+    if(v < SUB_BUCKETS)
+        return v;
+    if(v >> MAX_TICK_BITS)
+        v = (1ULL << MAX_TICK_BITS) - 1;
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (v >> shift) - SUB_BUCKETS;
+}
+
+// middle of the values of a bucket
+static double bucket_value(int b) {
+    if(b < SUB_BUCKETS)
+        return b;
+    int shift = b / SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(b % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) - 1) / 2.0;
+}
+
+static size_t str2sizet(const char* arg) {
+    size_t res = 0;
+    sscanf(arg, "%zu", &res);
+    return res;
+}
+
+static size_t mpi_type_size(const char* type) {
+    static const struct { const char* name; size_t size; } types[] = {
+        {"MPI_BYTE", 1}, {"MPI_CHAR", 1}, {"MPI_SIGNED_CHAR", 1}, {"MPI_UNSIGNED_CHAR", 1},
+        {"MPI_PACKED", 1}, {"MPI_CHARACTER", 1}, {"MPI_INT8_T", 1}, {"MPI_UINT8_T", 1},
+        {"MPI_SHORT", 2}, {"MPI_UNSIGNED_SHORT", 2}, {"MPI_INT16_T", 2}, {"MPI_UINT16_T", 2},
+        {"MPI_INT", 4}, {"MPI_UNSIGNED", 4}, {"MPI_FLOAT", 4}, {"MPI_INTEGER", 4}, {"MPI_REAL", 4},
+        {"MPI_INT32_T", 4}, {"MPI_UINT32_T", 4},
+        {"MPI_LONG", 8}, {"MPI_UNSIGNED_LONG", 8}, {"MPI_LONG_LONG", 8}, {"MPI_LONG_LONG_INT", 8},
+        {"MPI_UNSIGNED_LONG_LONG", 8}, {"MPI_DOUBLE", 8}, {"MPI_DOUBLE_PRECISION", 8},
+        {"MPI_INT64_T", 8}, {"MPI_UINT64_T", 8}, {"MPI_INTEGER8", 8}, {"MPI_REAL8", 8},
+        {"MPI_LONG_DOUBLE", 16},
+    };
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if(strcmp(type, types[i].name) == 0)
+            return types[i].size;
+    return 0;
+}
+
+/*
+ * POSIX calls are counted by posix_file_access(), record by
+ * record. MPI-IO calls are the MPI_File_read* and
+ * MPI_File_write* calls that take a count and a datatype.
+ */
+static FuncAccess* build_func_access(RecorderReader* reader) {
+    FuncAccess* access = malloc(sizeof(FuncAccess) * reader->supported_funcs);
+    for(int i = 0; i < reader->supported_funcs; i++) {
+        FuncAccess* a = &access[i];
+        const char* func = reader->func_list[i];
+        Record record = {.func_id = i};
+        int type = recorder_get_func_type(reader, &record);
+        a->layer = -1;
+        a->type_arg = -1;
+        a->dir = strstr(func, "read") ? DIR_READ : DIR_WRITE;
+
+        if(type == RECORDER_POSIX) {
+            a->layer = LAYER_POSIX;
+        } else if(type == RECORDER_MPIIO) {
+            if(!strstr(func, "read") && !strstr(func, "write"))
+                continue;
+            if(strstr(func, "_end"))        // split collectives: the size is given at _begin
+                continue;
+            a->layer = LAYER_MPIIO;
+            a->count_arg = strstr(func, "_at") ? 3 : 2;
+            a->type_arg = a->count_arg + 1;
         }
     }
+    return access;
+}
+
+static void add_latency(Histogram* h, double duration, double resolution) {
+    if(h->buckets == NULL)
+        h->buckets = calloc(NUM_BUCKETS, sizeof(uint64_t));
+    uint64_t ticks = duration > 0 ? (uint64_t)(duration / resolution + 0.5) : 0;
+    h->buckets[bucket_of(ticks)]++;
+    h->count++;
+    h->total += duration;
+    if(ticks > h->max)
+        h->max = ticks;
+}
 
-    free(unique_signature);
-    free(call_count);
+// bytes of a call spread over the bins it overlaps
+static void add_bandwidth(PerfPass* pass, double* bins, double tstart, double tend, size_t bytes) {
+    double from = (tstart - pass->t_begin) / pass->bin_width;
+    double to   = (tend - pass->t_begin) / pass->bin_width;
+    int first = from < 0 ? 0 : (int) from;
+    int last  = to < 0 ? 0 : (int) to;
+    if(first >= pass->bins) first = pass->bins - 1;
+    if(last  >= pass->bins) last  = pass->bins - 1;
+    if(first == last || to <= from) {
+        bins[first] += bytes;
+        return;
+    }
+    for(int b = first; b <= last; b++) {
+        double lo = b > from ? b : from, hi = b + 1 < to ? b + 1 : to;
+        bins[b] += bytes * (hi - lo) / (to - from);
+    }
+}
+
+static void perf_record(Record* record, int rank, int thread, void* arg) {
+    PerfPass* pass = (PerfPass*) arg;
+    RecorderReader* reader = pass->reader;
+    PerfStats* ps = &pass->threads[thread];
+
+    bool user_func = record->func_id == RECORDER_USER_FUNCTION;
+    Histogram* h = &ps->latency[user_func ? reader->supported_funcs : record->func_id];
+    add_latency(h, record->tend - record->tstart, reader->metadata.time_resolution);
+    if(user_func)
+        return;
+
+    FuncAccess* a = &pass->access[record->func_id];
+    if(a->layer == LAYER_POSIX) {
+        size_t bytes;
+        int is_read;
+        posix_file_access(reader->func_list[record->func_id], record, &bytes, &is_read);
+        if(is_read < 0)
+            return;
+        int dir = is_read ? DIR_READ : DIR_WRITE;
+        ps->bytes[LAYER_POSIX][dir] += bytes;
+        // the data reaches the file system through POSIX calls
+        add_bandwidth(pass, ps->bw_bytes[dir], record->tstart, record->tend, bytes);
+        return;
+    }
+
+    if(a->layer < 0 || record->arg_count <= a->type_arg)
+        return;
+
+    size_t size = mpi_type_size(record->args[a->type_arg]);
+    if(size == 0) {
+        ps->unknown_type_calls++;
+        return;
+    }
+    ps->bytes[a->layer][a->dir] += str2sizet(record->args[a->count_arg]) * size;
+}
+
+static void alloc_perf_stats(PerfStats* ps, int num_funcs, int bins) {
+    memset(ps, 0, sizeof(PerfStats));
+    ps->latency = calloc(num_funcs, sizeof(Histogram));
+    ps->bw_bytes[DIR_READ]  = calloc(bins, sizeof(double));
+    ps->bw_bytes[DIR_WRITE] = calloc(bins, sizeof(double));
+}
+
+static void free_perf_stats(PerfStats* ps, int num_funcs) {
+    for(int i = 0; i < num_funcs; i++)
+        free(ps->latency[i].buckets);
+    free(ps->latency);
+    free(ps->bw_bytes[DIR_READ]);
+    free(ps->bw_bytes[DIR_WRITE]);
+}
+
+/*
+ * Time span of all ranks, looked up by nthreads threads.
+ * Without recorder.idx this builds the timestamp index of
+ * every rank, which the decode needs first anyway and reuses,
+ * so the timestamps are not inflated more often than by the
+ * decode alone.
+ */
+typedef struct SpanPass_t {
+    RecorderReader* reader;
+    int next_rank;          // next rank to look up, under lock
+    bool found;             // some rank has records
+    double t0, t1;          // first tstart and last tend
+    pthread_mutex_t lock;
+} SpanPass;
+
+static void* span_worker(void* arg) {
+    SpanPass* sp = (SpanPass*) arg;
+    bool found = false;
+    double t0 = 0, t1 = 0;
+    while(true) {
+        pthread_mutex_lock(&sp->lock);
+        int rank = sp->next_rank++;
+        pthread_mutex_unlock(&sp->lock);
+        if(rank >= sp->reader->metadata.total_ranks)
+            break;
+
+        size_t records;
+        double tstart, tend;
+        recorder_get_rank_span(sp->reader, rank, &records, &tstart, &tend);
+        if(records == 0)
+            continue;
+        if(!found || tstart < t0) t0 = tstart;
+        if(!found || tend > t1)   t1 = tend;
+        found = true;
+    }
+
+    pthread_mutex_lock(&sp->lock);
+    if(found) {
+        if(!sp->found || t0 < sp->t0) sp->t0 = t0;
+        if(!sp->found || t1 > sp->t1) sp->t1 = t1;
+        sp->found = true;
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+static void get_job_span(RecorderReader* reader, int nthreads, double* t0, double* t1) {
+    SpanPass sp = {.reader = reader, .next_rank = 0, .found = false, .t0 = 0, .t1 = 0};
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_t* threads = malloc(sizeof(pthread_t) * nthreads);
+    for(int t = 0; t < nthreads; t++)
+        pthread_create(&threads[t], NULL, span_worker, &sp);
+    for(int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+    pthread_mutex_destroy(&sp.lock);
+    *t0 = sp.t0;
+    *t1 = sp.t1;
+}
+
+/*
+ * Decode all ranks with nthreads threads and merge
+ * their statistics into ps, see print_performance()
+ */
+void collect_performance(RecorderReader* reader, int nthreads, int bins, PerfStats* ps,
+                         double* t_begin, double* bin_width) {
+    int nprocs = reader->metadata.total_ranks;
+    int num_funcs = reader->supported_funcs + 1;
+    if(nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > nprocs)
+        nthreads = nprocs;
+    if(nthreads < 1)
+        nthreads = 1;
+
+    // bins cover the whole job, from the first tstart to the last tend
+    double t0, t1;
+    get_job_span(reader, nthreads, &t0, &t1);
+
+    PerfPass pass;
+    pass.reader    = reader;
+    pass.access    = build_func_access(reader);
+    pass.bins      = bins;
+    pass.t_begin   = t0;
+    pass.bin_width = t1 > t0 ? (t1 - t0) / bins : 1;
+    pass.threads   = malloc(sizeof(PerfStats) * nthreads);
+    for(int t = 0; t < nthreads; t++)
+        alloc_perf_stats(&pass.threads[t], num_funcs, bins);
+
+    recorder_decode_records_parallel(reader, NULL, nprocs, nthreads, perf_record, &pass);
+
+    alloc_perf_stats(ps, num_funcs, bins);
+    for(int t = 0; t < nthreads; t++) {
+        PerfStats* src = &pass.threads[t];
+        for(int f = 0; f < num_funcs; f++) {
+            Histogram *h = &ps->latency[f], *s = &src->latency[f];
+            if(s->count == 0)
+                continue;
+            if(h->buckets == NULL)
+                h->buckets = calloc(NUM_BUCKETS, sizeof(uint64_t));
+            for(int b = 0; b < NUM_BUCKETS; b++)
+                h->buckets[b] += s->buckets[b];
+            h->count += s->count;
+            h->total += s->total;
+            if(s->max > h->max)
+                h->max = s->max;
+        }
+        for(int l = 0; l < NUM_LAYERS; l++) {
+            ps->bytes[l][DIR_READ]  += src->bytes[l][DIR_READ];
+            ps->bytes[l][DIR_WRITE] += src->bytes[l][DIR_WRITE];
+        }
+        ps->unknown_type_calls += src->unknown_type_calls;
+        for(int b = 0; b < bins; b++) {
+            ps->bw_bytes[DIR_READ][b]  += src->bw_bytes[DIR_READ][b];
+            ps->bw_bytes[DIR_WRITE][b] += src->bw_bytes[DIR_WRITE][b];
+        }
+        free_perf_stats(src, num_funcs);
+    }
+    free(pass.threads);
+    free(pass.access);
+    *t_begin = pass.t_begin;
+    *bin_width = pass.bin_width;
+}
+
+// latency in seconds below which a fraction q of the calls are
+static double percentile(Histogram* h, double q, double resolution) {
+    size_t rank = (size_t) ceil(q * h->count);
+    if(rank == 0)
+        rank = 1;
+    size_t seen = 0;
+    for(int b = 0; b < NUM_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if(seen >= rank) {
+            double v = bucket_value(b);
+            return (v < h->max ? v : h->max) * resolution;
+        }
+    }
+    return h->max * resolution;
+}
+
+static Histogram* sort_latency;     // for compare_by_time()
+
+static int compare_by_time(const void* a, const void* b) {
+    double ta = sort_latency[*(int*)a].total, tb = sort_latency[*(int*)b].total;
+    if(ta != tb)
+        return ta < tb ? 1 : -1;
+    return *(int*)a - *(int*)b;
+}
+
+// functions that were called, by total time spent in them
+static int* funcs_by_time(RecorderReader* reader, PerfStats* ps, int* num) {
+    int num_funcs = reader->supported_funcs + 1;
+    int* order = malloc(sizeof(int) * num_funcs);
+    *num = 0;
+    for(int f = 0; f < num_funcs; f++)
+        if(ps->latency[f].count > 0)
+            order[(*num)++] = f;
+    sort_latency = ps->latency;
+    qsort(order, *num, sizeof(int), compare_by_time);
+    return order;
+}
+
+static const char* perf_func_name(RecorderReader* reader, int f) {
+    return f == reader->supported_funcs ? "[user functions]" : reader->func_list[f];
+}
+
+void print_performance(RecorderReader* reader, PerfStats* ps, int bins, double t_begin, double bin_width) {
+    double res = reader->metadata.time_resolution;
+
+    printf("\n%-25s %12s %14s %12s %12s %12s %12s\n", "Func", "Calls", "Total (s)",
+           "Mean (us)", "p50 (us)", "p99 (us)", "Max (us)");
+    int num;
+    int* order = funcs_by_time(reader, ps, &num);
+    for(int i = 0; i < num; i++) {
+        Histogram* h = &ps->latency[order[i]];
+        printf("%-25s %12zu %14.6f %12.1f %12.1f %12.1f %12.1f\n", perf_func_name(reader, order[i]),
+               h->count, h->total, h->total / h->count * 1e6, percentile(h, 0.5, res) * 1e6,
+               percentile(h, 0.99, res) * 1e6, h->max * res * 1e6);
+    }
+    free(order);
+
+    printf("\n%-10s %16s %16s\n", "Layer", "Bytes Read", "Bytes Written");
+    printf("%-10s %16zu %16zu\n", "POSIX", ps->bytes[LAYER_POSIX][DIR_READ], ps->bytes[LAYER_POSIX][DIR_WRITE]);
+    printf("%-10s %16zu %16zu\n", "MPI-IO", ps->bytes[LAYER_MPIIO][DIR_READ], ps->bytes[LAYER_MPIIO][DIR_WRITE]);
+    if(ps->unknown_type_calls > 0)
+        printf("MPI-IO calls with a derived datatype, not counted: %zu\n", ps->unknown_type_calls);
+
+    printf("\nPOSIX bandwidth of all ranks, MB/s\n");
+    printf("%-12s %12s %12s\n", "Time (s)", "Read", "Write");
+    for(int b = 0; b < bins; b++)
+        printf("%-12.3f %12.2f %12.2f\n", t_begin + b * bin_width,
+               ps->bw_bytes[DIR_READ][b] / bin_width / 1e6, ps->bw_bytes[DIR_WRITE][b] / bin_width / 1e6);
+}
+
+static void print_json_string(const char* s) {
+    putchar('"');
+    for(; *s; s++) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if(c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+/*
+ * The same report as one JSON object, times in seconds,
+ * the call signatures are given with cst
+ */
+void print_json(RecorderReader* reader, JobStats* js, JobFileStat* files, CST* cst,
+                PerfStats* ps, int bins, double t_begin, double bin_width) {
+    RecorderMetadata* meta = &reader->metadata;
+    printf("{\n  \"metadata\": {\"start_ts\": %.6f, \"total_ranks\": %d, \"time_resolution\": %g, "
+           "\"posix_tracing\": %s, \"mpi_tracing\": %s, \"mpiio_tracing\": %s, \"hdf5_tracing\": %s, "
+           "\"pnetcdf_tracing\": %s, \"netcdf_tracing\": %s, \"interprocess_compression\": %s},\n",
+           meta->start_ts, meta->total_ranks, meta->time_resolution,
+           meta->posix_tracing ? "true" : "false", meta->mpi_tracing ? "true" : "false",
+           meta->mpiio_tracing ? "true" : "false", meta->hdf5_tracing ? "true" : "false",
+           meta->pnetcdf_tracing ? "true" : "false", meta->netcdf_tracing ? "true" : "false",
+           meta->interprocess_compression ? "true" : "false");
+    printf("  \"calls\": {\"total\": %zu, \"POSIX\": %zu, \"MPI\": %zu, \"MPI-IO\": %zu, \"HDF5\": %zu, "
+           "\"PnetCDF\": %zu, \"NetCDF\": %zu, \"user\": %zu},\n",
+           js->total, js->posix, js->mpi, js->mpiio, js->hdf5, js->pnetcdf, js->netcdf, js->user_count);
+
+    printf("  \"functions\": [");
+    bool first = true;
+    for(int i = 0; i < reader->supported_funcs; i++) {
+        if(js->unique_signature[i] == 0 && js->call_count[i] == 0)
+            continue;
+        printf("%s\n    {\"name\": ", first ? "" : ",");
+        print_json_string(reader->func_list[i]);
+        printf(", \"unique_signatures\": %d, \"calls\": %zu}", js->unique_signature[i], js->call_count[i]);
+        first = false;
+    }
+    printf("\n  ]");
+
+    if(files) {
+        printf(",\n  \"files\": [");
+        first = true;
+        JobFileStat *file, *tmp;
+        HASH_ITER(hh, files, file, tmp) {
+            printf("%s\n    {\"name\": ", first ? "" : ",");
+            print_json_string(file->stat.filename);
+            printf(", \"ranks\": %d, \"reads\": %zu, \"writes\": %zu, \"bytes_read\": %zu, \"bytes_written\": %zu}",
+                   file->ranks, file->stat.reads, file->stat.writes, file->stat.bytes_read, file->stat.bytes_written);
+            first = false;
+        }
+        printf("\n  ]");
+    }
+
+    if(cst) {
+        printf(",\n  \"signatures\": [");
+        for(int i = 0; i < cst->entries; i++) {
+            Record* record = reader_cs_to_record(&cst->cs_list[i]);
+            reader_instantiate_args(record, -1);
+            printf("%s\n    {\"name\": ", i ? "," : "");
+            print_json_string(recorder_get_func_name(reader, record));
+            printf(", \"args\": [");
+            bool user_func = (recorder_get_func_type(reader, record) == RECORDER_USER_FUNCTION);
+            for(int arg_id = 0; !user_func && arg_id < record->arg_count; arg_id++) {
+                printf("%s", arg_id ? ", " : "");
+                print_json_string(record->args[arg_id]);
+            }
+            printf("], \"count\": %d}", cst->cs_list[i].count);
+            recorder_free_record(record);
+        }
+        printf("\n  ]");
+    }
+
+    if(ps) {
+        double res = meta->time_resolution;
+        printf(",\n  \"latency\": [");
+        int num;
+        int* order = funcs_by_time(reader, ps, &num);
+        for(int i = 0; i < num; i++) {
+            Histogram* h = &ps->latency[order[i]];
+            printf("%s\n    {\"name\": ", i ? "," : "");
+            print_json_string(perf_func_name(reader, order[i]));
+            printf(", \"calls\": %zu, \"total\": %.9g, \"mean\": %.9g, \"p50\": %.9g, \"p90\": %.9g, "
+                   "\"p99\": %.9g, \"max\": %.9g}", h->count, h->total, h->total / h->count,
+                   percentile(h, 0.5, res), percentile(h, 0.9, res), percentile(h, 0.99, res), h->max * res);
+        }
+        free(order);
+        printf("\n  ],\n");
+        printf("  \"bytes\": {\"POSIX\": {\"read\": %zu, \"written\": %zu}, \"MPI-IO\": {\"read\": %zu, \"written\": %zu, "
+               "\"unknown_type_calls\": %zu}},\n",
+               ps->bytes[LAYER_POSIX][DIR_READ], ps->bytes[LAYER_POSIX][DIR_WRITE],
+               ps->bytes[LAYER_MPIIO][DIR_READ], ps->bytes[LAYER_MPIIO][DIR_WRITE], ps->unknown_type_calls);
+        printf("  \"bandwidth\": {\"start\": %.9g, \"bin_seconds\": %.9g, \"read_bytes\": [", t_begin, bin_width);
+        for(int b = 0; b < bins; b++)
+            printf("%s%.0f", b ? ", " : "", ps->bw_bytes[DIR_READ][b]);
+        printf("], \"write_bytes\": [");
+        for(int b = 0; b < bins; b++)
+            printf("%s%.0f", b ? ", " : "", ps->bw_bytes[DIR_WRITE][b]);
+        printf("]}");
+    }
+    printf("\n}\n");
 }
 
 void print_metadata(RecorderReader* reader) {
@@ -108,30 +683,98 @@ void print_metadata(RecorderReader* reader) {
 }
 
 
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-a] [-f] [-l] [-j] [-t threads] [-b bins] [path to traces]\n"
+                    "  -a  list the call signatures\n"
+                    "  -f  list the files accessed through POSIX calls\n"
+                    "  -l  decode all records for latencies, bytes and bandwidth\n"
+                    "  -j  print the report as JSON\n"
+                    "  -t  threads used by -l, one per core by default\n"
+                    "  -b  time bins of the bandwidth timeline (default %d)\n", prog, DEFAULT_BW_BINS);
+}
+
 int main(int argc, char **argv) {
     bool show_cst = false;
+    bool show_files = false;
+    bool show_perf = false;
+    bool json = false;
+    int nthreads = 0;
+    int bins = DEFAULT_BW_BINS;
     int opt;
-    while ((opt = getopt(argc, argv, "a")) != -1) {
+    while ((opt = getopt(argc, argv, "afljt:b:")) != -1) {
         switch(opt) {
             case 'a':
                 show_cst = true;
                 break;
-            defaut:
-                fprintf(stderr, "Usage: %s [-a] [path to traces]\n", argv[0]);
+            case 'f':
+                show_files = true;
+                break;
+            case 'l':
+                show_perf = true;
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'b':
+                bins = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
     }
+    if (optind >= argc || bins <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
 
     RecorderReader reader;
     recorder_init_reader(argv[optind], &reader);
 
+    // kept loaded while the other ranks are read
+    reader_pin_rank(&reader, 0);
     CST* cst = reader_get_cst(&reader, 0);
-    print_metadata(&reader);
-    print_statistics(&reader, cst);
+    JobFileStat *files = NULL, *file, *tmp;
+    JobStats js;
+    collect_statistics(&reader, cst, &js, &files);
+    HASH_SORT(files, compare_files);
+
+    PerfStats ps;
+    double t_begin = 0, bin_width = 0;
+    if (show_perf)
+        collect_performance(&reader, nthreads, bins, &ps, &t_begin, &bin_width);
+
+    if (json) {
+        print_json(&reader, &js, show_files ? files : NULL, show_cst ? cst : NULL,
+                   show_perf ? &ps : NULL, bins, t_begin, bin_width);
+    } else {
+        print_metadata(&reader);
+        print_statistics(&reader, &js);
+
+        if (show_perf)
+            print_performance(&reader, &ps, bins, t_begin, bin_width);
+
+        if (show_files)
+            print_files(files);
+
+        if (show_cst)
+            print_cst(&reader, cst);
+    }
 
-    if (show_cst) {
-        print_cst(&reader, cst);
+    if (show_perf)
+        free_perf_stats(&ps, reader.supported_funcs + 1);
+    free(js.unique_signature);
+    free(js.call_count);
+    HASH_ITER(hh, files, file, tmp) {
+        HASH_DEL(files, file);
+        free(file->stat.filename);
+        free(file);
     }
 
+    reader_unpin_rank(&reader, 0);
     recorder_free_reader(&reader);
 
     return 0;
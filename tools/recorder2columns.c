@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <mpi.h>
+#include "reader.h"
+
+/*
+ * Convert a trace into fixed-width column files that can be
+ * mapped and scanned directly, e.g., with numpy.memmap(),
+ * without expanding the grammar again for every analysis.
+ *
+ * _columns/
+ *   columns.txt        description: version, rows, ranks, time resolution, columns
+ *   tstart.f64         double, seconds
+ *   tend.f64           double, seconds
+ *   func_id.i32        index in funcs.txt, RECORDER_USER_FUNCTION (255) for user functions
+ *   cs_id.i32          call signature of the record in its rank, see cs.txt
+ *   rank.i32
+ *   tid.u64
+ *   call_depth.u8
+ *   offset.i64         absolute offset of positional calls (pwrite, lseek, MPI_File_write_at, etc.)
+ *                      stored relative to the previous access, see RecordBatch, -1 otherwise
+ *   rank_rows.u64      total_ranks+1 entries, rows of rank r are [rank_rows[r], rank_rows[r+1])
+ *   funcs.txt          function names, one per line
+ *   cs.txt             call signatures, one per line, ordered by rank then cs_id:
+ *                      rank \t cs_id \t func name \t arg \t arg ...
+ *                      with \, tab and newline in args written as \\, \t and \n
+ *   cs_rows.u64        total_ranks+1 entries, line of (rank, cs_id) is cs_rows[rank] + cs_id
+ *
+ * Values are in the byte order of the machine that converted the trace
+ * (given in columns.txt). Row i of every column is the same record,
+ * records of a rank are in the order recorder_decode_records() passes them.
+ *
+ * The number of records of each rank is known from the timestamp headers,
+ * so each rank is written at its place by whichever MPI process and thread
+ * decodes it.
+ */
+
+#define COLUMNS_VERSION 3
+#define BATCH_ROWS      (64*1024)
+
+enum {
+    COL_TSTART, COL_TEND, COL_FUNC_ID, COL_CS_ID,
+    COL_RANK, COL_TID, COL_CALL_DEPTH, COL_OFFSET, NUM_COLUMNS
+};
+
+typedef struct Column_t {
+    const char* file;
+    const char* type;
+    size_t width;           // bytes per row
+    int    fd;
+} Column;
+
+static Column columns[NUM_COLUMNS] = {
+    {"tstart.f64",      "f64", 8, -1},
+    {"tend.f64",        "f64", 8, -1},
+    {"func_id.i32",     "i32", 4, -1},
+    {"cs_id.i32",       "i32", 4, -1},
+    {"rank.i32",        "i32", 4, -1},
+    {"tid.u64",         "u64", 8, -1},
+    {"call_depth.u8",   "u8",  1, -1},
+    {"offset.i64",      "i64", 8, -1},
+};
+
+RecorderReader reader;
+static char columns_dir[1024];
+static uint64_t* rank_rows;         // total_ranks+1 entries
+
+// ranks of this process, taken by the threads largest first
+static int*  tasks;
+static int   num_tasks, next_task;
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct Worker_t {
+    int rank;
+    RecordBatch batch;
+    int32_t*  rank_col;
+    uint64_t* tid_col;
+} Worker;
+
+
+static int open_file(const char* name, int flags) {
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/%s", columns_dir, name);
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
+        perror(path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return fd;
+}
+
+static void write_at(int fd, const void* buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, (const char*)buf + done, size - done, offset + done);
+        if (n < 0) {
+            perror("[Recorder] pwrite");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        done += n;
+    }
+}
+
+static void write_column(int col, const void* values, size_t rows, uint64_t first_row) {
+    Column* c = &columns[col];
+    write_at(c->fd, values, rows * c->width, first_row * c->width);
+}
+
+static void write_batch(RecordBatch* batch, void* arg) {
+    Worker* w = (Worker*) arg;
+    size_t rows = batch->rows;
+    uint64_t row = rank_rows[w->rank] + batch->first;
+    if (row + rows > rank_rows[w->rank+1]) {
+        fprintf(stderr, "[Recorder] rank %d has more records than its timestamps\n", w->rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        w->rank_col[i] = w->rank;
+        w->tid_col[i]  = (uint64_t) batch->tid[i];
+    }
+    write_column(COL_TSTART,     batch->tstart,     rows, row);
+    write_column(COL_TEND,       batch->tend,       rows, row);
+    write_column(COL_FUNC_ID,    batch->func_id,    rows, row);
+    write_column(COL_CS_ID,      batch->cs_id,      rows, row);
+    write_column(COL_RANK,       w->rank_col,       rows, row);
+    write_column(COL_TID,        w->tid_col,        rows, row);
+    write_column(COL_CALL_DEPTH, batch->call_depth, rows, row);
+    write_column(COL_OFFSET,     batch->offset,     rows, row);
+}
+
+static void* column_worker(void* arg) {
+    Worker* w = (Worker*) arg;
+    w->batch.capacity   = BATCH_ROWS;
+    w->batch.tstart     = malloc(sizeof(double) * BATCH_ROWS);
+    w->batch.tend       = malloc(sizeof(double) * BATCH_ROWS);
+    w->batch.func_id    = malloc(sizeof(int) * BATCH_ROWS);
+    w->batch.cs_id      = malloc(sizeof(int) * BATCH_ROWS);
+    w->batch.call_depth = malloc(sizeof(unsigned char) * BATCH_ROWS);
+    w->batch.tid        = malloc(sizeof(pthread_t) * BATCH_ROWS);
+    w->batch.offset     = malloc(sizeof(long long) * BATCH_ROWS);
+    w->rank_col = malloc(sizeof(int32_t) * BATCH_ROWS);
+    w->tid_col  = malloc(sizeof(uint64_t) * BATCH_ROWS);
+
+    while (1) {
+        pthread_mutex_lock(&task_lock);
+        int task = next_task < num_tasks ? next_task++ : -1;
+        pthread_mutex_unlock(&task_lock);
+        if (task < 0)
+            break;
+
+        w->rank = tasks[task];
+        recorder_decode_batch(&reader, w->rank, &w->batch, write_batch, w);
+        printf("\r[Recorder] rank %d finished\n", w->rank);
+    }
+
+    free(w->batch.tstart);
+    free(w->batch.tend);
+    free(w->batch.func_id);
+    free(w->batch.cs_id);
+    free(w->batch.call_depth);
+    free(w->batch.tid);
+    free(w->batch.offset);
+    free(w->rank_col);
+    free(w->tid_col);
+    return NULL;
+}
+
+static size_t* rank_counts;      // records of each rank, for compare_ranks()
+
+static int compare_ranks(const void* a, const void* b) {
+    size_t ca = rank_counts[*(int*)a], cb = rank_counts[*(int*)b];
+    if (ca != cb)
+        return ca < cb ? 1 : -1;
+    return *(int*)a - *(int*)b;
+}
+
+/*
+ * Copy an argument, escaping the separators of cs.txt,
+ * returns the bytes written (at most twice its length)
+ */
+static size_t escape_arg(char* dst, const char* arg) {
+    char* p = dst;
+    for (; *arg; arg++) {
+        switch (*arg) {
+            case '\\': *p++ = '\\'; *p++ = '\\'; break;
+            case '\t': *p++ = '\\'; *p++ = 't'; break;
+            case '\n': *p++ = '\\'; *p++ = 'n'; break;
+            default:   *p++ = *arg;
+        }
+    }
+    return p - dst;
+}
+
+/*
+ * Call signatures of a rank as lines of cs.txt,
+ * returns the text and sets its length and lines
+ */
+static char* cs_lines(int rank, size_t* len, uint64_t* lines) {
+    size_t cap = 4096;
+    char* text = malloc(cap);
+    *len = 0;
+    *lines = 0;
+
+    Record* cs;
+    while ((cs = recorder_get_call_signature(&reader, rank, *lines)) != NULL) {
+        const char* func = recorder_get_func_name(&reader, cs);
+        size_t need = 64 + strlen(func);
+        for (int i = 0; i < cs->arg_count; i++)
+            need += 2 * strlen(cs->args[i]) + 1;
+        if (*len + need > cap) {
+            while (*len + need > cap)
+                cap *= 2;
+            text = realloc(text, cap);
+        }
+
+        *len += sprintf(text + *len, "%d\t%lu\t%s", rank, (unsigned long) *lines, func);
+        for (int i = 0; i < cs->arg_count; i++) {
+            text[(*len)++] = '\t';
+            *len += escape_arg(text + *len, cs->args[i]);
+        }
+        text[(*len)++] = '\n';
+
+        recorder_free_record(cs);
+        (*lines)++;
+    }
+    return text;
+}
+
+/*
+ * Every process has the text of its ranks, the line and byte
+ * counts of all ranks are summed up to place each one in cs.txt
+ */
+static void write_cs_dictionary(int mpi_rank, int mpi_size) {
+    int nprocs = reader.metadata.total_ranks;
+    uint64_t* lines = calloc(nprocs + 1, sizeof(uint64_t));
+    uint64_t* bytes = calloc(nprocs + 1, sizeof(uint64_t));
+    char** texts = calloc(nprocs, sizeof(char*));
+
+    for (int rank = mpi_rank; rank < nprocs; rank += mpi_size) {
+        size_t len;
+        texts[rank] = cs_lines(rank, &len, &lines[rank+1]);
+        bytes[rank+1] = len;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, lines, nprocs + 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, bytes, nprocs + 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    for (int rank = 0; rank < nprocs; rank++) {
+        lines[rank+1] += lines[rank];
+        bytes[rank+1] += bytes[rank];
+    }
+
+    int fd = open_file("cs.txt", O_WRONLY);
+    for (int rank = mpi_rank; rank < nprocs; rank += mpi_size) {
+        write_at(fd, texts[rank], bytes[rank+1] - bytes[rank], bytes[rank]);
+        free(texts[rank]);
+    }
+    close(fd);
+
+    if (mpi_rank == 0) {
+        fd = open_file("cs_rows.u64", O_WRONLY | O_CREAT | O_TRUNC);
+        write_at(fd, lines, sizeof(uint64_t) * (nprocs + 1), 0);
+        close(fd);
+    }
+    free(texts);
+    free(bytes);
+    free(lines);
+}
+
+static void write_description(void) {
+    FILE* f;
+    char path[2048];
+
+    snprintf(path, sizeof(path), "%s/funcs.txt", columns_dir);
+    f = fopen(path, "w");
+    for (int i = 0; i < reader.supported_funcs; i++)
+        fprintf(f, "%s\n", reader.func_list[i]);
+    fclose(f);
+
+    int fd = open_file("rank_rows.u64", O_WRONLY | O_CREAT | O_TRUNC);
+    write_at(fd, rank_rows, sizeof(uint64_t) * (reader.metadata.total_ranks + 1), 0);
+    close(fd);
+
+    uint16_t probe = 1;
+    snprintf(path, sizeof(path), "%s/columns.txt", columns_dir);
+    f = fopen(path, "w");
+    fprintf(f, "version %d\n", COLUMNS_VERSION);
+    fprintf(f, "rows %lu\n", (unsigned long) rank_rows[reader.metadata.total_ranks]);
+    fprintf(f, "ranks %d\n", reader.metadata.total_ranks);
+    fprintf(f, "time_resolution %g\n", reader.metadata.time_resolution);
+    fprintf(f, "byte_order %s\n", *(uint8_t*)&probe ? "little" : "big");
+    for (int col = 0; col < NUM_COLUMNS; col++)
+        fprintf(f, "column %s %s\n", columns[col].file, columns[col].type);
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+
+    int mpi_size, mpi_rank;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+
+    int nthreads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch(opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind >= argc) {
+        if(mpi_rank == 0)
+            fprintf(stderr, "Usage: %s [-t threads per process] [path to traces]\n", argv[0]);
+        MPI_Finalize();
+        return 1;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN) / mpi_size;
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    snprintf(columns_dir, sizeof(columns_dir), "%s/_columns", argv[optind]);
+    if(mpi_rank == 0)
+        mkdir(columns_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    recorder_init_reader(argv[optind], &reader);
+
+    int nprocs = reader.metadata.total_ranks;
+    rank_counts = malloc(sizeof(size_t) * nprocs);
+    rank_rows = malloc(sizeof(uint64_t) * (nprocs + 1));
+    rank_rows[0] = 0;
+    for (int rank = 0; rank < nprocs; rank++) {
+        rank_counts[rank] = recorder_get_num_records(&reader, rank);
+        rank_rows[rank+1] = rank_rows[rank] + rank_counts[rank];
+    }
+
+    // the files are created and sized once, then written at known offsets
+    if (mpi_rank == 0) {
+        for (int col = 0; col < NUM_COLUMNS; col++) {
+            int fd = open_file(columns[col].file, O_WRONLY | O_CREAT | O_TRUNC);
+            if (ftruncate(fd, rank_rows[nprocs] * columns[col].width) != 0) {
+                perror("[Recorder] ftruncate");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            close(fd);
+        }
+        close(open_file("cs.txt", O_WRONLY | O_CREAT | O_TRUNC));
+        write_description();
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    for (int col = 0; col < NUM_COLUMNS; col++)
+        columns[col].fd = open_file(columns[col].file, O_WRONLY);
+
+    tasks = malloc(sizeof(int) * nprocs);
+    num_tasks = 0;
+    for (int rank = mpi_rank; rank < nprocs; rank += mpi_size)
+        tasks[num_tasks++] = rank;
+    qsort(tasks, num_tasks, sizeof(int), compare_ranks);
+    if (nthreads > num_tasks)
+        nthreads = num_tasks > 0 ? num_tasks : 1;
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * nthreads);
+    Worker* workers = calloc(nthreads, sizeof(Worker));
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, column_worker, &workers[i]);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int col = 0; col < NUM_COLUMNS; col++)
+        close(columns[col].fd);
+
+    write_cs_dictionary(mpi_rank, mpi_size);
+
+    free(threads);
+    free(workers);
+    free(tasks);
+    free(rank_rows);
+    free(rank_counts);
+    recorder_free_reader(&reader);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Finalize();
+
+    return 0;
+}
@@ -1,222 +1,305 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include "reader.h"
-#include <parquet/arrow/writer.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 #include <arrow/api.h>
 #include <arrow/io/api.h>
-#include <stdint-gcc.h>
+#include <parquet/arrow/writer.h>
 #include <mpi.h>
+#include "reader.h"
+#include "reader-private.h"
 
-struct ParquetWriter {
-    int rank;
-    char* base_file;
-    int64_t index;
-    arrow::Int32Builder indexBuilder, categoryBuilder, rankBuilder, threadBuilder, arg_countBuilder, levelBuilder;
-    arrow::FloatBuilder tstartBuilder, tendBuilder;
-    arrow::StringBuilder func_idBuilder, args_Builder[10];
-
-    std::shared_ptr<arrow::Array> indexArray, categoryArray, rankArray, threadArray, arg_countArray, levelArray, tstartArray, tendArray,
-            func_idArray, argsArray[10];
-
-    std::shared_ptr<arrow::Schema> schema;
-    const int64_t chunk_size = 1024;
-    const int64_t NUM_ROWS = 1024*1024*64; // 1B
-    int64_t row_group = 0;
-    ParquetWriter(int, char*);
-
-    void finish();
-};
+/*
+ * Each MPI process converts its ranks into two files:
+ *
+ *   _parquet/records_<mpi_rank>.parquet    one row per record
+ *     rank, tid, tstart, tend (float64 seconds), call_depth,
+ *     func, file (dictionary strings), category, cs_id and
+ *     offset (absolute offset when the call signature keeps
+ *     it relative to the previous access, null otherwise)
+ *
+ *   _parquet/cs_<mpi_rank>.parquet         one row per call signature
+ *     rank, cs_id, func, category, args (list of strings)
+ *
+ * Arguments are only stored once per call signature,
+ * join the two tables on (rank, cs_id) to get them.
+ *
+ * Records are decoded into columns of ROW_GROUP_SIZE rows,
+ * each written as a row group of the file right away, so
+ * memory does not grow with the size of the trace.
+ */
+#define ROW_GROUP_SIZE (1024*1024)
 
-ParquetWriter::ParquetWriter(int _rank, char* _path) {
-    rank = _rank;
-    row_group = 0;
-
-    base_file = _path;
-    schema = arrow::schema(
-            {arrow::field("index", arrow::int32()), arrow::field("rank", arrow::int32()),
-             arrow::field("thread_id", arrow::int32()), arrow::field("cat", arrow::int32()),
-             arrow::field("tstart", arrow::float32()), arrow::field("tend", arrow::float32()),
-             arrow::field("func_id", arrow::utf8()), arrow::field("level", arrow::int32()),
-             arrow::field("arg_count", arrow::int32()), arrow::field("args_1", arrow::utf8()),
-             arrow::field("args_2", arrow::utf8()), arrow::field("args_3", arrow::utf8()),
-             arrow::field("args_4", arrow::utf8()), arrow::field("args_5", arrow::utf8()),
-             arrow::field("args_6", arrow::utf8()), arrow::field("args_7", arrow::utf8()),
-             arrow::field("args_8", arrow::utf8()), arrow::field("args_9", arrow::utf8()),
-             arrow::field("args_10", arrow::utf8())});
-    index = 0;
-
-    indexBuilder = arrow::Int32Builder();
-    indexArray.reset();
-    rankBuilder = arrow::Int32Builder();
-    rankArray.reset();
-    threadBuilder = arrow::Int32Builder();
-    threadArray.reset();
-    categoryBuilder = arrow::Int32Builder();
-    categoryArray.reset();
-    arg_countBuilder = arrow::Int32Builder();
-    arg_countArray.reset();
-    levelBuilder = arrow::Int32Builder();
-    levelArray.reset();
-
-    tstartBuilder = arrow::FloatBuilder();
-    tstartArray.reset();
-    tendBuilder = arrow::FloatBuilder();
-    tendArray.reset();
-
-
-    func_idBuilder = arrow::StringBuilder();
-    func_idArray.reset();
-    for (int i =0; i< 10; i++){
-        args_Builder[i] = arrow::StringBuilder();
-        argsArray[i].reset();
+RecorderReader reader;
+
+/*
+ * Strings of a dictionary column, shared by all row groups of a
+ * file. Ids never change once given, so the dictionary written
+ * with a row group is valid for the previous ones too.
+ */
+struct Dictionary {
+    std::unordered_map<std::string, int32_t> ids;
+    std::vector<std::string> values;
+    std::shared_ptr<arrow::Array> array;    // values, rebuilt when it grew
+
+    int32_t id(const char* s) {
+        auto it = ids.find(s);
+        if (it != ids.end())
+            return it->second;
+        int32_t id = values.size();
+        ids.emplace(s, id);
+        values.push_back(s);
+        return id;
     }
-}
 
-void ParquetWriter::finish(void) {
-    indexBuilder.Finish(&indexArray);
-    rankBuilder.Finish(&rankArray);
-    threadBuilder.Finish(&threadArray);
-    tstartBuilder.Finish(&tstartArray);
-    tendBuilder.Finish(&tendArray);
-    func_idBuilder.Finish(&func_idArray);
-    levelBuilder.Finish(&levelArray);
-    categoryBuilder.Finish(&categoryArray);
-    arg_countBuilder.Finish(&arg_countArray);
-    for (int arg_id = 0; arg_id < 10; arg_id++) {
-        args_Builder[arg_id].Finish(&argsArray[arg_id]);
+    std::shared_ptr<arrow::Array> get_array() {
+        if (!array || array->length() != (int64_t) values.size()) {
+            arrow::StringBuilder builder;
+            PARQUET_THROW_NOT_OK(builder.AppendValues(values));
+            PARQUET_THROW_NOT_OK(builder.Finish(&array));
+        }
+        return array;
     }
+};
+
+static std::shared_ptr<arrow::Array> dictionary_column(const std::shared_ptr<arrow::Array>& indices,
+                                                       Dictionary& dict) {
+    PARQUET_ASSIGN_OR_THROW(auto column, arrow::DictionaryArray::FromArrays(
+                arrow::dictionary(arrow::int32(), arrow::utf8()), indices, dict.get_array()));
+    return column;
+}
 
-    auto table = arrow::Table::Make(schema, {indexArray, rankArray,threadArray,categoryArray,
-                                             tstartArray, tendArray,
-                                             func_idArray, levelArray, arg_countArray  ,
-                                             argsArray[0], argsArray[1], argsArray[2],
-                                             argsArray[3], argsArray[4], argsArray[5],
-                                             argsArray[6], argsArray[7], argsArray[8],
-                                             argsArray[9] });
-    char path[256];
-    sprintf(path, "%s_%d.parquet" , base_file, row_group);
+static std::unique_ptr<parquet::arrow::FileWriter> open_parquet(const char* path,
+                                                                const std::shared_ptr<arrow::Schema>& schema) {
     PARQUET_ASSIGN_OR_THROW(auto outfile, arrow::io::FileOutputStream::Open(path));
-    PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(*table, arrow::default_memory_pool(), outfile, 1024));
+    auto props = parquet::WriterProperties::Builder()
+                    .enable_dictionary()
+                    ->compression(parquet::Compression::SNAPPY)
+                    ->max_row_group_length(ROW_GROUP_SIZE)
+                    ->build();
+    // keeps the dictionary types when the files are read back with Arrow
+    auto arrow_props = parquet::ArrowWriterProperties::Builder().store_schema()->build();
+    PARQUET_ASSIGN_OR_THROW(auto writer, parquet::arrow::FileWriter::Open(
+                *schema, arrow::default_memory_pool(), outfile, props, arrow_props));
+    return writer;
 }
 
-RecorderReader reader;
+struct Converter {
+    Dictionary funcs, files;
+    std::shared_ptr<arrow::Schema> records_schema, cs_schema;
+    std::unique_ptr<parquet::arrow::FileWriter> records_file, cs_file;
+
+    // the rank being converted and its call signatures
+    int rank;
+    std::vector<int32_t> cs_func;           // id in funcs
+    std::vector<int32_t> cs_filename;       // id in files, -1 if none
+    std::vector<int8_t>  cs_category;
+
+    Converter(const char* dir);
+    void convert_rank(int rank);
+    void write_records(RecordBatch* batch);
+    void close();
+};
+
+Converter::Converter(const char* dir) {
+    auto dict_type = arrow::dictionary(arrow::int32(), arrow::utf8());
+    records_schema = arrow::schema({
+            arrow::field("rank", arrow::int32(), false),
+            arrow::field("tid", arrow::int64(), false),
+            arrow::field("tstart", arrow::float64(), false),
+            arrow::field("tend", arrow::float64(), false),
+            arrow::field("call_depth", arrow::uint8(), false),
+            arrow::field("func", dict_type, false),
+            arrow::field("file", dict_type),
+            arrow::field("category", arrow::int8(), false),
+            arrow::field("cs_id", arrow::int32(), false),
+            arrow::field("offset", arrow::int64())});
+    cs_schema = arrow::schema({
+            arrow::field("rank", arrow::int32(), false),
+            arrow::field("cs_id", arrow::int32(), false),
+            arrow::field("func", dict_type, false),
+            arrow::field("category", arrow::int8(), false),
+            arrow::field("args", arrow::list(arrow::utf8()), false)});
+
+    int mpi_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/records_%d.parquet", dir, mpi_rank);
+    records_file = open_parquet(path, records_schema);
+    snprintf(path, sizeof(path), "%s/cs_%d.parquet", dir, mpi_rank);
+    cs_file = open_parquet(path, cs_schema);
+}
+
+static void write_batch(RecordBatch* batch, void* arg) {
+    ((Converter*) arg)->write_records(batch);
+}
+
+void Converter::convert_rank(int _rank) {
+    rank = _rank;
+    cs_func.clear();
+    cs_filename.clear();
+    cs_category.clear();
+
+    /*
+     * Write the call signatures of the rank to the CS table, and keep
+     * what the records take from them, so that the columns of a
+     * record are filled from its cs_id alone
+     */
+    arrow::Int32Builder rank_b, cs_id_b, func_b;
+    arrow::Int8Builder category_b;
+    arrow::ListBuilder args_b(arrow::default_memory_pool(), std::make_shared<arrow::StringBuilder>());
+    auto arg_b = static_cast<arrow::StringBuilder*>(args_b.value_builder());
+    int32_t num_cs = 0;
+    Record* cs;
+    while ((cs = recorder_get_call_signature(&reader, rank, num_cs)) != NULL) {
+        const char* func = recorder_get_func_name(&reader, cs);
+        int category = recorder_get_func_type(&reader, cs);
+        const char* filename = NULL;
+        if (category == RECORDER_POSIX) {
+            size_t bytes;
+            int is_read;
+            filename = posix_file_access(func, cs, &bytes, &is_read);
+        }
+        cs_func.push_back(funcs.id(func));
+        cs_filename.push_back(filename ? files.id(filename) : -1);
+        cs_category.push_back(category);
 
-void handle_one_record(Record* record, void* arg) {
-    ParquetWriter *writer = (ParquetWriter*) arg;
-
-    writer->rankBuilder.Append(writer->rank);
-    writer->threadBuilder.Append(record->tid);
-    writer->tstartBuilder.Append(record->tstart);
-    writer->tendBuilder.Append(record->tend);
-    int cat = recorder_get_func_type(&reader, record);
-    if (cat == RECORDER_FTRACE){
-        writer->func_idBuilder.Append(record->args[0]);
-        record->arg_count = 0;
-    }else {
-        writer->func_idBuilder.Append(recorder_get_func_name(&reader, record));
+        PARQUET_THROW_NOT_OK(rank_b.Append(rank));
+        PARQUET_THROW_NOT_OK(cs_id_b.Append(num_cs));
+        PARQUET_THROW_NOT_OK(func_b.Append(cs_func.back()));
+        PARQUET_THROW_NOT_OK(category_b.Append(category));
+        PARQUET_THROW_NOT_OK(args_b.Append());
+        for (int i = 0; i < cs->arg_count; i++)
+            PARQUET_THROW_NOT_OK(arg_b->Append(cs->args[i]));
+        recorder_free_record(cs);
+        num_cs++;
     }
-    writer->categoryBuilder.Append(cat);
-    writer->levelBuilder.Append(record->level);
-    writer->arg_countBuilder.Append(record->arg_count);
 
-    for (int arg_id = 0; arg_id < 10; arg_id++) {
-        if(arg_id < record->arg_count)
-            writer->args_Builder[arg_id].Append(record->args[arg_id]);
-        else
-            writer->args_Builder[arg_id].Append("");
+    std::shared_ptr<arrow::Array> ranks, cs_ids, func_ids, categories, args;
+    PARQUET_THROW_NOT_OK(rank_b.Finish(&ranks));
+    PARQUET_THROW_NOT_OK(cs_id_b.Finish(&cs_ids));
+    PARQUET_THROW_NOT_OK(func_b.Finish(&func_ids));
+    PARQUET_THROW_NOT_OK(category_b.Finish(&categories));
+    PARQUET_THROW_NOT_OK(args_b.Finish(&args));
+    if (num_cs > 0) {
+        auto table = arrow::Table::Make(cs_schema, {ranks, cs_ids, dictionary_column(func_ids, funcs),
+                                                    categories, args}, num_cs);
+        PARQUET_THROW_NOT_OK(cs_file->WriteTable(*table, num_cs));
     }
-    writer->index ++;
-    writer->indexBuilder.Append(writer->index);
-    if(writer->index % writer->NUM_ROWS == 0) {
-        writer->indexBuilder.Finish(&writer->indexArray);
-        writer->rankBuilder.Finish(&writer->rankArray);
-        writer->threadBuilder.Finish(&writer->threadArray);
-        writer->categoryBuilder.Finish(&writer->categoryArray);
-        writer->tstartBuilder.Finish(&writer->tstartArray);
-        writer->tendBuilder.Finish(&writer->tendArray);
-        writer->func_idBuilder.Finish(&writer->func_idArray);
-        writer->levelBuilder.Finish(&writer->levelArray);
-        writer->arg_countBuilder.Finish(&writer->arg_countArray);
-        for (int arg_id = 0; arg_id < 10; arg_id++) {
-            writer->args_Builder[arg_id].Finish(&writer->argsArray[arg_id]);
-        }
 
-        auto table = arrow::Table::Make(writer->schema, {writer->indexArray, writer->rankArray,writer->threadArray, writer->categoryArray,
-                                                         writer->tstartArray, writer->tendArray,
-                                                         writer->func_idArray, writer->levelArray, writer->arg_countArray  ,
-                                                         writer->argsArray[0], writer->argsArray[1], writer->argsArray[2],
-                                                         writer->argsArray[3], writer->argsArray[4], writer->argsArray[5],
-                                                         writer->argsArray[6], writer->argsArray[7], writer->argsArray[8],
-                                                         writer->argsArray[9] });
-        char path[256];
-        sprintf(path, "%s_%d.parquet" , writer->base_file, writer->row_group);
-        PARQUET_ASSIGN_OR_THROW(auto outfile, arrow::io::FileOutputStream::Open(path));
-        PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(*table, arrow::default_memory_pool(), outfile, 1024*1024*128));
-
-        writer->row_group++;
-        writer->indexBuilder = arrow::Int32Builder();
-        writer->indexArray.reset();
-        writer->rankBuilder = arrow::Int32Builder();
-        writer->rankArray.reset();
-        writer->threadBuilder = arrow::Int32Builder();
-        writer->threadArray.reset();
-        writer->categoryBuilder = arrow::Int32Builder();
-        writer->categoryArray.reset();
-        writer->arg_countBuilder = arrow::Int32Builder();
-        writer->arg_countArray.reset();
-        writer->levelBuilder = arrow::Int32Builder();
-        writer->levelArray.reset();
-
-        writer->tstartBuilder = arrow::FloatBuilder();
-        writer->tstartArray.reset();
-        writer->tendBuilder = arrow::FloatBuilder();
-        writer->tendArray.reset();
-
-
-        writer->func_idBuilder = arrow::StringBuilder();
-        writer->func_idArray.reset();
-        for (int i =0; i< 10; i++){
-            writer->args_Builder[i] = arrow::StringBuilder();
-            writer->argsArray[i].reset();
-        }
+    std::vector<double> tstart(ROW_GROUP_SIZE), tend(ROW_GROUP_SIZE);
+    std::vector<int> cs_id(ROW_GROUP_SIZE);
+    std::vector<unsigned char> call_depth(ROW_GROUP_SIZE);
+    std::vector<pthread_t> tid(ROW_GROUP_SIZE);
+    std::vector<long long> offset(ROW_GROUP_SIZE);
+
+    RecordBatch batch = {};
+    batch.capacity   = ROW_GROUP_SIZE;
+    batch.tstart     = tstart.data();
+    batch.tend       = tend.data();
+    batch.cs_id      = cs_id.data();
+    batch.call_depth = call_depth.data();
+    batch.tid        = tid.data();
+    batch.offset     = reader.metadata.intraprocess_pattern_recognition ? offset.data() : NULL;
+    recorder_decode_batch(&reader, rank, &batch, write_batch, this);
+}
+
+void Converter::write_records(RecordBatch* batch) {
+    int64_t rows = batch->rows;
+    arrow::Int32Builder rank_b, func_b, file_b;
+    arrow::Int64Builder tid_b, offset_b;
+    arrow::Int8Builder category_b;
+    PARQUET_THROW_NOT_OK(rank_b.Reserve(rows));
+    PARQUET_THROW_NOT_OK(func_b.Reserve(rows));
+    PARQUET_THROW_NOT_OK(file_b.Reserve(rows));
+    PARQUET_THROW_NOT_OK(tid_b.Reserve(rows));
+    PARQUET_THROW_NOT_OK(offset_b.Reserve(rows));
+    PARQUET_THROW_NOT_OK(category_b.Reserve(rows));
+
+    for (int64_t i = 0; i < rows; i++) {
+        int cs = batch->cs_id[i];
+        rank_b.UnsafeAppend(rank);
+        tid_b.UnsafeAppend((int64_t) batch->tid[i]);
+        func_b.UnsafeAppend(cs_func[cs]);
+        category_b.UnsafeAppend(cs_category[cs]);
+        if (cs_filename[cs] < 0)
+            file_b.UnsafeAppendNull();
+        else
+            file_b.UnsafeAppend(cs_filename[cs]);
+        if (!batch->offset || batch->offset[i] < 0)
+            offset_b.UnsafeAppendNull();
+        else
+            offset_b.UnsafeAppend(batch->offset[i]);
     }
+
+    arrow::DoubleBuilder tstart_b, tend_b;
+    arrow::UInt8Builder call_depth_b;
+    arrow::Int32Builder cs_id_b;
+    PARQUET_THROW_NOT_OK(tstart_b.AppendValues(batch->tstart, rows));
+    PARQUET_THROW_NOT_OK(tend_b.AppendValues(batch->tend, rows));
+    PARQUET_THROW_NOT_OK(call_depth_b.AppendValues(batch->call_depth, rows));
+    PARQUET_THROW_NOT_OK(cs_id_b.AppendValues(batch->cs_id, rows));
+
+    std::shared_ptr<arrow::Array> ranks, tids, tstarts, tends, call_depths,
+                                  func_ids, file_ids, categories, cs_ids, offsets;
+    PARQUET_THROW_NOT_OK(rank_b.Finish(&ranks));
+    PARQUET_THROW_NOT_OK(tid_b.Finish(&tids));
+    PARQUET_THROW_NOT_OK(tstart_b.Finish(&tstarts));
+    PARQUET_THROW_NOT_OK(tend_b.Finish(&tends));
+    PARQUET_THROW_NOT_OK(call_depth_b.Finish(&call_depths));
+    PARQUET_THROW_NOT_OK(func_b.Finish(&func_ids));
+    PARQUET_THROW_NOT_OK(file_b.Finish(&file_ids));
+    PARQUET_THROW_NOT_OK(category_b.Finish(&categories));
+    PARQUET_THROW_NOT_OK(cs_id_b.Finish(&cs_ids));
+    PARQUET_THROW_NOT_OK(offset_b.Finish(&offsets));
+
+    auto table = arrow::Table::Make(records_schema, {
+            ranks, tids, tstarts, tends, call_depths,
+            dictionary_column(func_ids, funcs), dictionary_column(file_ids, files),
+            categories, cs_ids, offsets}, rows);
+    PARQUET_THROW_NOT_OK(records_file->WriteTable(*table, rows));
 }
 
-int min(int a, int b) { return a < b ? a : b; }
-int max(int a, int b) { return a > b ? a : b; }
+void Converter::close() {
+    PARQUET_THROW_NOT_OK(records_file->Close());
+    PARQUET_THROW_NOT_OK(cs_file->Close());
+}
 
 
 int main(int argc, char **argv) {
 
-    char parquet_file_dir[256], parquet_file_path[256];
-    sprintf(parquet_file_dir, "%s/_parquet", argv[1]);
-    mkdir(parquet_file_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     int mpi_size, mpi_rank;
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
 
-    if(mpi_rank == 0)
+    if (argc < 2) {
+        if (mpi_rank == 0)
+            fprintf(stderr, "Usage: %s [path to traces]\n", argv[0]);
+        MPI_Finalize();
+        return 1;
+    }
+
+    char parquet_file_dir[1024];
+    snprintf(parquet_file_dir, sizeof(parquet_file_dir), "%s/_parquet", argv[1]);
+    if (mpi_rank == 0)
         mkdir(parquet_file_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     MPI_Barrier(MPI_COMM_WORLD);
+
     recorder_init_reader(argv[1], &reader);
 
-    // Each rank will process n files (n ranks traces)
-    int n = max(reader.metadata.total_ranks/mpi_size, 1);
-    int start_rank = n * mpi_rank;
-    int end_rank   = min(reader.metadata.total_ranks, n*(mpi_rank+1));
-    sprintf(parquet_file_path, "%s/%d" , parquet_file_dir, mpi_rank);
-
-    ParquetWriter writer(0, parquet_file_path);
-    for(int rank = start_rank; rank < end_rank; rank++) {
-        writer.rank = rank;
-        recorder_decode_records(&reader, rank, handle_one_record, &writer);
-        printf("\r[Recorder] rank %d finished, unique call signatures: %d\n", rank, cst.entries);
+    Converter converter(parquet_file_dir);
+    for (int rank = mpi_rank; rank < reader.metadata.total_ranks; rank += mpi_size) {
+        converter.convert_rank(rank);
+        printf("\r[Recorder] rank %d finished, unique call signatures: %zu\n", rank, converter.cs_func.size());
     }
-    writer.finish();
+    converter.close();
     recorder_free_reader(&reader);
 
     MPI_Barrier(MPI_COMM_WORLD);
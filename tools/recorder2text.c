@@ -1,17 +1,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <math.h>
 #include <mpi.h>
 #include "reader.h"
 
-#define DECIMAL 6
+#define OUTPUT_BUFFER_SIZE (4*1024*1024)
 
 RecorderReader reader;
-static char formatting_record[32];
 static char formatting_fname[128];
+static char textfile_dir[512];
+
+// timestamps are printed with this many decimals
+static int      decimal;
+static uint64_t decimal_scale;          // 10^decimal
+
+/*
+ * Each decoding thread writes the rank it is decoding
+ * into its own buffer, flushed with large write() calls
+ */
+typedef struct TextWriter_t {
+    int    rank;            // rank whose file is open, -1 if none
+    int    fd;
+    size_t used;
+    char*  buf;
+} TextWriter;
+
+static TextWriter* writers;
+static bool* created;       // created[rank]: its text file exists
 
 int digits_count(int n) {
     int digits = 0;
@@ -22,65 +44,262 @@ int digits_count(int n) {
     return digits;
 }
 
-void write_to_textfile(Record *record, void* arg) {
-    FILE* f = (FILE*) arg;
+static void flush_writer(TextWriter* w) {
+    size_t done = 0;
+    while (done < w->used) {
+        ssize_t n = write(w->fd, w->buf + done, w->used - done);
+        if (n < 0) {
+            perror("[Recorder] write");
+            exit(1);
+        }
+        done += n;
+    }
+    w->used = 0;
+}
+
+static void put(TextWriter* w, const char* s, size_t len) {
+    if (w->used + len > OUTPUT_BUFFER_SIZE) {
+        flush_writer(w);
+        if (len > OUTPUT_BUFFER_SIZE) {
+            TextWriter direct = {w->rank, w->fd, len, (char*) s};
+            flush_writer(&direct);
+            return;
+        }
+    }
+    memcpy(w->buf + w->used, s, len);
+    w->used += len;
+}
+
+static void put_str(TextWriter* w, const char* s) {
+    put(w, s, strlen(s));
+}
+
+// digits of v at the end of the buffer ending at p, returns the first one
+static char* format_uint(char* p, uint64_t v) {
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    return p;
+}
+
+static void put_int(TextWriter* w, int v) {
+    char tmp[16];
+    char* end = tmp + sizeof(tmp);
+    char* p = format_uint(end, v < 0 ? -(int64_t)v : v);
+    if (v < 0)
+        *--p = '-';
+    put(w, p, end - p);
+}
+
+/*
+ * Same digits as printf("%.*f", decimal, t): timestamps
+ * are multiples of the time resolution, so they are never
+ * halfway between two printed values
+ */
+static void put_time(TextWriter* w, double t) {
+    char tmp[64];
+    if (t < 0 || t * decimal_scale >= 1e18) {
+        int len = snprintf(tmp, sizeof(tmp), "%.*f", decimal, t);
+        put(w, tmp, len);
+        return;
+    }
+
+    uint64_t v = (uint64_t)(t * decimal_scale + 0.5);
+    char* end = tmp + sizeof(tmp);
+    char* p = end;
+    if (decimal > 0) {
+        uint64_t frac = v % decimal_scale;
+        for (int i = 0; i < decimal; i++) {
+            *--p = '0' + frac % 10;
+            frac /= 10;
+        }
+        *--p = '.';
+    }
+    p = format_uint(p, v / decimal_scale);
+    put(w, p, end - p);
+}
+
+static void close_rank(TextWriter* w) {
+    if (w->rank < 0)
+        return;
+    flush_writer(w);
+    close(w->fd);
+    printf("\r[Recorder] rank %d finished\n", w->rank);
+    w->rank = -1;
+}
+
+static void open_rank(TextWriter* w, int rank) {
+    close_rank(w);
+
+    char textfile_path[1024];
+    sprintf(textfile_path, formatting_fname, textfile_dir, rank);
+    w->fd = open(textfile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        perror(textfile_path);
+        exit(1);
+    }
+    w->rank = rank;
+    created[rank] = true;
+}
+
+void write_to_textfile(Record *record, int rank, int thread, void* arg) {
+    TextWriter* w = &writers[thread];
+    if (w->rank != rank)
+        open_rank(w, rank);
 
     bool user_func = (record->func_id == RECORDER_USER_FUNCTION);
 
     const char* func_name = recorder_get_func_name(&reader, record);
 
-    fprintf(f, formatting_record, record->tstart, record->tend, // record->tid
-                             func_name, record->call_depth, recorder_get_func_type(&reader, record));
+    // tstart tend func_name call_depth func_type ( args )
+    put_time(w, record->tstart);
+    put(w, " ", 1);
+    put_time(w, record->tend);
+    put(w, " ", 1);
+    put_str(w, func_name);
+    put(w, " ", 1);
+    put_int(w, record->call_depth);
+    put(w, " ", 1);
+    put_int(w, recorder_get_func_type(&reader, record));
+    put(w, " (", 2);
 
     for(int arg_id = 0; !user_func && arg_id < record->arg_count; arg_id++) {
-        char *arg = record->args[arg_id];
-        fprintf(f, " %s", arg);
+        put(w, " ", 1);
+        put_str(w, record->args[arg_id]);
     }
 
-    fprintf(f, " )\n");
+    put(w, " )\n", 3);
 }
 
+static size_t* rank_counts;      // records of each rank, for compare_ranks()
 
-int min(int a, int b) { return a < b ? a : b; }
-int max(int a, int b) { return a > b ? a : b; }
+static int compare_ranks(const void* a, const void* b) {
+    size_t ca = rank_counts[*(int*)a], cb = rank_counts[*(int*)b];
+    if (ca != cb)
+        return ca < cb ? 1 : -1;
+    return *(int*)a - *(int*)b;
+}
 
-int main(int argc, char **argv) {
+/*
+ * Ranks are given to the MPI processes largest first, each to
+ * the least loaded process so far. All processes compute the
+ * same assignment from the record counts of the ranks.
+ */
+static int* assign_ranks(int mpi_size, int mpi_rank, int* num_ranks) {
+    int nprocs = reader.metadata.total_ranks;
+    size_t* counts = malloc(sizeof(size_t) * nprocs);
+    int* order = malloc(sizeof(int) * nprocs);
+    for (int rank = 0; rank < nprocs; rank++) {
+        counts[rank] = recorder_get_num_records(&reader, rank);
+        order[rank] = rank;
+    }
+    rank_counts = counts;
+    qsort(order, nprocs, sizeof(int), compare_ranks);
 
-    char textfile_dir[512];
-    char textfile_path[1024];
-    snprintf(textfile_dir, sizeof(textfile_dir), "%s/_text", argv[1]);
+    size_t* load = calloc(mpi_size, sizeof(size_t));
+    int* mine = malloc(sizeof(int) * nprocs);
+    *num_ranks = 0;
+    for (int i = 0; i < nprocs; i++) {
+        int target = 0;
+        for (int p = 1; p < mpi_size; p++)
+            if (load[p] < load[target])
+                target = p;
+        // count empty ranks too, each one still writes a file
+        load[target] += counts[order[i]] + 1;
+        if (target == mpi_rank)
+            mine[(*num_ranks)++] = order[i];
+    }
+
+    free(load);
+    free(order);
+    free(counts);
+    return mine;
+}
+
+// one thread per core, shared by the MPI processes of a node
+static int default_threads() {
+    int local_size = 1;
+#if MPI_VERSION >= 3
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &local_size);
+    MPI_Comm_free(&node_comm);
+#endif
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN) / local_size;
+    return nthreads > 0 ? nthreads : 1;
+}
+
+int main(int argc, char **argv) {
 
     int mpi_size, mpi_rank;
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
 
+    int nthreads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch(opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            default:
+                if(mpi_rank == 0)
+                    fprintf(stderr, "Usage: %s [-t threads per process] [path to traces]\n", argv[0]);
+                MPI_Finalize();
+                return 1;
+        }
+    }
+    if (nthreads <= 0)
+        nthreads = default_threads();
+
+    snprintf(textfile_dir, sizeof(textfile_dir), "%s/_text", argv[optind]);
+
     if(mpi_rank == 0)
         mkdir(textfile_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     MPI_Barrier(MPI_COMM_WORLD);
 
-    recorder_init_reader(argv[1], &reader);
+    recorder_init_reader(argv[optind], &reader);
 
-    int decimal =  log10(1 / reader.metadata.time_resolution);
-    sprintf(formatting_record, "%%.%df %%.%df %%s %%d %%d (", decimal, decimal);
+    decimal =  log10(1 / reader.metadata.time_resolution);
+    decimal_scale = 1;
+    for (int i = 0; i < decimal; i++)
+        decimal_scale *= 10;
     sprintf(formatting_fname,  "%%s/%%0%dd.txt", digits_count(reader.metadata.total_ranks));
 
-    // Each rank will process n files (n ranks traces)
-    int n = max(reader.metadata.total_ranks/mpi_size, 1);
-    int start_rank = n * mpi_rank;
-    int end_rank   = min(reader.metadata.total_ranks, n*(mpi_rank+1));
+    int num_ranks;
+    int* ranks = assign_ranks(mpi_size, mpi_rank, &num_ranks);
+    if (nthreads > num_ranks)
+        nthreads = num_ranks > 0 ? num_ranks : 1;
 
-    for(int rank = start_rank; rank < end_rank; rank++) {
-        sprintf(textfile_path, formatting_fname, textfile_dir, rank);
-        FILE* fout = fopen(textfile_path, "w");
+    created = calloc(reader.metadata.total_ranks, sizeof(bool));
+    writers = malloc(sizeof(TextWriter) * nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        writers[i].rank = -1;
+        writers[i].used = 0;
+        writers[i].buf  = malloc(OUTPUT_BUFFER_SIZE);
+    }
 
-        recorder_decode_records(&reader, rank, write_to_textfile, fout);
+    if (num_ranks > 0)
+        recorder_decode_records_parallel(&reader, ranks, num_ranks, nthreads, write_to_textfile, NULL);
 
-        fclose(fout);
+    for (int i = 0; i < nthreads; i++)
+        close_rank(&writers[i]);
 
-        printf("\r[Recorder] rank %d finished\n", rank);
+    // ranks without records still get their (empty) file
+    for (int i = 0; i < num_ranks; i++) {
+        if (!created[ranks[i]]) {
+            open_rank(&writers[0], ranks[i]);
+            close_rank(&writers[0]);
+        }
     }
 
+    for (int i = 0; i < nthreads; i++)
+        free(writers[i].buf);
+    free(writers);
+    free(created);
+    free(ranks);
     recorder_free_reader(&reader);
 
     MPI_Barrier(MPI_COMM_WORLD);
@@ -1,25 +1,54 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "reader.h"
 #include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
 #include <assert.h>
 #include <mpi.h>
-#include <ostream>
-#include <sstream>
-#include <fstream>
 #include <iostream>
-#include <iomanip>
+
+#define OUTPUT_BUFFER_SIZE (4*1024*1024)
 
 RecorderReader reader;
 
-struct Writer{
-    std::ofstream outFile;
-    const char* sep;
-    int rank, my_rank, total_ranks;
+/*
+ * Which records go into the timeline: top-level calls and
+ * the POSIX, MPI-IO and HDF5 calls they make, optionally
+ * only some functions and only those starting in [t0, t1)
+ */
+struct Filter {
+    double t0 = 0, t1 = INFINITY;
+    std::set<std::string> funcs;        // empty for all functions
 };
 
+static Filter filter;
+
+static bool keep_call(Record* record) {
+    int cat = recorder_get_func_type(&reader, record);
+    if (!(record->call_depth == 0 || cat == RECORDER_POSIX || cat == RECORDER_MPIIO || cat == RECORDER_HDF5))
+        return false;
+    if (filter.funcs.empty())
+        return true;
+    const char* func_name = recorder_get_func_name(&reader, record);
+    if (record->func_id == RECORDER_USER_FUNCTION)
+        func_name = record->args[0];
+    return filter.funcs.count(func_name) > 0;
+}
+
+static bool select_call(Record* cs, void* arg) {
+    return keep_call(cs);
+}
+
 static const char* type_name(int type) {
     switch (type) {
         case RECORDER_POSIX:
@@ -37,102 +66,555 @@ static const char* type_name(int type) {
     }
 }
 
-struct timeline_ts{
-    double value;
+/*
+ * Each thread of a rank is a Perfetto track written as its own
+ * packet sequence, whose events default to that track and
+ * refer to names and arguments interned on the sequence
+ */
+struct Sequence {
+    pthread_t tid;
+    uint32_t id;                    // trusted_packet_sequence_id
+    uint64_t track_uuid;
+    std::vector<bool> names, cats;  // interned func ids and categories
+    std::unordered_map<std::string, uint64_t> args;
+    size_t arg_hits;
+    bool intern_args;
+    uint64_t ticks;                 // time of the last packet, see write_time()
+    std::vector<std::pair<double, int>> open;   // tend and call depth of the
+                                                // open slices, innermost last
+};
+
+/*
+ * Output of one MPI process, appended to out
+ * and written once it holds a few MB
+ */
+struct Writer {
+    FILE* file;
+    std::string out;
+    int rank;
+
+    // Chrome JSON
+    const char* sep;
+
+    // Perfetto, see write_to_perfetto()
+    uint32_t num_sequences;
+    std::vector<struct Sequence> threads;   // of the current rank
+
+    void flush() {
+        fwrite(out.data(), 1, out.size(), file);
+        out.clear();
+    }
+    void maybe_flush() {
+        if (out.size() >= OUTPUT_BUFFER_SIZE)
+            flush();
+    }
 };
-std::ostream&
-operator<<( std::ostream&      out,
-            const timeline_ts& ts )
-{
-    std::ios oldState(nullptr);
-    oldState.copyfmt(out);
-
-    // Chrome traces are always in micro seconds and Recorder timestamps in
-    // seconds. No need to use the timer resolution from the trace to convert
-    // to microseconds.
-    out << std::fixed << std::setw(5) << std::setprecision(3) << (ts.value * 1e6);
-    out.copyfmt(oldState);
-
-    return out;
-}
-
-void write_to_json(Record *record, void* arg) {
-
-   int cat = recorder_get_func_type(&reader, record);
-   if (record->call_depth == 0 || (cat == 0 || cat == 1 || cat == 3)) {
-        Writer *writer = (Writer *) arg;
-        bool user_func = (record->func_id == RECORDER_USER_FUNCTION);
-        const char *func_name = recorder_get_func_name(&reader, record);
-
-        if (user_func)
-            func_name = record->args[0];
-        std::stringstream ss;
-        ss  << writer->sep
-            << "{\"pid\":"      << writer->rank
-            << ",\"tid\":"      << record->tid
-            << ",\"ts\":"       << timeline_ts{record->tstart}
-            << ",\"name\":\""   << func_name
-            << "\",\"cat\":\""  << type_name(cat)
-            << "\",\"ph\":\"X\""
-            << ",\"dur\":"      << timeline_ts{record->tend - record->tstart}
-            << ",\"args\":{";
-        if (!user_func) {
-            ss  << "\"args\":[";
-            const char* sep = "";
+
+static void append_uint(std::string& s, uint64_t v) {
+    char tmp[24];
+    char* end = tmp + sizeof(tmp);
+    char* p = end;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    s.append(p, end - p);
+}
+
+/*
+ * Chrome traces are always in micro seconds and Recorder timestamps in
+ * seconds. Only the decimals the trace resolution can set are written,
+ * e.g., one for the default 0.1 us, at most three as "%.3f" would.
+ */
+static int us_decimals = 3;
+
+static void append_us(std::string& s, double seconds) {
+    static const uint64_t scale[] = {1, 10, 100, 1000};
+    double us = seconds * 1e6;
+    if (!(us >= 0 && us < 1e15)) {
+        char tmp[64];
+        int len = snprintf(tmp, sizeof(tmp), "%.*f", us_decimals, us);
+        s.append(tmp, len);
+        return;
+    }
+    uint64_t m = scale[us_decimals];
+    uint64_t v = (uint64_t)(us * m + 0.5);
+    append_uint(s, v / m);
+    if (us_decimals == 0)
+        return;
+    char frac[4] = {'.'};
+    for (int i = us_decimals, r = v % m; i > 0; i--, r /= 10)
+        frac[i] = '0' + r % 10;
+    s.append(frac, us_decimals + 1);
+}
+
+static void append_json_string(std::string& s, const char* str) {
+    s.push_back('"');
+    for (const char* c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            s.push_back('\\');
+            s.push_back(*c);
+        } else if ((unsigned char)*c < 0x20) {
+            char tmp[8];
+            snprintf(tmp, sizeof(tmp), "\\u%04x", *c);
+            s.append(tmp);
+        } else {
+            s.push_back(*c);
+        }
+    }
+    s.push_back('"');
+}
+
+void write_to_json(Record *record, Writer* writer) {
+    int cat = recorder_get_func_type(&reader, record);
+    bool user_func = (record->func_id == RECORDER_USER_FUNCTION);
+    const char *func_name = recorder_get_func_name(&reader, record);
+    if (user_func)
+        func_name = record->args[0];
+
+    std::string& s = writer->out;
+    s += writer->sep;
+    s += "{\"pid\":";
+    append_uint(s, writer->rank);
+    s += ",\"tid\":";
+    append_uint(s, (uint64_t) record->tid);
+    s += ",\"ts\":";
+    append_us(s, record->tstart);
+    s += ",\"dur\":";
+    append_us(s, record->tend - record->tstart);
+    s += ",\"name\":";
+    append_json_string(s, func_name);
+    s += ",\"cat\":\"";
+    s += type_name(cat);
+    s += "\",\"ph\":\"X\"";
+    if (!user_func && record->arg_count > 0) {
+        s += ",\"args\":{\"args\":[";
+        for (int arg_id = 0; arg_id < record->arg_count; arg_id++) {
+            if (arg_id)
+                s.push_back(',');
+            append_json_string(s, record->args[arg_id]);
+        }
+        s += "]}";
+    }
+    s.push_back('}');
+    writer->sep = ",\n";
+    writer->maybe_flush();
+}
+
+
+/*
+ * Minimal protobuf encoding of the Perfetto trace format
+ * (protos/perfetto/trace/trace_packet.proto), enough for
+ * track descriptors and track events
+ */
+struct Proto {
+    std::string buf;
+
+    void clear() { buf.clear(); }
+    void varint(uint64_t v) {
+        while (v >= 0x80) {
+            buf.push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back(char(v));
+    }
+    void tag(int field, int wire_type) { varint((uint64_t)field << 3 | wire_type); }
+    void uint(int field, uint64_t v)  { tag(field, 0); varint(v); }
+    void bytes(int field, const char* s, size_t len) {
+        tag(field, 2);
+        varint(len);
+        buf.append(s, len);
+    }
+    void str(int field, const char* s) { bytes(field, s, strlen(s)); }
+    void message(int field, const Proto& m) { bytes(field, m.buf.data(), m.buf.size()); }
+};
+
+// field numbers of the Perfetto protos
+enum {
+    TRACE_PACKET                    = 1,
+    PACKET_CLOCK_SNAPSHOT           = 6,
+    PACKET_TIMESTAMP                = 8,
+    PACKET_SEQUENCE_ID              = 10,
+    PACKET_TRACK_EVENT              = 11,
+    PACKET_INTERNED_DATA            = 12,
+    PACKET_SEQUENCE_FLAGS           = 13,
+    PACKET_DEFAULTS                 = 59,
+    PACKET_TRACK_DESCRIPTOR         = 60,
+    DEFAULTS_TRACK_EVENT            = 11,
+    DEFAULTS_CLOCK_ID               = 58,
+    SNAPSHOT_CLOCKS                 = 1,
+    CLOCK_ID                        = 1,
+    CLOCK_TIMESTAMP                 = 2,
+    CLOCK_IS_INCREMENTAL            = 3,
+    CLOCK_UNIT_NS                   = 4,
+    TRACK_UUID                      = 1,
+    TRACK_NAME                      = 2,
+    TRACK_PARENT_UUID               = 5,
+    EVENT_CATEGORY_IIDS             = 3,
+    EVENT_DEBUG_ANNOTATIONS         = 4,
+    EVENT_TYPE                      = 9,
+    EVENT_NAME_IID                  = 10,
+    EVENT_TRACK_UUID                = 11,
+    EVENT_NAME                      = 23,
+    INTERNED_EVENT_CATEGORIES       = 1,
+    INTERNED_EVENT_NAMES            = 2,
+    INTERNED_ANNOTATION_NAMES       = 3,
+    INTERNED_ANNOTATION_STRINGS     = 29,
+    INTERNED_IID                    = 1,
+    INTERNED_NAME                   = 2,
+    ANNOTATION_NAME_IID             = 1,
+    ANNOTATION_STRING_VALUE         = 6,
+    ANNOTATION_STRING_VALUE_IID     = 17,
+};
+enum { SLICE_BEGIN = 1, SLICE_END = 2 };
+enum { SEQ_INCREMENTAL_STATE_CLEARED = 1, SEQ_NEEDS_INCREMENTAL_STATE = 2 };
+enum { PERFETTO_CLOCK_BOOTTIME = 6, PERFETTO_CLOCK_INCREMENTAL = 64 };
+
+// packet timestamps count ticks of the trace resolution
+// since the previous packet of the sequence
+static uint64_t tick_ns;
+
+// arguments are interned while they repeat, i.e., until more
+// than this many of them are new and most of them are new
+// (e.g., offsets that differ in every call)
+#define MIN_INTERNED_ARGS 4096
+
+static Proto packet, event, interned, scratch, item;
+
+static void write_packet(Writer* writer) {
+    Proto trace;
+    trace.buf.swap(writer->out);
+    trace.message(TRACE_PACKET, packet);
+    trace.buf.swap(writer->out);
+    packet.clear();
+    writer->maybe_flush();
+}
+
+// a rank is a track, each of its threads a track below it
+static uint64_t rank_track_uuid(int rank) {
+    return (uint64_t)(rank + 1) << 32;
+}
+
+static void write_track(Writer* writer, uint64_t uuid, uint64_t parent_uuid, const char* name) {
+    scratch.clear();
+    scratch.uint(TRACK_UUID, uuid);
+    scratch.str(TRACK_NAME, name);
+    if (parent_uuid)
+        scratch.uint(TRACK_PARENT_UUID, parent_uuid);
+    packet.message(PACKET_TRACK_DESCRIPTOR, scratch);
+}
+
+// events of a sequence are written in time order, see close_slices()
+static void write_time(Sequence* seq, double t) {
+    uint64_t ticks = llround(t * 1e9 / tick_ns);
+    if (ticks < seq->ticks)
+        ticks = seq->ticks;
+    packet.uint(PACKET_TIMESTAMP, ticks - seq->ticks);
+    seq->ticks = ticks;
+}
+
+static void write_slice_end(Writer* writer, Sequence* seq, double tend) {
+    event.clear();
+    event.uint(EVENT_TYPE, SLICE_END);
+    write_time(seq, tend);
+    packet.message(PACKET_TRACK_EVENT, event);
+    packet.uint(PACKET_SEQUENCE_ID, seq->id);
+    packet.uint(PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+    write_packet(writer);
+}
+
+/*
+ * Close the slices of a thread that end before a call starting
+ * at t, or that are not its callers. Timestamps are rounded to
+ * the trace resolution, so consecutive calls can overlap by a
+ * tick; the earlier one is then ended at t.
+ */
+static void close_slices(Writer* writer, Sequence* seq, double t, int call_depth) {
+    while (!seq->open.empty() &&
+           (seq->open.back().first <= t || seq->open.back().second >= call_depth)) {
+        write_slice_end(writer, seq, std::min(seq->open.back().first, t));
+        seq->open.pop_back();
+    }
+}
+
+static Sequence* thread_sequence(Writer* writer, pthread_t tid) {
+    for (Sequence& seq : writer->threads)
+        if (pthread_equal(seq.tid, tid))
+            return &seq;
+
+    int thread = writer->threads.size();
+    writer->threads.emplace_back();
+    Sequence* seq = &writer->threads.back();
+    seq->tid        = tid;
+    seq->id         = ++writer->num_sequences;
+    seq->ticks      = 0;
+    seq->arg_hits   = 0;
+    seq->intern_args = true;
+    seq->track_uuid = rank_track_uuid(writer->rank) | (uint64_t)(thread + 1);
+    seq->names.assign(reader.supported_funcs, false);
+    seq->cats.assign(RECORDER_NETCDF + 1, false);
+
+    // the first packet of the sequence describes its track,
+    // makes it the default track of its events and starts
+    // the incremental clock of their timestamps at 0
+    char name[64];
+    sprintf(name, "Thread %d", thread);
+    write_track(writer, seq->track_uuid, rank_track_uuid(writer->rank), name);
+    scratch.clear();
+    scratch.uint(EVENT_TRACK_UUID, seq->track_uuid);
+    item.clear();
+    item.message(DEFAULTS_TRACK_EVENT, scratch);
+    item.uint(DEFAULTS_CLOCK_ID, PERFETTO_CLOCK_INCREMENTAL);
+    packet.message(PACKET_DEFAULTS, item);
+
+    Proto snapshot;
+    scratch.clear();
+    scratch.uint(CLOCK_ID, PERFETTO_CLOCK_INCREMENTAL);
+    scratch.uint(CLOCK_TIMESTAMP, 0);
+    scratch.uint(CLOCK_IS_INCREMENTAL, 1);
+    scratch.uint(CLOCK_UNIT_NS, tick_ns);
+    snapshot.message(SNAPSHOT_CLOCKS, scratch);
+    scratch.clear();
+    scratch.uint(CLOCK_ID, PERFETTO_CLOCK_BOOTTIME);
+    scratch.uint(CLOCK_TIMESTAMP, 0);
+    snapshot.message(SNAPSHOT_CLOCKS, scratch);
+    packet.message(PACKET_CLOCK_SNAPSHOT, snapshot);
+    packet.uint(PACKET_SEQUENCE_ID, seq->id);
+    packet.uint(PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+    write_packet(writer);
+
+    // the name of the single debug annotation
+    item.clear();
+    item.uint(INTERNED_IID, 1);
+    item.str(INTERNED_NAME, "args");
+    interned.clear();
+    interned.message(INTERNED_ANNOTATION_NAMES, item);
+    packet.message(PACKET_INTERNED_DATA, interned);
+    packet.uint(PACKET_SEQUENCE_ID, seq->id);
+    packet.uint(PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+    write_packet(writer);
+    return seq;
+}
+
+/*
+ * Records of a thread nest, so each one is a slice begun at
+ * tstart and ended once a later record starts after its tend.
+ * Function names, categories and arguments are interned on
+ * the sequence of the thread the first time they are used.
+ */
+void write_to_perfetto(Record* record, Writer* writer) {
+    Sequence* seq = thread_sequence(writer, record->tid);
+    close_slices(writer, seq, record->tstart, record->call_depth);
+
+    int cat = recorder_get_func_type(&reader, record);
+    bool user_func = (record->func_id == RECORDER_USER_FUNCTION);
+
+    interned.clear();
+    event.clear();
+    event.uint(EVENT_TYPE, SLICE_BEGIN);
+
+    if (!seq->cats[cat]) {
+        item.clear();
+        item.uint(INTERNED_IID, cat + 1);
+        item.str(INTERNED_NAME, type_name(cat));
+        interned.message(INTERNED_EVENT_CATEGORIES, item);
+        seq->cats[cat] = true;
+    }
+    event.uint(EVENT_CATEGORY_IIDS, cat + 1);
+
+    if (user_func) {
+        event.str(EVENT_NAME, record->args[0]);
+    } else {
+        if (!seq->names[record->func_id]) {
+            item.clear();
+            item.uint(INTERNED_IID, record->func_id + 1);
+            item.str(INTERNED_NAME, recorder_get_func_name(&reader, record));
+            interned.message(INTERNED_EVENT_NAMES, item);
+            seq->names[record->func_id] = true;
+        }
+        event.uint(EVENT_NAME_IID, record->func_id + 1);
+
+        if (record->arg_count > 0) {
+            std::string args;
             for (int arg_id = 0; arg_id < record->arg_count; arg_id++) {
-                char *arg = record->args[arg_id];
-                ss << sep << "\"" << arg << "\"";
-                sep = ",";
+                if (arg_id)
+                    args.push_back(' ');
+                args += record->args[arg_id];
+            }
+
+            scratch.clear();
+            scratch.uint(ANNOTATION_NAME_IID, 1);
+            auto it = seq->intern_args ? seq->args.find(args) : seq->args.end();
+            if (it != seq->args.end()) {
+                scratch.uint(ANNOTATION_STRING_VALUE_IID, it->second);
+                seq->arg_hits++;
+            } else if (seq->intern_args) {
+                uint64_t iid = seq->args.size() + 1;
+                item.clear();
+                item.uint(INTERNED_IID, iid);
+                item.bytes(INTERNED_NAME, args.data(), args.size());
+                interned.message(INTERNED_ANNOTATION_STRINGS, item);
+                seq->args.emplace(args, iid);
+                scratch.uint(ANNOTATION_STRING_VALUE_IID, iid);
+                if (seq->args.size() > MIN_INTERNED_ARGS && seq->arg_hits < seq->args.size()) {
+                    seq->intern_args = false;
+                    seq->args.clear();
+                }
+            } else {
+                scratch.bytes(ANNOTATION_STRING_VALUE, args.data(), args.size());
             }
-            ss  << "],";
+            event.message(EVENT_DEBUG_ANNOTATIONS, scratch);
         }
-        ss << "\"tend\": \"" << record->tend << "\"}}";
-        writer->outFile << ss.rdbuf();
-        writer->sep = ",\n";
     }
+
+    write_time(seq, record->tstart);
+    packet.message(PACKET_TRACK_EVENT, event);
+    if (!interned.buf.empty())
+        packet.message(PACKET_INTERNED_DATA, interned);
+    packet.uint(PACKET_SEQUENCE_ID, seq->id);
+    packet.uint(PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+    write_packet(writer);
+
+    // a callee ends with its caller at the latest
+    double tend = record->tend;
+    if (!seq->open.empty() && seq->open.back().first < tend)
+        tend = seq->open.back().first;
+    seq->open.emplace_back(tend, record->call_depth);
+}
+
+static bool perfetto = false;
+
+static void write_record(Record* record, Writer* writer) {
+    if (perfetto)
+        write_to_perfetto(record, writer);
+    else
+        write_to_json(record, writer);
 }
 
-int min(int a, int b) { return a < b ? a : b; }
-int max(int a, int b) { return a > b ? a : b; }
+// records of a time window, filtered one by one
+static void write_windowed(Record* record, void* arg) {
+    if (keep_call(record))
+        write_record(record, (Writer*) arg);
+}
+
+// records of the selected call signatures only
+static void write_selected(Record* record, size_t index, void* arg) {
+    if (record->tstart >= filter.t0 && record->tstart < filter.t1)
+        write_record(record, (Writer*) arg);
+}
+
+static void convert_rank(Writer* writer, int rank) {
+    writer->rank = rank;
+    if (perfetto) {
+        char name[64];
+        sprintf(name, "Rank %d", rank);
+        write_track(writer, rank_track_uuid(rank), 0, name);
+        write_packet(writer);
+        writer->threads.clear();
+    }
+
+    if (filter.t0 > 0 || filter.t1 < INFINITY) {
+        recorder_decode_time_window(&reader, rank, filter.t0, filter.t1, write_windowed, writer);
+    } else {
+        bool* selected = recorder_select_call_signatures(&reader, rank, select_call, NULL);
+        recorder_decode_records_filtered(&reader, rank, selected, write_selected, writer);
+        free(selected);
+    }
+
+    for (Sequence& seq : writer->threads)
+        close_slices(writer, &seq, INFINITY, 0);
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [-p] [-s t0] [-e t1] [-f func1,func2,...] <directory-of-recorder.mt>\n"
+              << "  -p  write Perfetto protobuf traces instead of Chrome JSON\n"
+              << "  -s  only calls starting at or after t0 (seconds)\n"
+              << "  -e  only calls starting before t1 (seconds)\n"
+              << "  -f  only these functions\n";
+    std::exit(1);
+}
 
 int main(int argc, char **argv) {
 
-    if(argc!=2) {
-        std::cerr << "Usage: " << argv[0] << " <directory-of-recorder.mt>\n";
-        std::exit(1);
+    int opt;
+    while ((opt = getopt(argc, argv, "ps:e:f:")) != -1) {
+        switch(opt) {
+            case 'p':
+                perfetto = true;
+                break;
+            case 's':
+                filter.t0 = atof(optarg);
+                break;
+            case 'e':
+                filter.t1 = atof(optarg);
+                break;
+            case 'f': {
+                std::string funcs(optarg);
+                size_t start = 0, end;
+                do {
+                    end = funcs.find(',', start);
+                    std::string func = funcs.substr(start, end == std::string::npos ? end : end - start);
+                    if (!func.empty())
+                        filter.funcs.insert(func);
+                    start = end + 1;
+                } while (end != std::string::npos);
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
     }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    const char* traces_dir = argv[optind];
 
     int mpi_size, mpi_rank;
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
 
-    char textfile_dir[256];
-    sprintf(textfile_dir, "%s/_chrome", argv[1]);
+    char textfile_dir[1024];
+    snprintf(textfile_dir, sizeof(textfile_dir), "%s/_chrome", traces_dir);
 
     if(mpi_rank == 0)
         mkdir(textfile_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     MPI_Barrier(MPI_COMM_WORLD);
 
-    recorder_init_reader(argv[1], &reader);
+    recorder_init_reader(traces_dir, &reader);
 
-    // Each rank will process n files (n ranks traces)
-    int n = max(reader.metadata.total_ranks/mpi_size, 1);
-    int start_rank = n * mpi_rank;
-    int end_rank   = min(reader.metadata.total_ranks, n*(mpi_rank+1));
-    char textfile_path[256];
-    sprintf(textfile_path, "%s/timeline_%d.json", textfile_dir, mpi_rank);
+    char textfile_path[1100];
+    snprintf(textfile_path, sizeof(textfile_path), "%s/timeline_%d.%s", textfile_dir, mpi_rank,
+             perfetto ? "perfetto-trace" : "json");
     Writer local;
-    local.outFile.open(textfile_path, std::ofstream::trunc|std::ofstream::out);
-    local.outFile << "{\"traceEvents\": [\n";
+    local.file = fopen(textfile_path, "w");
+    if (local.file == NULL) {
+        perror(textfile_path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    local.out.reserve(OUTPUT_BUFFER_SIZE + 64*1024);
     local.sep = "";
-    for(int rank = start_rank; rank < end_rank; rank++) {
-        local.rank = rank;
-        recorder_decode_records(&reader, rank, write_to_json, &local);
+    local.num_sequences = 0;
+    tick_ns = llround(reader.metadata.time_resolution * 1e9);
+    if (tick_ns == 0)
+        tick_ns = 1;
+    double tick_us = reader.metadata.time_resolution * 1e6;
+    for (us_decimals = 0; us_decimals < 3 && tick_us < 0.999; us_decimals++)
+        tick_us *= 10;
+
+    if (!perfetto)
+        local.out += "{\"traceEvents\": [\n";
+
+    // ranks are dealt round-robin, so none is left
+    // out when mpi_size does not divide total_ranks
+    for(int rank = mpi_rank; rank < reader.metadata.total_ranks; rank += mpi_size) {
+        convert_rank(&local, rank);
         printf("\r[Recorder] rank %d finished, %s\n", rank, textfile_path);
     }
-    local.outFile << "],\n\"displayTimeUnit\": \"ms\",\"systemTraceEvents\": \"SystemTraceData\",\"otherData\": {\"version\": \"Taxonomy v1.0\" }, \"stackFrames\": {}, \"samples\": []}\n";
-    local.outFile.close();
+
+    if (!perfetto)
+        local.out += "],\n\"displayTimeUnit\": \"ms\",\"systemTraceEvents\": \"SystemTraceData\",\"otherData\": {\"version\": \"Taxonomy v1.0\" }, \"stackFrames\": {}, \"samples\": []}\n";
+    local.flush();
+    fclose(local.file);
     recorder_free_reader(&reader);
 
     MPI_Barrier(MPI_COMM_WORLD);